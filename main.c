@@ -10,47 +10,90 @@
  *   3. Builds a parent->children relationship in memory
  *   4. Reads namespace info from /proc/<pid>/ns/* (or
  *      /proc/<pid>/task/<tid>/ns)
- *   5. Prints a tree starting from PID 1 (init), recursively printing children
+ *   5. Walks the tree once starting from PID 1 (init), handing every visited
+ *      node to each configured output sink (tree, NDJSON, metrics)
  *   6. Only prints namespace references if they differ from the parent's
  *
  *****************************************************************************/
 
+#define _GNU_SOURCE /* O_PATH, pread() friends */
+
 #include <ctype.h>
-#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <limits.h>
+#include <linux/nsfs.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #define MAX_NAMESPACES                                                         \
   10 /* Typical: ipc, uts, net, pid, user, mnt, cgroup, etc. */
 #define MAX_TYPE_LEN 32
 #define MAX_INODE_LEN 64
-#define LINKPATH_LEN (PATH_MAX + NAME_MAX + 2)
+#define MAX_SINKS 16
+#define SINK_FLUSH_THRESHOLD (64 * 1024)
 
 /**
  * struct NamespaceEntry - Represents a single namespace symlink target
- * @type:  Namespace type string, e.g., "net"
- * @inode: Full symlink target, e.g., "net:[4026531840]"
+ * @type:    Namespace type string, e.g., "net"
+ * @inode:   Full symlink target, e.g., "net:[4026531840]"
+ * @ino:     The numeric inode inside the brackets, e.g., 4026531840
+ * @typeIdx: Index of the symlink name in g_nsTypes, or -1 if unknown
  *
  * The kernel symbolic link for a namespace looks like:
  *   /proc/<pid>/ns/net -> net:[4026531840]
  * This struct captures both the short type ("net") and the entire target
- * string ("net:[4026531840]").
+ * string ("net:[4026531840]"). Note that @type comes from the target, so
+ * "pid_for_children" reports "pid"; @typeIdx comes from the link name and
+ * tells the two apart.
  */
 typedef struct {
   char type[MAX_TYPE_LEN];
   char inode[MAX_INODE_LEN];
+  unsigned long long ino;
+  int typeIdx;
 } NamespaceEntry;
 
+/*
+ * Namespace link names under /proc/<pid>/ns, in readdir-independent order.
+ * The *_for_children entries mirror pid and time and are not counted as
+ * distinct namespaces of their own.
+ */
+static const char *const g_nsTypes[] = {
+    "cgroup", "ipc",  "mnt",  "net",  "pid", "pid_for_children",
+    "time",   "time_for_children", "user", "uts"};
+#define NS_TYPE_COUNT (sizeof(g_nsTypes) / sizeof(g_nsTypes[0]))
+
 /**
  * struct ProcInfo - Holds basic process metadata and a list of its children
  * @pid:        The process PID (or thread TID if isThread=1)
  * @ppid:       The parent PID
  * @comm:       The command name (extracted robustly from /proc/<pid>/stat)
+ * @starttime:  Start time in clock ticks since boot (field 22 of stat);
+ *              together with @pid it identifies a task across PID reuse
+ * @numThreads: Threads in the thread group (field 20 of stat)
  * @isThread:   Non-zero if this is a thread, zero if a main process
  * @namespaces: Array storing up to MAX_NAMESPACES for each process
  * @nsCount:    Number of namespaces actually read
@@ -58,21 +101,48 @@ typedef struct {
  * @children:   Dynamic array of pointers to child ProcInfo structs
  * @childCount: How many children this process has
  * @keep:       Used to determine if this process is shown after filters
+ * @lastSeen:   Watch mode: the tick in which this task was last listed
+ * @fdSlot:     Watch mode: 1-based slot in the fd cache, 0 if not cached
+ * @queryMask:  Watch mode: event subscribers whose standing query it matches
+ * @epochSlot:  Watch mode: 1-based slot in the --query-socket snapshots,
+ *              0 if it has none yet
+ * @collapsed:  TUI: the subtree below this task is folded away
  */
 typedef struct ProcInfo {
   pid_t pid;
   pid_t ppid;
   char comm[256];
+  unsigned long long starttime;
+  long numThreads;
   int isThread;
+  unsigned long long cpuTime;      /* utime + stime, clock ticks */
+  unsigned long long childCpuTime; /* cutime + cstime of reaped children */
+  unsigned long long cpuDelta;     /* cpuTime used since the last tick */
+  unsigned long long childCpuDelta;
+  long rssPages;
 
   NamespaceEntry namespaces[MAX_NAMESPACES];
   size_t nsCount;
   int nsReadable;
 
+  struct ProcInfo *parent;
   struct ProcInfo **children;
   size_t childCount;
 
   int keep;
+  unsigned long lastSeen;
+  size_t fdSlot;
+  unsigned long long queryMask;
+  size_t epochSlot;
+  int collapsed;
+
+  /* Watch mode render cache, see render_tree() */
+  int renderValid;
+  int renderedKeep;
+  int renderIsLast;
+  size_t renderDepth;
+  unsigned long long renderPrefixHash;
+  struct RenderSpan *spans;
 } ProcInfo;
 
 /* Global dynamic list of all processes/threads discovered. */
@@ -81,9 +151,31 @@ static size_t g_procCount = 0;    /* how many entries used */
 static size_t g_procCapacity = 0; /* allocated capacity */
 static int g_unreadableFound = 0; /* track unreadable ns */
 
+/*
+ * --rescue: the one-shot scan and rendering run entirely from static
+ * arrays sized at build time, so nstree still works when malloc() fails,
+ * and links into a small static binary for an initramfs. Tasks beyond
+ * RESCUE_MAX_TASKS are counted and reported instead of stored.
+ */
+#ifndef RESCUE_MAX_TASKS
+#define RESCUE_MAX_TASKS 8192 /* must be a power of two */
+#endif
+static int g_rescue = 0;
+static size_t g_rescueDropped = 0; /* tasks that did not fit */
+static ProcInfo g_rescueTasks[RESCUE_MAX_TASKS];
+static ProcInfo *g_rescueChildren[RESCUE_MAX_TASKS];
+
 /* By default, do NOT show threads. Can be overridden with --show-threads/-t */
 static int show_threads = 0;
 
+/*
+ * --sample=RATE: scan each thread with this probability (1 = all). The
+ * choice is a hash of the TID and a per-run seed, so it is uniform but
+ * stable across watch ticks.
+ */
+static double g_sampleRate = 1.0;
+static unsigned long long g_sampleSeed = 0;
+
 /* List of namespace filters. If none are specified, we show everything. */
 static const char *g_filters[32];
 static size_t g_filterCount = 0;
@@ -105,6 +197,57 @@ static int is_number(const char *s) {
   return 1;
 }
 
+/**
+ * ns_type_index - Map a /proc/<pid>/ns link name to its g_nsTypes index
+ * @name: Link name, e.g. "net" or "pid_for_children"
+ *
+ * Return: index into g_nsTypes, or -1 for types this build does not know.
+ */
+static int ns_type_index(const char *name) {
+  for (size_t i = 0; i < NS_TYPE_COUNT; i++) {
+    if (strcmp(g_nsTypes[i], name) == 0)
+      return (int)i;
+  }
+  return -1;
+}
+
+#define NS_TYPE_MASK_ALL ((1u << NS_TYPE_COUNT) - 1)
+
+/**
+ * parse_ns_type_mask - Parse a comma separated list of namespace types
+ * @list: e.g. "net,user"; "*" or an empty list selects every type
+ * @mask: Output bit mask over g_nsTypes
+ *
+ * Return: 0 on success, -1 if a type is unknown.
+ */
+static int parse_ns_type_mask(const char *list, unsigned int *mask) {
+  unsigned int m = 0;
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s", list);
+
+  char *save = NULL;
+  for (char *tok = strtok_r(buf, ", \t\r\n", &save); tok;
+       tok = strtok_r(NULL, ", \t\r\n", &save)) {
+    if (strcmp(tok, "*") == 0) {
+      m = NS_TYPE_MASK_ALL;
+      continue;
+    }
+    int t = ns_type_index(tok);
+    if (t < 0)
+      return -1;
+    m |= 1u << t;
+  }
+  *mask = m ? m : NS_TYPE_MASK_ALL;
+  return 0;
+}
+
+/**
+ * ns_hash - Hash a namespace inode into a power-of-two sized table
+ */
+static size_t ns_hash(unsigned long long ino, size_t cap) {
+  return (size_t)(ino * 0x9E3779B97F4A7C15ULL >> 21) & (cap - 1);
+}
+
 /**
  * parse_namespace_symlink - Parse a namespace symlink target
  * @linkTarget: Symlink target string, e.g., "net:[4026531840]"
@@ -130,57 +273,118 @@ static void parse_namespace_symlink(const char *linkTarget,
   } else {
     snprintf(ns->type, sizeof(ns->type), "%s", linkTarget);
   }
+
+  /* Pull the inode number out of the brackets, if present */
+  const char *bracket = strchr(linkTarget, '[');
+  ns->ino = bracket ? strtoull(bracket + 1, NULL, 10) : 0;
 }
 
 /**
- * read_namespaces - Read namespace symlinks from /proc/<pid>/ns/*
- * @proc: Pointer to the ProcInfo struct for the given PID (or TID)
- * @pidPath: The /proc path to read from, e.g. "/proc/1234" or
- *           "/proc/1234/task/5678"
+ * struct DirStream - Directory reader over getdents64() with its own buffer
+ * @fd:  The open directory
+ * @len: Bytes of directory entries in @buf
+ * @pos: Offset of the next entry in @buf
  *
- * This function reads each file in `pidPath/ns/`, which are
- * symbolic links representing the process (or thread) namespaces.
+ * Unlike opendir(), this never touches the heap, so the scan keeps working
+ * when malloc() does not (see --rescue). Lives on the caller's stack.
  */
-static void read_namespaces(ProcInfo *proc, const char *pidPath) {
-  char nsPath[PATH_MAX];
-  snprintf(nsPath, sizeof(nsPath), "%s/ns", pidPath);
+typedef struct {
+  int fd;
+  size_t len;
+  size_t pos;
+  char buf[4096];
+} DirStream;
+
+/* Layout of the records getdents64() fills in */
+typedef struct {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+} LinuxDirent64;
+
+static int dirstream_open(DirStream *d, int dirFd, const char *path) {
+  d->fd = openat(dirFd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  d->len = d->pos = 0;
+  return d->fd < 0 ? -1 : 0;
+}
+
+/* Return the next entry name (never "." or ".."), or NULL at the end */
+static const char *dirstream_next(DirStream *d) {
+  for (;;) {
+    if (d->pos >= d->len) {
+      long n = syscall(SYS_getdents64, d->fd, d->buf, sizeof(d->buf));
+      if (n <= 0)
+        return NULL;
+      d->len = (size_t)n;
+      d->pos = 0;
+    }
+    LinuxDirent64 *ent = (LinuxDirent64 *)(d->buf + d->pos);
+    d->pos += ent->d_reclen;
+    if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+      return ent->d_name;
+  }
+}
 
+static void dirstream_close(DirStream *d) { close(d->fd); }
+
+/**
+ * read_namespaces_at - Read namespace symlinks from an ns directory
+ * @proc:   Pointer to the ProcInfo struct for the given PID (or TID)
+ * @dirFd:  Directory @nsPath is relative to, or AT_FDCWD
+ * @nsPath: The ns directory, e.g. "ns" relative to an open /proc/<pid>
+ *          directory, or "/proc/1234/ns"
+ *
+ * Each link is read relative to the opened ns directory, so no full path
+ * is resolved per namespace.
+ */
+static void read_namespaces_at(ProcInfo *proc, int dirFd,
+                               const char *nsPath) {
   proc->nsReadable = 0;
 
-  DIR *dir = opendir(nsPath);
-  if (!dir) {
+  DirStream dir;
+  if (dirstream_open(&dir, dirFd, nsPath) != 0) {
     proc->nsCount = 0;
     g_unreadableFound = 1;
     return;
   }
 
-  struct dirent *entry;
+  const char *name;
   size_t idx = 0;
 
-  while ((entry = readdir(dir)) != NULL && idx < MAX_NAMESPACES) {
-    /* Skip . and .. */
-    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
-      continue;
-
-    /* Build the path to the namespace symlink */
-    char linkPath[LINKPATH_LEN];
-    snprintf(linkPath, sizeof(linkPath), "%s/%s", nsPath, entry->d_name);
-
+  while (idx < MAX_NAMESPACES && (name = dirstream_next(&dir)) != NULL) {
     /* Read the symlink target, e.g., "net:[4026531840]" */
     char linkTarget[256];
-    ssize_t len = readlink(linkPath, linkTarget, sizeof(linkTarget) - 1);
+    ssize_t len = readlinkat(dir.fd, name, linkTarget, sizeof(linkTarget) - 1);
     if (len != -1) {
       linkTarget[len] = '\0';
       parse_namespace_symlink(linkTarget, &proc->namespaces[idx]);
+      proc->namespaces[idx].typeIdx = ns_type_index(name);
       idx++;
     }
   }
 
-  closedir(dir);
+  dirstream_close(&dir);
   proc->nsReadable = 1;
   proc->nsCount = idx;
 }
 
+/**
+ * read_namespaces - Read namespace symlinks from /proc/<pid>/ns/*
+ * @proc: Pointer to the ProcInfo struct for the given PID (or TID)
+ * @pidPath: The /proc path to read from, e.g. "/proc/1234" or
+ *           "/proc/1234/task/5678"
+ *
+ * This function reads each file in `pidPath/ns/`, which are
+ * symbolic links representing the process (or thread) namespaces.
+ */
+static void read_namespaces(ProcInfo *proc, const char *pidPath) {
+  char nsPath[PATH_MAX];
+  snprintf(nsPath, sizeof(nsPath), "%s/ns", pidPath);
+  read_namespaces_at(proc, AT_FDCWD, nsPath);
+}
+
 /**
  * parse_proc_stat_line - Parse a line from /proc/<pid>/stat
  * @line:   The entire line read from /proc/<pid>/stat
@@ -188,7 +392,8 @@ static void read_namespaces(ProcInfo *proc, const char *pidPath) {
  *
  * The /proc/<pid>/stat file has a format where the process name
  * (comm) is in parentheses, which can contain parentheses themselves.
- * This function extracts the PID, command name (comm), and the PPID.
+ * This function extracts the PID, command name (comm), the PPID, the CPU
+ * times, the start time and the resident set size.
  */
 static void parse_proc_stat_line(const char *line, ProcInfo *pInfo) {
   /* 1) Parse the PID from the start of the line */
@@ -224,8 +429,20 @@ static void parse_proc_stat_line(const char *line, ProcInfo *pInfo) {
 
     char stateChar;
     int ppidVal = 0;
-    sscanf(rest, "%c %d", &stateChar, &ppidVal);
+    long numThreads = 0;
+    unsigned long long starttime = 0, utime = 0, stime = 0;
+    long long cutime = 0, cstime = 0;
+    sscanf(rest,
+           "%c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %lld %lld "
+           "%*d %*d %ld %*d %llu %*u %ld",
+           &stateChar, &ppidVal, &utime, &stime, &cutime, &cstime,
+           &numThreads, &starttime, &pInfo->rssPages);
+    pInfo->cpuTime = utime + stime;
+    if (cutime + cstime > 0)
+      pInfo->childCpuTime = (unsigned long long)(cutime + cstime);
     pInfo->ppid = (pid_t)ppidVal;
+    pInfo->numThreads = numThreads;
+    pInfo->starttime = starttime;
   }
 }
 
@@ -246,29 +463,116 @@ static void ensure_capacity(void) {
 }
 
 /**
- * read_proc_info - Fill a ProcInfo struct for a given stat file path
- * @statPath: e.g. "/proc/<pid>/stat" or "/proc/<pid>/task/<tid>/stat"
- * @isThread: 0 = main process, 1 = thread
+ * struct PidIndex - Open-addressing map from PID/TID to g_processes index
+ * @keys: PIDs, 0 marks an empty slot (PID 0 never appears in /proc)
+ * @vals: Index into g_processes for the PID in the same slot
+ * @cap:  Number of slots, always a power of two
  *
- * This function opens the specified stat file, parses it for
- * the PID, PPID, and command name. Then calls read_namespaces().
+ * PIDs and TIDs share one number space, so a single map covers both
+ * processes and threads.
  */
-static void read_proc_info(const char *statPath, int isThread) {
-  FILE *fp = fopen(statPath, "r");
-  if (!fp)
-    return;
+typedef struct {
+  pid_t *keys;
+  size_t *vals;
+  size_t cap;
+} PidIndex;
 
-  char line[1024];
-  if (!fgets(line, sizeof(line), fp)) {
-    fclose(fp);
-    return;
+static PidIndex g_pidIndex;
+
+static size_t pid_hash(pid_t pid, size_t cap) {
+  return (size_t)((unsigned long long)(unsigned int)pid *
+                  0x9E3779B97F4A7C15ULL >> 17) &
+         (cap - 1);
+}
+
+/**
+ * pid_index_insert - Map @pid to g_processes[@idx]
+ *
+ * The map is kept at most half full; it is sized from g_procCapacity so
+ * appending a task never needs more than one growth step.
+ */
+static void pid_index_insert(pid_t pid, size_t idx) {
+  if (g_pidIndex.cap < g_procCapacity * 2) {
+    size_t newCap = g_pidIndex.cap ? g_pidIndex.cap : 256;
+    while (newCap < g_procCapacity * 2)
+      newCap *= 2;
+    pid_t *keys = calloc(newCap, sizeof(*keys));
+    size_t *vals = malloc(newCap * sizeof(*vals));
+    if (!keys || !vals) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < g_pidIndex.cap; i++) {
+      if (!g_pidIndex.keys[i])
+        continue;
+      size_t h = pid_hash(g_pidIndex.keys[i], newCap);
+      while (keys[h])
+        h = (h + 1) & (newCap - 1);
+      keys[h] = g_pidIndex.keys[i];
+      vals[h] = g_pidIndex.vals[i];
+    }
+    free(g_pidIndex.keys);
+    free(g_pidIndex.vals);
+    g_pidIndex.keys = keys;
+    g_pidIndex.vals = vals;
+    g_pidIndex.cap = newCap;
   }
-  fclose(fp);
 
-  /* We'll store it in g_processes[g_procCount]. */
-  ensure_capacity();
-  ProcInfo *pInfo = &g_processes[g_procCount];
+  size_t h = pid_hash(pid, g_pidIndex.cap);
+  while (g_pidIndex.keys[h] && g_pidIndex.keys[h] != pid)
+    h = (h + 1) & (g_pidIndex.cap - 1);
+  g_pidIndex.keys[h] = pid;
+  g_pidIndex.vals[h] = idx;
+}
 
+/**
+ * pid_index_find - Look up the g_processes index of @pid
+ *
+ * Return: the index, or -1 if @pid is not in the table.
+ */
+static ssize_t pid_index_find(pid_t pid) {
+  if (!g_pidIndex.cap || pid <= 0)
+    return -1;
+  size_t h = pid_hash(pid, g_pidIndex.cap);
+  while (g_pidIndex.keys[h]) {
+    if (g_pidIndex.keys[h] == pid)
+      return (ssize_t)g_pidIndex.vals[h];
+    h = (h + 1) & (g_pidIndex.cap - 1);
+  }
+  return -1;
+}
+
+/**
+ * pid_index_rebuild - Re-index g_processes from scratch
+ *
+ * Needed whenever entries are moved, e.g. after watch mode compacts away
+ * exited tasks.
+ */
+static void pid_index_rebuild(void) {
+  if (!g_rescue && g_pidIndex.cap > 256 &&
+      g_pidIndex.cap > g_procCapacity * 8) {
+    /* The table shrank; let pid_index_insert() size the index again */
+    free(g_pidIndex.keys);
+    free(g_pidIndex.vals);
+    g_pidIndex.keys = NULL;
+    g_pidIndex.vals = NULL;
+    g_pidIndex.cap = 0;
+  }
+  if (g_pidIndex.cap)
+    memset(g_pidIndex.keys, 0, g_pidIndex.cap * sizeof(*g_pidIndex.keys));
+  for (size_t i = 0; i < g_procCount; i++)
+    pid_index_insert(g_processes[i].pid, i);
+}
+
+/**
+ * init_from_stat_line - Initialize @pInfo from the contents of a stat file
+ * @line:     The stat line; modified in place while parsing
+ * @isThread: 0 = main process, 1 = thread
+ * @tgid:     For threads, the thread group leader shown as the parent
+ * @pInfo:    Entry to fill; everything but the namespaces is initialized
+ */
+static void init_from_stat_line(char *line, int isThread, pid_t tgid,
+                                ProcInfo *pInfo) {
   /* Initialize fields */
   memset(pInfo, 0, sizeof(*pInfo));
   pInfo->isThread = isThread;
@@ -280,143 +584,358 @@ static void read_proc_info(const char *statPath, int isThread) {
   parse_proc_stat_line(line, pInfo);
 
   /*
-   * Build the corresponding "directory path" to read namespaces.
-   * e.g. if statPath is "/proc/1234/task/5678/stat",
-   * then pidPath is "/proc/1234/task/5678".
+   * If this entry is for a thread, override ppid so that
+   * all threads are shown under the main PID (like pstree).
    */
-  char pidPath[PATH_MAX];
-  strncpy(pidPath, statPath, sizeof(pidPath));
-  pidPath[sizeof(pidPath) - 1] = '\0';
+  if (isThread)
+    pInfo->ppid = tgid;
+}
+
+/**
+ * read_stat_file - Read and parse one stat file into @pInfo
+ * @statPath: e.g. "/proc/<pid>/stat" or "/proc/<pid>/task/<tid>/stat"
+ * @isThread: 0 = main process, 1 = thread
+ * @pInfo:    Entry to fill; everything but the namespaces is initialized
+ *
+ * Return: 0 on success, -1 if the task is gone or the file is unreadable.
+ */
+static int read_stat_file(const char *statPath, int isThread,
+                          ProcInfo *pInfo) {
+  int fd = open(statPath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  /* A single read() returns the whole (short) stat file */
+  char line[1024];
+  ssize_t n = read(fd, line, sizeof(line) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  line[n] = '\0';
+
+  /*
+   * statPath is something like: "/proc/1234/task/5678/stat"
+   * We'll parse out "1234" as the parent PID of a thread.
+   */
+  pid_t tgid = (pid_t)atoi(statPath + 6); /* skip "/proc/" */
+  init_from_stat_line(line, isThread, tgid, pInfo);
+  return 0;
+}
+
+/**
+ * stat_path_to_dir - Derive the task directory from a stat file path
+ * @statPath: e.g. "/proc/1234/task/5678/stat"
+ * @pidPath:  Output buffer of PATH_MAX bytes, e.g. "/proc/1234/task/5678"
+ */
+static void stat_path_to_dir(const char *statPath, char *pidPath) {
+  snprintf(pidPath, PATH_MAX, "%s", statPath);
 
   /* Chop off "/stat" from the end. */
   char *slashStat = strstr(pidPath, "/stat");
   if (slashStat)
     *slashStat = '\0';
+}
 
-  read_namespaces(pInfo, pidPath);
+/**
+ * read_proc_info - Fill a ProcInfo struct for a given stat file path
+ * @statPath: e.g. "/proc/<pid>/stat" or "/proc/<pid>/task/<tid>/stat"
+ * @isThread: 0 = main process, 1 = thread
+ *
+ * This function opens the specified stat file, parses it for
+ * the PID, PPID, and command name. Then calls read_namespaces().
+ */
+static void read_proc_info(const char *statPath, int isThread) {
+  if (g_rescue && g_procCount == g_procCapacity) {
+    g_rescueDropped++;
+    return;
+  }
+
+  /* We'll store it in g_processes[g_procCount]. */
+  ensure_capacity();
+  ProcInfo *pInfo = &g_processes[g_procCount];
+
+  if (read_stat_file(statPath, isThread, pInfo) != 0)
+    return;
 
   /*
-   * If this entry is for a thread, override ppid so that
-   * all threads are shown under the main PID (like pstree).
+   * Build the corresponding "directory path" to read namespaces.
+   * e.g. if statPath is "/proc/1234/task/5678/stat",
+   * then pidPath is "/proc/1234/task/5678".
    */
-  if (isThread) {
-    /*
-     * statPath is something like: "/proc/1234/task/5678/stat"
-     * We'll parse out "1234" as the parent PID.
-     */
-    const char *afterProc = statPath + 6; /* skip "/proc/" */
-    char *slashTask = strstr((char *)afterProc, "/task/");
-    if (slashTask) {
-      *slashTask = '\0';
-      pInfo->ppid = (pid_t)atoi(afterProc);
-      *slashTask = '/';
-    }
-  }
+  char pidPath[PATH_MAX];
+  stat_path_to_dir(statPath, pidPath);
+  read_namespaces(pInfo, pidPath);
 
   g_procCount++;
 }
 
 /**
- * gather_processes_and_threads - Collect all processes from /proc into
- * g_processes, and optionally each thread under /proc/<pid>/task/.
+ * sample_task - Decide whether the task @tid is part of the sample
  *
- *   - For the main process, read /proc/<pid>/stat
- *   - If show_threads == 1, then open /proc/<pid>/task and for each TID != pid,
- *     read /proc/<pid>/task/<tid>/stat and mark those as threads.
+ * Return: 1 if the task should be scanned.
  */
-static void gather_processes_and_threads(void) {
-  DIR *procDir = opendir("/proc");
-  if (!procDir) {
+static int sample_task(pid_t tid) {
+  if (g_sampleRate >= 1.0)
+    return 1;
+  /* splitmix64 finalizer over TID and seed, mapped to [0, 1) */
+  unsigned long long x = (unsigned long long)tid + g_sampleSeed;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+  return (double)(x >> 11) * (1.0 / 9007199254740992.0) < g_sampleRate;
+}
+
+/**
+ * scan_proc - Walk /proc and hand every task's stat path to @visit
+ * @visit: Called as visit(statPath, isThread) for each process, and for each
+ *         thread under /proc/<pid>/task/ if show_threads is set
+ *
+ * Processes (thread group leaders) are always visited; with --sample this
+ * is the cheap first pass that discovers every namespace with a process in
+ * it, however small, while only sampled threads are read.
+ */
+static void scan_proc(void (*visit)(const char *statPath, int isThread)) {
+  DirStream procDir;
+  if (dirstream_open(&procDir, AT_FDCWD, "/proc") != 0) {
     perror("opendir /proc");
     exit(EXIT_FAILURE);
   }
 
-  struct dirent *entry;
-  while ((entry = readdir(procDir)) != NULL) {
-    if (!is_number(entry->d_name))
+  const char *pidName;
+  while ((pidName = dirstream_next(&procDir)) != NULL) {
+    if (!is_number(pidName))
       continue; /* skip non-numeric directories */
 
     /* Read the main process's /stat first */
     char statPath[PATH_MAX];
-    snprintf(statPath, sizeof(statPath), "/proc/%s/stat", entry->d_name);
-    read_proc_info(statPath, 0 /* isThread=0 */);
+    snprintf(statPath, sizeof(statPath), "/proc/%s/stat", pidName);
+    visit(statPath, 0 /* isThread=0 */);
 
     /* Conditionally read each thread in /proc/<pid>/task/ if show_threads=1 */
     if (show_threads) {
       char taskDirPath[PATH_MAX];
-      snprintf(taskDirPath, sizeof(taskDirPath), "/proc/%s/task",
-               entry->d_name);
-
-      DIR *taskDir = opendir(taskDirPath);
-      if (taskDir) {
-        struct dirent *dt;
-        while ((dt = readdir(taskDir)) != NULL) {
-          if (!is_number(dt->d_name))
+      snprintf(taskDirPath, sizeof(taskDirPath), "/proc/%s/task", pidName);
+
+      DirStream taskDir;
+      if (dirstream_open(&taskDir, AT_FDCWD, taskDirPath) == 0) {
+        const char *tidName;
+        while ((tidName = dirstream_next(&taskDir)) != NULL) {
+          if (!is_number(tidName))
             continue;
           /* Convert TID to integer */
-          pid_t tid = atoi(dt->d_name);
+          pid_t tid = atoi(tidName);
 
           /* If TID == main PID, that's the same /stat we already read. */
-          if (tid == (pid_t)atoi(entry->d_name))
+          if (tid == (pid_t)atoi(pidName))
+            continue;
+
+          /* With --sample, only a random subset of threads is read */
+          if (!sample_task(tid))
             continue;
 
           /* Construct /proc/<pid>/task/<tid>/stat path */
           char tstatPath[PATH_MAX];
 	  int len = snprintf(tstatPath, sizeof(tstatPath),
-			     "%s/%s/stat", taskDirPath, dt->d_name);
+			     "%s/%s/stat", taskDirPath, tidName);
 
 	  /* Should never happen. But keeps gcc happy */
 	  if (len < 0 || (size_t)len >= sizeof(tstatPath)) {
 		  fprintf(stderr, "Path too long: %s/%s/stat\n",
-			  taskDirPath, dt->d_name);
+			  taskDirPath, tidName);
 		  continue;
 	  }
 
-          read_proc_info(tstatPath, 1 /* isThread=1 */);
+          visit(tstatPath, 1 /* isThread=1 */);
         }
-        closedir(taskDir);
+        dirstream_close(&taskDir);
       }
     }
   }
-  closedir(procDir);
+  dirstream_close(&procDir);
 }
 
 /**
- * build_process_tree - Build parent->children mappings in the global array
+ * gather_processes_and_threads - Collect all processes from /proc into
+ * g_processes, and optionally each thread under /proc/<pid>/task/.
  *
- * We go through each entry in g_processes, then find all entries whose ppid
- * matches that entry's pid. We connect them in the parent->children array.
+ *   - For the main process, read /proc/<pid>/stat
+ *   - If show_threads == 1, then open /proc/<pid>/task and for each TID != pid,
+ *     read /proc/<pid>/task/<tid>/stat and mark those as threads.
  */
-static void build_process_tree(void) {
+static void gather_processes_and_threads(void) {
+  scan_proc(read_proc_info);
+}
+
+/**
+ * free_process_tree - Release the parent->children arrays
+ */
+static void free_process_tree(void) {
+  if (g_rescue)
+    return; /* the child arrays live in g_rescueChildren */
   for (size_t i = 0; i < g_procCount; i++) {
-    ProcInfo *parent = &g_processes[i];
-    parent->childCount = 0;
-    parent->children = NULL;
+    g_processes[i].children = NULL; /* a slice of g_childSlab */
+    g_processes[i].childCount = 0;
+  }
+}
 
-    /* Count how many processes have parent->pid as ppid */
-    size_t childCount = 0;
-    for (size_t j = 0; j < g_procCount; j++) {
-      if (g_processes[j].ppid == parent->pid)
-        childCount++;
-    }
-    if (!childCount)
-      continue;
+/*
+ * Every task is somebody's child at most once, so all children arrays fit
+ * back to back in one slab of g_procCount pointers. The slab is kept
+ * across watch ticks instead of allocating an array per parent each time,
+ * and shrinks again when the table does.
+ */
+static ProcInfo **g_childSlab = NULL;
+static size_t g_childSlabCap = 0;
+
+static void child_slab_reserve(size_t count) {
+  if (count <= g_childSlabCap && (g_childSlabCap <= 1024 ||
+                                  count >= g_childSlabCap / 4))
+    return;
+  size_t newCap = count + count / 4 + 64;
+  ProcInfo **tmp = realloc(g_childSlab, newCap * sizeof(*tmp));
+  if (!tmp) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  g_childSlab = tmp;
+  g_childSlabCap = newCap;
+}
+
+/* --sort: how children are ordered under their parent */
+enum { CHILD_ORDER_SCAN, CHILD_ORDER_PID, CHILD_ORDER_START, CHILD_ORDER_COMM };
+static const char *const g_childOrderNames[] = {"scan", "pid", "starttime",
+                                                "comm"};
+static int g_childOrder = CHILD_ORDER_PID;
+
+static size_t *g_order = NULL;    /* g_processes indices in child order */
+static size_t *g_orderTmp = NULL; /* radix sort scratch */
+static size_t g_orderCap = 0;
+
+/* Byte @pass (least significant first) of the sort key of @proc */
+static unsigned char child_order_byte(const ProcInfo *proc, int key,
+                                      unsigned int pass) {
+  switch (key) {
+  case CHILD_ORDER_START:
+    return (unsigned char)(proc->starttime >> (8 * pass));
+  case CHILD_ORDER_COMM: {
+    /* comm is at most 15 bytes (TASK_COMM_LEN); pass 0 is the last one */
+    size_t pos = 15 - pass;
+    return pos < strlen(proc->comm) ? (unsigned char)proc->comm[pos] : 0;
+  }
+  default:
+    return (unsigned char)((unsigned int)proc->pid >> (8 * pass));
+  }
+}
+
+/**
+ * radix_pass - One stable counting-sort pass of g_order on a key byte
+ *
+ * Passes in which every entry has the same byte are skipped, so e.g. PIDs
+ * below 65536 cost two passes, not four.
+ */
+static void radix_pass(int key, unsigned int pass) {
+  size_t counts[257] = {0};
+  for (size_t i = 0; i < g_procCount; i++)
+    counts[child_order_byte(&g_processes[g_order[i]], key, pass) + 1]++;
+  for (size_t b = 1; b < 257; b++) {
+    if (counts[b] == g_procCount)
+      return;
+  }
+  for (size_t b = 1; b < 257; b++)
+    counts[b] += counts[b - 1];
+  for (size_t i = 0; i < g_procCount; i++) {
+    size_t v = g_order[i];
+    g_orderTmp[counts[child_order_byte(&g_processes[v], key, pass)]++] = v;
+  }
+  size_t *tmp = g_order;
+  g_order = g_orderTmp;
+  g_orderTmp = tmp;
+}
 
-    parent->children = (ProcInfo **)malloc(childCount * sizeof(ProcInfo *));
-    if (!parent->children) {
+/**
+ * child_order_sort - Fill g_order with all entries in g_childOrder order
+ *
+ * An LSD radix sort over all tasks at once: filling the children arrays in
+ * this order sorts every sibling list in O(n) total, with ties broken by
+ * PID so the result does not depend on the scan order.
+ */
+static void child_order_sort(void) {
+  if (g_procCount > g_orderCap) {
+    g_orderCap = g_procCount;
+    free(g_order);
+    free(g_orderTmp);
+    g_order = malloc(g_orderCap * sizeof(*g_order));
+    g_orderTmp = malloc(g_orderCap * sizeof(*g_orderTmp));
+    if (!g_order || !g_orderTmp) {
       perror("malloc");
       exit(EXIT_FAILURE);
     }
+  }
+  for (size_t i = 0; i < g_procCount; i++)
+    g_order[i] = i;
+  if (g_childOrder == CHILD_ORDER_SCAN)
+    return;
 
-    /* Fill the child pointers */
-    size_t idx = 0;
-    for (size_t j = 0; j < g_procCount; j++) {
-      if (g_processes[j].ppid == parent->pid) {
-        parent->children[idx] = &g_processes[j];
-        idx++;
-      }
+  for (unsigned int pass = 0; pass < sizeof(pid_t); pass++)
+    radix_pass(CHILD_ORDER_PID, pass);
+  if (g_childOrder == CHILD_ORDER_START) {
+    for (unsigned int pass = 0; pass < sizeof(unsigned long long); pass++)
+      radix_pass(CHILD_ORDER_START, pass);
+  } else if (g_childOrder == CHILD_ORDER_COMM) {
+    for (unsigned int pass = 0; pass < 16; pass++)
+      radix_pass(CHILD_ORDER_COMM, pass);
+  }
+}
+
+/**
+ * build_process_tree - Build parent->children mappings in the global array
+ *
+ * Each entry's parent is looked up through the PID index, so the whole build
+ * is linear in the number of tasks. Children are ordered by g_childOrder
+ * (or keep their g_processes order for "scan").
+ */
+static void build_process_tree(void) {
+  pid_index_rebuild();
+
+  /* Count how many children each process has */
+  for (size_t i = 0; i < g_procCount; i++) {
+    g_processes[i].parent = NULL;
+    g_processes[i].children = NULL;
+    g_processes[i].childCount = 0;
+  }
+  for (size_t j = 0; j < g_procCount; j++) {
+    ssize_t p = pid_index_find(g_processes[j].ppid);
+    if (p >= 0 && (size_t)p != j) {
+      g_processes[p].childCount++;
+      g_processes[j].parent = &g_processes[p];
+    }
+  }
+
+  ProcInfo **pool = g_rescueChildren;
+  if (!g_rescue) {
+    child_slab_reserve(g_procCount);
+    pool = g_childSlab;
+  }
+  size_t pooled = 0;
+  for (size_t i = 0; i < g_procCount; i++) {
+    ProcInfo *parent = &g_processes[i];
+    if (!parent->childCount)
+      continue;
+    parent->children = pool + pooled;
+    pooled += parent->childCount;
+    /* Reset and reuse childCount as the fill cursor below */
+    parent->childCount = 0;
+  }
+
+  /* Fill the child pointers */
+  child_order_sort();
+  for (size_t k = 0; k < g_procCount; k++) {
+    size_t j = g_order[k];
+    ssize_t p = pid_index_find(g_processes[j].ppid);
+    if (p >= 0 && (size_t)p != j) {
+      ProcInfo *parent = &g_processes[p];
+      parent->children[parent->childCount++] = &g_processes[j];
     }
-    parent->childCount = childCount;
   }
 }
 
@@ -437,185 +956,8237 @@ static const char *find_namespace_inode(const NamespaceEntry *list,
   return NULL;
 }
 
+/* g_nsTypes index -> its namespace kind (*_for_children fold onto the base) */
+static const int g_nsKinds[NS_TYPE_COUNT] = {0, 1, 2, 3, 4, 4, 6, 6, 8, 9};
+
 /**
- * has_requested_namespace_diff - Checks if 'proc' differs in any requested
- * namespace filter from the parent's namespaces.
- * If parentNs == NULL, treat as "no parent," so differences are considered if
- * the child has that namespace at all.
+ * namespace_kind_inodes - Index @list's inodes by namespace kind
+ * @inos: Filled with the inode of the first entry of each kind
+ *
+ * Return: a mask of the kinds present, bits over g_nsTypes.
  */
-static int has_requested_namespace_diff(const ProcInfo *proc,
-                                        const NamespaceEntry *parentNs,
-                                        size_t parentNsCount) {
-  /* If no filters => we won't prune on differences. */
-  if (g_filterCount == 0) {
-    return 0;
+static unsigned int namespace_kind_inodes(const NamespaceEntry *list,
+                                          size_t listCount,
+                                          unsigned long long *inos) {
+  unsigned int have = 0;
+  for (size_t i = 0; i < listCount; i++) {
+    int t = list[i].typeIdx;
+    if (t < 0 || (have & (1u << g_nsKinds[t])))
+      continue;
+    have |= 1u << g_nsKinds[t];
+    inos[g_nsKinds[t]] = list[i].ino;
   }
+  return have;
+}
 
-  for (size_t f = 0; f < g_filterCount; f++) {
-    const char *filterType = g_filters[f];
-
-    /* If the filter is "*", check if there's a difference in ANY namespace. */
-    if (strcmp(filterType, "*") == 0) {
-      for (size_t i = 0; i < proc->nsCount; i++) {
-        const char *childInode = proc->namespaces[i].inode;
-        const char *childType = proc->namespaces[i].type;
-
-        if (!parentNs) {
-          /* No parent => any namespace the child has is considered new. */
-          return 1;
-        } else {
-          const char *parentInode =
-              find_namespace_inode(parentNs, parentNsCount, childType);
-          if (!parentInode || strcmp(parentInode, childInode) != 0) {
-            return 1;
-          }
+/**
+ * namespace_diff_mask - Determine which namespaces differ from the parent's
+ *
+ * The parent's entries are indexed by kind once, so known types cost an
+ * integer compare each; only links g_nsTypes does not know are matched by
+ * their type string.
+ *
+ * Return: a mask with bit i set if proc->namespaces[i] is not shared with
+ * the parent (every namespace counts as different for the root).
+ */
+static unsigned int namespace_diff_mask(const ProcInfo *proc,
+                                        const NamespaceEntry *parentNs,
+                                        size_t parentNsCount) {
+  if (!parentNs)
+    return (1u << proc->nsCount) - 1;
+
+  unsigned long long parentInos[NS_TYPE_COUNT];
+  unsigned int have =
+      namespace_kind_inodes(parentNs, parentNsCount, parentInos);
+  unsigned int diffMask = 0;
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    const NamespaceEntry *ns = &proc->namespaces[i];
+    if (ns->typeIdx >= 0) {
+      int k = g_nsKinds[ns->typeIdx];
+      if (!(have & (1u << k)) || parentInos[k] != ns->ino)
+        diffMask |= 1u << i;
+      continue;
+    }
+    const char *parentInode =
+        find_namespace_inode(parentNs, parentNsCount, ns->type);
+    if (!parentInode || strcmp(parentInode, ns->inode) != 0)
+      diffMask |= 1u << i;
+  }
+  return diffMask;
+}
+
+/*
+ * The filters only change when the TUI edits them, so traversal_select()
+ * compiles them into g_filterAny/g_filterKinds once and picks one of the
+ * keep kernels below; the per-node loops never look at g_filters.
+ */
+static int g_filterAny = 0;            /* a bare --filter ("*") was given */
+static unsigned int g_filterKinds = 0; /* --filter=TYPE, bits over g_nsTypes */
+
+/**
+ * filter_entry_mask - Bits of the @proc->namespaces entries --filter=TYPE
+ * compares
+ *
+ * A filter only looks at the first entry of its type, so "pid" compares
+ * whichever of pid and pid_for_children the ns directory listed first.
+ */
+static unsigned int filter_entry_mask(const ProcInfo *proc) {
+  unsigned int mask = 0, seen = 0;
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    int t = proc->namespaces[i].typeIdx;
+    if (t < 0)
+      continue;
+    unsigned int kind = 1u << g_nsKinds[t];
+    if ((g_filterKinds & kind) && !(seen & kind))
+      mask |= 1u << i;
+    seen |= kind;
+  }
+  return mask;
+}
+
+/* Whether @proc entered a namespace of one of the --filter=TYPE types */
+static int filter_typed_differs(const ProcInfo *proc,
+                                const NamespaceEntry *parentNs,
+                                size_t parentNsCount) {
+  unsigned int entries = filter_entry_mask(proc);
+  if (!parentNs || !entries)
+    return entries != 0;
+
+  /* Usually a single entry, so the parent is searched per entry */
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    if (!(entries & (1u << i)))
+      continue;
+    int k = g_nsKinds[proc->namespaces[i].typeIdx];
+    size_t j = 0;
+    while (j < parentNsCount && (parentNs[j].typeIdx < 0 ||
+                                 g_nsKinds[parentNs[j].typeIdx] != k))
+      j++;
+    if (j == parentNsCount || parentNs[j].ino != proc->namespaces[i].ino)
+      return 1;
+  }
+  return 0;
+}
+
+/**
+ * filter_keeps - Whether the filters keep @proc for its own sake
+ *
+ * The root (@parentNs == NULL) differs in every namespace it has.
+ */
+static int filter_keeps(const ProcInfo *proc, const NamespaceEntry *parentNs,
+                        size_t parentNsCount) {
+  if (g_filterAny)
+    return namespace_diff_mask(proc, parentNs, parentNsCount) != 0;
+  return filter_typed_differs(proc, parentNs, parentNsCount);
+}
+
+/* No filters: everything is kept and there is nothing to propagate */
+static void keep_all(ProcInfo *root) {
+  (void)root;
+  for (size_t i = 0; i < g_procCount; i++)
+    g_processes[i].keep = 1;
+}
+
+/* A bare --filter: keep paths to anything that entered a namespace */
+static int keep_any(ProcInfo *proc, const NamespaceEntry *parentNs,
+                    size_t parentNsCount) {
+  int keep = namespace_diff_mask(proc, parentNs, parentNsCount) != 0;
+  for (size_t i = 0; i < proc->childCount; i++)
+    keep |= keep_any(proc->children[i], proc->namespaces, proc->nsCount);
+  proc->keep = keep;
+  return keep;
+}
+
+/* --filter=TYPE: keep paths to anything that entered one of the types */
+static int keep_typed(ProcInfo *proc, const NamespaceEntry *parentNs,
+                      size_t parentNsCount) {
+  int keep = filter_typed_differs(proc, parentNs, parentNsCount);
+  for (size_t i = 0; i < proc->childCount; i++)
+    keep |= keep_typed(proc->children[i], proc->namespaces, proc->nsCount);
+  proc->keep = keep;
+  return keep;
+}
+
+static void keep_any_root(ProcInfo *root) { keep_any(root, NULL, 0); }
+static void keep_typed_root(ProcInfo *root) { keep_typed(root, NULL, 0); }
+
+enum { KEEP_ALL, KEEP_ANY, KEEP_TYPED };
+static void (*const g_keepKernels[])(ProcInfo *root) = {
+    keep_all, keep_any_root, keep_typed_root};
+static void (*g_keepKernel)(ProcInfo *root) = keep_all;
+
+/**
+ * mark_keep_processes - Mark which processes to keep below @root
+ *
+ * A process is kept if the filters select it or any of its descendants.
+ * If no filters are specified, every process is kept.
+ */
+static void mark_keep_processes(ProcInfo *root) { g_keepKernel(root); }
+
+/**
+ * struct VisitInfo - Everything a renderer needs to know about one node
+ * @proc:          The node being visited
+ * @prefix:        Tree indentation for this node (without the branch glyph);
+ *                 empty unless a tree output is configured
+ * @isLast:        Non-zero if this is the last kept child of its parent;
+ *                 only set when a tree output is configured
+ * @depth:         Distance from the root of the traversal
+ * @parentNs:      Parent's namespace array, or NULL for the root
+ * @parentNsCount: How many namespaces in @parentNs
+ * @diffMask:      Bit i is set if proc->namespaces[i] differs from the parent
+ *
+ * The traversal computes this once per node and hands the same VisitInfo to
+ * every sink, so the namespace comparison is not repeated per output format.
+ */
+typedef struct {
+  const ProcInfo *proc;
+  const char *prefix;
+  int isLast;
+  size_t depth;
+  const NamespaceEntry *parentNs;
+  size_t parentNsCount;
+  unsigned int diffMask;
+} VisitInfo;
+
+struct Sink;
+
+/**
+ * struct SinkFormat - Renderer callbacks for one output format
+ * @name:  Format name as used in --output=FORMAT:DEST
+ * @begin: Called once before the traversal (may be NULL)
+ * @node:  Called for every kept node, in pre-order
+ * @end:   Called once after the traversal (may be NULL)
+ * @scalesSamples: Non-zero if the format scales sampled counts, i.e. may be
+ *                 used with --sample
+ * @cacheable: Non-zero if a node's output depends only on the node and its
+ *             position, so watch mode may replay unchanged subtrees
+ * @streamable: Non-zero if @node keeps no pointer to a task once the task's
+ *              subtree has been visited, so --mem-limit may hand it tasks
+ *              that only live on the traversal stack
+ */
+typedef struct {
+  const char *name;
+  void (*begin)(struct Sink *sink);
+  void (*node)(struct Sink *sink, const VisitInfo *visit);
+  void (*end)(struct Sink *sink);
+  int scalesSamples;
+  int cacheable;
+  int streamable;
+} SinkFormat;
+
+/**
+ * struct Sink - An output destination paired with a rendering format
+ * @format: Renderer used for this destination
+ * @dest:   Destination as given on the command line ("-" means stdout)
+ * @fd:     File descriptor the buffered output is written to
+ * @buf:    Private output buffer, flushed once it grows past
+ *          SINK_FLUSH_THRESHOLD bytes
+ * @len:    Number of bytes currently buffered
+ * @cap:    Allocated size of @buf
+ * @isFile: Non-zero if @fd is a regular file, which watch mode rewrites
+ *          from the start on every render instead of appending
+ * @state:  Format-private state (e.g. accumulated metrics), or NULL
+ * @retain: Non-zero while a whole rendering is kept in @buf instead of
+ *          being flushed at the threshold (render cache)
+ * @prev:   The previous complete rendering, when @retain is set
+ * @prevLen: Length of @prev
+ * @prevCap: Allocated size of @prev
+ * @shared: Non-zero if another sink also writes to stdout; the rendering
+ *          is then held until sinks_end() so that the two do not interleave
+ */
+typedef struct Sink {
+  const SinkFormat *format;
+  const char *dest;
+  int fd;
+  char *buf;
+  size_t len;
+  size_t cap;
+  int isFile;
+  void *state;
+  int retain;
+  char *prev;
+  size_t prevLen;
+  size_t prevCap;
+  int shared;
+} Sink;
+
+static Sink g_sinks[MAX_SINKS];
+static size_t g_sinkCount = 0;
+
+/**
+ * sink_flush - Write out everything buffered in @sink
+ */
+static void sink_flush(Sink *sink) {
+  size_t off = 0;
+  while (off < sink->len) {
+    ssize_t n = write(sink->fd, sink->buf + off, sink->len - off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror(sink->dest);
+      exit(EXIT_FAILURE);
+    }
+    off += (size_t)n;
+  }
+  sink->len = 0;
+}
+
+/**
+ * sink_reserve - Make room for at least @extra more bytes in @sink's buffer
+ */
+static void sink_reserve(Sink *sink, size_t extra) {
+  if (sink->len + extra <= sink->cap)
+    return;
+  if (g_rescue) {
+    /* A static buffer; it is twice the flush threshold, so this fits */
+    sink_flush(sink);
+    return;
+  }
+  size_t newCap = sink->cap ? sink->cap : 4096;
+  while (newCap < sink->len + extra)
+    newCap *= 2;
+  char *tmp = realloc(sink->buf, newCap);
+  if (!tmp) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  sink->buf = tmp;
+  sink->cap = newCap;
+}
+
+/**
+ * sink_write - Append @len bytes of @data to @sink
+ */
+static void sink_write(Sink *sink, const char *data, size_t len) {
+  if (!len)
+    return; /* @data may be NULL */
+  sink_reserve(sink, len);
+  memcpy(sink->buf + sink->len, data, len);
+  sink->len += len;
+  if (sink->len >= SINK_FLUSH_THRESHOLD && !sink->retain && !sink->shared)
+    sink_flush(sink);
+}
+
+/**
+ * sink_puts - Append a NUL-terminated string to @sink
+ */
+static void sink_puts(Sink *sink, const char *str) {
+  sink_write(sink, str, strlen(str));
+}
+
+/**
+ * sink_printf - printf-style append to @sink
+ */
+static void sink_printf(Sink *sink, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void sink_printf(Sink *sink, const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  int needed = vsnprintf(NULL, 0, fmt, ap);
+  va_end(ap);
+  if (needed < 0)
+    return;
+
+  sink_reserve(sink, (size_t)needed + 1);
+  va_start(ap, fmt);
+  vsnprintf(sink->buf + sink->len, (size_t)needed + 1, fmt, ap);
+  va_end(ap);
+  sink->len += (size_t)needed;
+  if (sink->len >= SINK_FLUSH_THRESHOLD && !sink->retain && !sink->shared)
+    sink_flush(sink);
+}
+
+/**
+ * sink_put_json_string - Append @str to @sink as a quoted JSON string
+ *
+ * comm is chosen by the process itself and may contain quotes, backslashes
+ * or control characters, so everything below 0x20 is escaped.
+ */
+static void sink_put_json_string(Sink *sink, const char *str) {
+  sink_write(sink, "\"", 1);
+  for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      char esc[2] = {'\\', (char)*c};
+      sink_write(sink, esc, 2);
+    } else if (*c < 0x20) {
+      sink_printf(sink, "\\u%04x", *c);
+    } else {
+      sink_write(sink, (const char *)c, 1);
+    }
+  }
+  sink_write(sink, "\"", 1);
+}
+
+/* ---- tree: the classic pstree-like rendering ---- */
+
+static void tree_node(Sink *sink, const VisitInfo *visit) {
+  const ProcInfo *proc = visit->proc;
+
+  /* Print the tree branch prefix */
+  sink_puts(sink, visit->prefix);
+  sink_puts(sink, visit->isLast ? "└─" : "├─");
+
+  /* If it's a thread, comm is typically in braces, e.g. {bash} */
+  if (proc->isThread) {
+    sink_printf(sink, "{%s}(%d)", proc->comm, proc->pid);
+  } else {
+    sink_printf(sink, "%s(%d)", proc->comm, proc->pid);
+  }
+
+  /* If namespaces were unreadable, add an asterisk */
+  if (!proc->nsReadable) {
+    sink_puts(sink, "*");
+  }
+
+  /* Print the namespaces that differ from the parent's */
+  int firstNsPrinted = 1;
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    if (!(visit->diffMask & (1u << i)))
+      continue;
+    sink_puts(sink, firstNsPrinted ? " [" : ", ");
+    firstNsPrinted = 0;
+    sink_puts(sink, proc->namespaces[i].inode);
+  }
+  if (!firstNsPrinted)
+    sink_puts(sink, "]");
+
+  sink_puts(sink, "\n");
+}
+
+/* ---- ndjson: one JSON object per visited task ---- */
+
+static void ndjson_node(Sink *sink, const VisitInfo *visit) {
+  const ProcInfo *proc = visit->proc;
+
+  sink_printf(sink, "{\"pid\":%d,\"ppid\":%d,\"comm\":", proc->pid,
+              proc->ppid);
+  sink_put_json_string(sink, proc->comm);
+  sink_printf(sink, ",\"thread\":%s,\"depth\":%zu,\"ns_readable\":%s",
+              proc->isThread ? "true" : "false", visit->depth,
+              proc->nsReadable ? "true" : "false");
+
+  sink_puts(sink, ",\"ns\":{");
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    const NamespaceEntry *ns = &proc->namespaces[i];
+    sink_printf(sink, "%s\"%s\":%llu", i ? "," : "",
+                ns->typeIdx >= 0 ? g_nsTypes[ns->typeIdx] : ns->type,
+                ns->ino);
+  }
+  sink_puts(sink, "},\"diff\":[");
+  int first = 1;
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    if (!(visit->diffMask & (1u << i)))
+      continue;
+    const NamespaceEntry *ns = &proc->namespaces[i];
+    sink_printf(sink, "%s\"%s\"", first ? "" : ",",
+                ns->typeIdx >= 0 ? g_nsTypes[ns->typeIdx] : ns->type);
+    first = 0;
+  }
+  sink_puts(sink, "]}\n");
+}
+
+/* ---- arrow: Apache Arrow IPC file for analytics ingestion ---- */
+
+/*
+ * The traversal appends every task to column arrays; the end writes the IPC
+ * file format: the ARROW1 magic, a schema message, one dictionary batch
+ * holding the distinct comms, one record batch, and the footer indexing
+ * them. Message metadata is flatbuffers, produced by the small front-to-back
+ * writer below: each table is written before the objects it refers to, and
+ * those forward offsets are patched once the objects are placed. Column
+ * arrays are handed to writev() where they were accumulated, without being
+ * copied into the sink buffer.
+ */
+
+/**
+ * struct FbWriter - Flatbuffer under construction, little-endian
+ */
+typedef struct {
+  unsigned char *buf;
+  size_t len;
+  size_t cap;
+} FbWriter;
+
+/**
+ * struct FbTable - A table being written
+ * @vtable: Position of its vtable, which precedes it
+ * @table:  Position of the table itself
+ * @fields: Number of field slots in the vtable
+ */
+typedef struct {
+  size_t vtable;
+  size_t table;
+  size_t fields;
+} FbTable;
+
+static void fb_reserve(FbWriter *fb, size_t extra) {
+  if (fb->len + extra <= fb->cap)
+    return;
+  size_t newCap = fb->cap ? fb->cap : 512;
+  while (newCap < fb->len + extra)
+    newCap *= 2;
+  unsigned char *tmp = realloc(fb->buf, newCap);
+  if (!tmp) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  fb->buf = tmp;
+  fb->cap = newCap;
+}
+
+static void fb_pad(FbWriter *fb, size_t align) {
+  fb_reserve(fb, align);
+  while (fb->len % align)
+    fb->buf[fb->len++] = 0;
+}
+
+static void fb_store(FbWriter *fb, size_t pos, unsigned long long v,
+                     size_t size) {
+  for (size_t i = 0; i < size; i++)
+    fb->buf[pos + i] = (unsigned char)(v >> (8 * i));
+}
+
+/* Append a @size-byte scalar at its natural alignment, returning where */
+static size_t fb_scalar(FbWriter *fb, unsigned long long v, size_t size) {
+  fb_pad(fb, size);
+  fb_reserve(fb, size);
+  size_t pos = fb->len;
+  fb_store(fb, pos, v, size);
+  fb->len += size;
+  return pos;
+}
+
+/* Point the offset field at @ref to the object at @target */
+static void fb_point(FbWriter *fb, size_t ref, size_t target) {
+  fb_store(fb, ref, target - ref, 4);
+}
+
+static FbTable fb_table_start(FbWriter *fb, size_t fields) {
+  FbTable t;
+  fb_pad(fb, 2);
+  t.vtable = fb->len;
+  t.fields = fields;
+  for (size_t i = 0; i < 2 + fields; i++)
+    fb_scalar(fb, 0, 2);
+  t.table = fb_scalar(fb, 0, 4);
+  fb_store(fb, t.table, t.table - t.vtable, 4); /* soffset to the vtable */
+  return t;
+}
+
+static size_t fb_field(FbWriter *fb, const FbTable *t, size_t id,
+                       unsigned long long v, size_t size) {
+  size_t pos = fb_scalar(fb, v, size);
+  fb_store(fb, t->vtable + 4 + 2 * id, pos - t->table, 2);
+  return pos;
+}
+
+/* An offset field, to be aimed with fb_point() once its object exists */
+static size_t fb_ref(FbWriter *fb, const FbTable *t, size_t id) {
+  return fb_field(fb, t, id, 0, 4);
+}
+
+static void fb_table_end(FbWriter *fb, const FbTable *t) {
+  fb_store(fb, t->vtable, 4 + 2 * t->fields, 2);
+  fb_store(fb, t->vtable + 2, fb->len - t->table, 2);
+}
+
+/* Start a vector of @count elements aligned to @align; returns its start */
+static size_t fb_vector(FbWriter *fb, size_t count, size_t align) {
+  fb_pad(fb, 4);
+  while ((fb->len + 4) % align)
+    fb_scalar(fb, 0, 4);
+  return fb_scalar(fb, count, 4);
+}
+
+static size_t fb_string(FbWriter *fb, const char *s) {
+  size_t len = strlen(s);
+  size_t pos = fb_scalar(fb, len, 4);
+  fb_reserve(fb, len + 1);
+  memcpy(fb->buf + fb->len, s, len + 1);
+  fb->len += len + 1;
+  return pos;
+}
+
+/* Arrow flatbuffer enums (Schema.fbs, Message.fbs) */
+#define ARROW_V5 4
+#define ARROW_TYPE_INT 2
+#define ARROW_TYPE_UTF8 5
+#define ARROW_TYPE_BOOL 6
+#define ARROW_MSG_SCHEMA 1
+#define ARROW_MSG_DICTIONARY 2
+#define ARROW_MSG_RECORD_BATCH 3
+
+/* Columns: pid, ppid, comm, thread, one per namespace type, diff_mask */
+#define ARROW_COLUMNS (5 + NS_TYPE_COUNT)
+
+/**
+ * struct ArrowBuf - One buffer of a message body
+ */
+typedef struct {
+  const void *data;
+  size_t len;
+} ArrowBuf;
+
+/**
+ * struct ArrowState - Columns accumulated by the arrow sink
+ * @rows:       Tasks visited
+ * @cap:        Rows allocated in every column
+ * @pid:        pid column
+ * @ppid:       ppid column
+ * @comm:       comm column, as indices into the dictionary
+ * @thread:     thread column, one bit per row
+ * @ns:         Per type, the namespace inode, 0 when null
+ * @valid:      Per type, the validity bitmap
+ * @nulls:      Per type, rows without that namespace
+ * @diff:       diff_mask column, bits over g_nsTypes
+ * @dictData:   Distinct comms, back to back
+ * @dictOffsets: Start of each distinct comm in @dictData, plus the end
+ * @dictCount:  Distinct comms
+ * @slots:      Open addressing over the dictionary, index + 1
+ * @offset:     Bytes written to the file so far
+ */
+typedef struct {
+  size_t rows;
+  size_t cap;
+  int *pid;
+  int *ppid;
+  int *comm;
+  unsigned char *thread;
+  unsigned long long *ns[NS_TYPE_COUNT];
+  unsigned char *valid[NS_TYPE_COUNT];
+  size_t nulls[NS_TYPE_COUNT];
+  unsigned int *diff;
+  char *dictData;
+  size_t dictLen;
+  size_t dictCap;
+  int *dictOffsets;
+  size_t dictCount;
+  size_t dictOffsetCap;
+  size_t *slots;
+  size_t slotCap;
+  size_t offset;
+} ArrowState;
+
+static void *arrow_realloc(void *p, size_t size) {
+  void *tmp = realloc(p, size ? size : 1);
+  if (!tmp) {
+    perror("realloc");
+    exit(EXIT_FAILURE);
+  }
+  return tmp;
+}
+
+static void arrow_grow(ArrowState *st) {
+  size_t cap = st->cap ? st->cap * 2 : 1024;
+  size_t oldBytes = st->cap / 8, bytes = cap / 8;
+  st->pid = arrow_realloc(st->pid, cap * sizeof(*st->pid));
+  st->ppid = arrow_realloc(st->ppid, cap * sizeof(*st->ppid));
+  st->comm = arrow_realloc(st->comm, cap * sizeof(*st->comm));
+  st->diff = arrow_realloc(st->diff, cap * sizeof(*st->diff));
+  st->thread = arrow_realloc(st->thread, bytes);
+  memset(st->thread + oldBytes, 0, bytes - oldBytes);
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    st->ns[t] = arrow_realloc(st->ns[t], cap * sizeof(*st->ns[t]));
+    st->valid[t] = arrow_realloc(st->valid[t], bytes);
+    memset(st->valid[t] + oldBytes, 0, bytes - oldBytes);
+  }
+  st->cap = cap;
+}
+
+static size_t arrow_slot(const ArrowState *st, const char *s, size_t len,
+                         unsigned long long hash) {
+  size_t h = (size_t)hash & (st->slotCap - 1);
+  while (st->slots[h]) {
+    size_t d = st->slots[h] - 1;
+    size_t dLen = (size_t)(st->dictOffsets[d + 1] - st->dictOffsets[d]);
+    if (dLen == len && memcmp(st->dictData + st->dictOffsets[d], s, len) == 0)
+      break;
+    h = (h + 1) & (st->slotCap - 1);
+  }
+  return h;
+}
+
+static unsigned long long arrow_hash(const char *s, size_t len) {
+  unsigned long long h = 1469598103934665603ULL;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+  return h;
+}
+
+/* Dictionary index of @comm, added if it is new */
+static int arrow_dict_index(ArrowState *st, const char *comm) {
+  size_t len = strlen(comm);
+  if ((st->dictCount + 1) * 2 > st->slotCap) {
+    free(st->slots);
+    st->slotCap = st->slotCap ? st->slotCap * 2 : 256;
+    st->slots = calloc(st->slotCap, sizeof(*st->slots));
+    if (!st->slots) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t d = 0; d < st->dictCount; d++) {
+      const char *s = st->dictData + st->dictOffsets[d];
+      size_t n = (size_t)(st->dictOffsets[d + 1] - st->dictOffsets[d]);
+      st->slots[arrow_slot(st, s, n, arrow_hash(s, n))] = d + 1;
+    }
+  }
+
+  size_t h = arrow_slot(st, comm, len, arrow_hash(comm, len));
+  if (st->slots[h])
+    return (int)(st->slots[h] - 1);
+
+  if (st->dictLen + len > st->dictCap) {
+    st->dictCap = (st->dictLen + len) * 2;
+    st->dictData = arrow_realloc(st->dictData, st->dictCap);
+  }
+  if (st->dictCount + 2 > st->dictOffsetCap) {
+    st->dictOffsetCap = st->dictOffsetCap ? st->dictOffsetCap * 2 : 256;
+    st->dictOffsets = arrow_realloc(
+        st->dictOffsets, st->dictOffsetCap * sizeof(*st->dictOffsets));
+  }
+  memcpy(st->dictData + st->dictLen, comm, len);
+  st->dictLen += len;
+  st->dictOffsets[st->dictCount + 1] = (int)st->dictLen;
+  st->slots[h] = ++st->dictCount;
+  return (int)(st->dictCount - 1);
+}
+
+static void arrow_begin(Sink *sink) {
+  ArrowState *st = calloc(1, sizeof(*st));
+  if (!st) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  st->dictOffsetCap = 256;
+  st->dictOffsets = arrow_realloc(NULL, 256 * sizeof(*st->dictOffsets));
+  st->dictOffsets[0] = 0;
+  sink->state = st;
+}
+
+static void arrow_node(Sink *sink, const VisitInfo *visit) {
+  ArrowState *st = sink->state;
+  const ProcInfo *proc = visit->proc;
+  if (st->rows == st->cap)
+    arrow_grow(st);
+
+  size_t r = st->rows++;
+  st->pid[r] = proc->pid;
+  st->ppid[r] = proc->ppid;
+  st->comm[r] = arrow_dict_index(st, proc->comm);
+  if (proc->isThread)
+    st->thread[r / 8] |= (unsigned char)(1u << (r % 8));
+
+  unsigned int diff = 0;
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++)
+    st->ns[t][r] = 0;
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    int t = proc->namespaces[i].typeIdx;
+    if (t < 0)
+      continue;
+    st->ns[t][r] = proc->namespaces[i].ino;
+    st->valid[t][r / 8] |= (unsigned char)(1u << (r % 8));
+    if (visit->diffMask & (1u << i))
+      diff |= 1u << t;
+  }
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++)
+    st->nulls[t] += !st->ns[t][r];
+  st->diff[r] = diff;
+}
+
+/* Write a Field table for the offset at @ref */
+static void arrow_put_field(FbWriter *fb, size_t ref, const char *name,
+                            int nullable, int type, int bitWidth,
+                            int isSigned, int dictionary) {
+  FbTable t = fb_table_start(fb, 6);
+  fb_point(fb, ref, t.table);
+  size_t nameRef = fb_ref(fb, &t, 0);
+  fb_field(fb, &t, 1, (unsigned long long)nullable, 1);
+  fb_field(fb, &t, 2, (unsigned long long)type, 1);
+  size_t typeRef = fb_ref(fb, &t, 3);
+  size_t dictRef = dictionary ? fb_ref(fb, &t, 4) : 0;
+  size_t childrenRef = fb_ref(fb, &t, 5);
+  fb_table_end(fb, &t);
+
+  fb_point(fb, nameRef, fb_string(fb, name));
+  FbTable ty = fb_table_start(fb, type == ARROW_TYPE_INT ? 2 : 0);
+  fb_point(fb, typeRef, ty.table);
+  if (type == ARROW_TYPE_INT) {
+    fb_field(fb, &ty, 0, (unsigned long long)bitWidth, 4);
+    fb_field(fb, &ty, 1, (unsigned long long)isSigned, 1);
+  }
+  fb_table_end(fb, &ty);
+
+  if (dictionary) {
+    /* DictionaryEncoding { id = 0, indexType = Int(32, signed) } */
+    FbTable d = fb_table_start(fb, 2);
+    fb_point(fb, dictRef, d.table);
+    fb_field(fb, &d, 0, 0, 8);
+    size_t indexRef = fb_ref(fb, &d, 1);
+    fb_table_end(fb, &d);
+    FbTable it = fb_table_start(fb, 2);
+    fb_point(fb, indexRef, it.table);
+    fb_field(fb, &it, 0, 32, 4);
+    fb_field(fb, &it, 1, 1, 1);
+    fb_table_end(fb, &it);
+  }
+  fb_point(fb, childrenRef, fb_vector(fb, 0, 4));
+}
+
+/* Write the Schema table for the offset at @ref */
+static void arrow_put_schema(FbWriter *fb, size_t ref) {
+  FbTable t = fb_table_start(fb, 2);
+  fb_point(fb, ref, t.table);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  fb_field(fb, &t, 0, 1, 2); /* column data is in host order */
+#else
+  fb_field(fb, &t, 0, 0, 2);
+#endif
+  size_t fieldsRef = fb_ref(fb, &t, 1);
+  fb_table_end(fb, &t);
+
+  fb_point(fb, fieldsRef, fb_vector(fb, ARROW_COLUMNS, 4));
+  size_t refs[ARROW_COLUMNS];
+  for (size_t c = 0; c < ARROW_COLUMNS; c++)
+    refs[c] = fb_scalar(fb, 0, 4);
+
+  arrow_put_field(fb, refs[0], "pid", 0, ARROW_TYPE_INT, 32, 1, 0);
+  arrow_put_field(fb, refs[1], "ppid", 0, ARROW_TYPE_INT, 32, 1, 0);
+  arrow_put_field(fb, refs[2], "comm", 0, ARROW_TYPE_UTF8, 0, 0, 1);
+  arrow_put_field(fb, refs[3], "thread", 0, ARROW_TYPE_BOOL, 0, 0, 0);
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    char name[64];
+    snprintf(name, sizeof(name), "ns_%s", g_nsTypes[t]);
+    arrow_put_field(fb, refs[4 + t], name, 1, ARROW_TYPE_INT, 64, 0, 0);
+  }
+  arrow_put_field(fb, refs[4 + NS_TYPE_COUNT], "diff_mask", 0,
+                  ARROW_TYPE_INT, 32, 0, 0);
+}
+
+/* Write a RecordBatch table of @length rows for the offset at @ref */
+static void arrow_put_batch(FbWriter *fb, size_t ref, size_t length,
+                            const size_t *nulls, size_t fields,
+                            const ArrowBuf *bufs, size_t bufCount) {
+  FbTable t = fb_table_start(fb, 3);
+  fb_point(fb, ref, t.table);
+  fb_field(fb, &t, 0, length, 8);
+  size_t nodesRef = fb_ref(fb, &t, 1);
+  size_t bufsRef = fb_ref(fb, &t, 2);
+  fb_table_end(fb, &t);
+
+  fb_point(fb, nodesRef, fb_vector(fb, fields, 8));
+  for (size_t f = 0; f < fields; f++) {
+    fb_scalar(fb, length, 8);
+    fb_scalar(fb, nulls[f], 8);
+  }
+  fb_point(fb, bufsRef, fb_vector(fb, bufCount, 8));
+  size_t off = 0;
+  for (size_t b = 0; b < bufCount; b++) {
+    fb_scalar(fb, off, 8);
+    fb_scalar(fb, bufs[b].len, 8);
+    off += (bufs[b].len + 7) & ~(size_t)7;
+  }
+}
+
+/* Write @iov out completely, however the kernel splits it */
+static void arrow_writev(Sink *sink, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(sink->fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror(sink->dest);
+      exit(EXIT_FAILURE);
+    }
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= (ssize_t)iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= (size_t)n;
+    }
+  }
+}
+
+/**
+ * arrow_put_message - Frame @fb as a message and write it with its body
+ * @block: Filled with the footer's Block for it: offset, metadata length
+ *         (including the 8-byte prefix) and body length
+ *
+ * @fb's Message.bodyLength field, at @bodyLengthPos, is filled in here.
+ */
+static void arrow_put_message(Sink *sink, ArrowState *st, FbWriter *fb,
+                              size_t bodyLengthPos, const ArrowBuf *bufs,
+                              size_t bufCount, unsigned long long *block) {
+  static const char zeros[8];
+  size_t body = 0;
+  for (size_t b = 0; b < bufCount; b++)
+    body += (bufs[b].len + 7) & ~(size_t)7;
+  fb_store(fb, bodyLengthPos, body, 8);
+  fb_pad(fb, 8);
+
+  unsigned char prefix[8];
+  memset(prefix, 0xFF, 4);
+  for (size_t i = 0; i < 4; i++)
+    prefix[4 + i] = (unsigned char)(fb->len >> (8 * i));
+
+  struct iovec iov[2 + 2 * (3 * ARROW_COLUMNS)];
+  int n = 0;
+  iov[n++] = (struct iovec){prefix, sizeof(prefix)};
+  iov[n++] = (struct iovec){fb->buf, fb->len};
+  for (size_t b = 0; b < bufCount; b++) {
+    if (bufs[b].len)
+      iov[n++] = (struct iovec){(void *)bufs[b].data, bufs[b].len};
+    if (bufs[b].len % 8)
+      iov[n++] = (struct iovec){(void *)zeros, 8 - bufs[b].len % 8};
+  }
+  arrow_writev(sink, iov, n);
+
+  block[0] = st->offset;
+  block[1] = sizeof(prefix) + fb->len;
+  block[2] = body;
+  st->offset += sizeof(prefix) + fb->len + body;
+}
+
+/* Start a Message table; returns the Message and its header offset field */
+static FbTable arrow_message_start(FbWriter *fb, int headerType,
+                                   size_t *headerRef, size_t *bodyLength) {
+  fb->len = 0;
+  size_t root = fb_scalar(fb, 0, 4);
+  FbTable t = fb_table_start(fb, 4);
+  fb_point(fb, root, t.table);
+  fb_field(fb, &t, 0, ARROW_V5, 2);
+  fb_field(fb, &t, 1, (unsigned long long)headerType, 1);
+  *headerRef = fb_ref(fb, &t, 2);
+  *bodyLength = fb_field(fb, &t, 3, 0, 8);
+  fb_table_end(fb, &t);
+  return t;
+}
+
+static void arrow_end(Sink *sink) {
+  ArrowState *st = sink->state;
+  FbWriter fb = {NULL, 0, 0};
+  size_t headerRef, bodyLength;
+  unsigned long long dictBlock[3], batchBlock[3], unused[3];
+
+  sink_flush(sink);
+  static const char magic[8] = "ARROW1";
+  struct iovec m = {(void *)magic, sizeof(magic)};
+  arrow_writev(sink, &m, 1);
+  st->offset = sizeof(magic);
+
+  arrow_message_start(&fb, ARROW_MSG_SCHEMA, &headerRef, &bodyLength);
+  arrow_put_schema(&fb, headerRef);
+  arrow_put_message(sink, st, &fb, bodyLength, NULL, 0, unused);
+
+  /* The comm dictionary: one Utf8 column without nulls */
+  ArrowBuf dictBufs[3] = {
+      {NULL, 0},
+      {st->dictOffsets, (st->dictCount + 1) * sizeof(*st->dictOffsets)},
+      {st->dictData, st->dictLen}};
+  size_t noNulls = 0;
+  arrow_message_start(&fb, ARROW_MSG_DICTIONARY, &headerRef, &bodyLength);
+  FbTable d = fb_table_start(&fb, 2);
+  fb_point(&fb, headerRef, d.table);
+  fb_field(&fb, &d, 0, 0, 8);
+  size_t dataRef = fb_ref(&fb, &d, 1);
+  fb_table_end(&fb, &d);
+  arrow_put_batch(&fb, dataRef, st->dictCount, &noNulls, 1, dictBufs, 3);
+  arrow_put_message(sink, st, &fb, bodyLength, dictBufs, 3, dictBlock);
+
+  /* The record batch, straight from the column arrays */
+  ArrowBuf bufs[2 * ARROW_COLUMNS];
+  size_t nulls[ARROW_COLUMNS] = {0};
+  size_t bitmapLen = (st->rows + 7) / 8, b = 0;
+  bufs[b++] = (ArrowBuf){NULL, 0};
+  bufs[b++] = (ArrowBuf){st->pid, st->rows * sizeof(*st->pid)};
+  bufs[b++] = (ArrowBuf){NULL, 0};
+  bufs[b++] = (ArrowBuf){st->ppid, st->rows * sizeof(*st->ppid)};
+  bufs[b++] = (ArrowBuf){NULL, 0};
+  bufs[b++] = (ArrowBuf){st->comm, st->rows * sizeof(*st->comm)};
+  bufs[b++] = (ArrowBuf){NULL, 0};
+  bufs[b++] = (ArrowBuf){st->thread, bitmapLen};
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    nulls[4 + t] = st->nulls[t];
+    bufs[b++] = (ArrowBuf){st->valid[t], st->nulls[t] ? bitmapLen : 0};
+    bufs[b++] = (ArrowBuf){st->ns[t], st->rows * sizeof(*st->ns[t])};
+  }
+  bufs[b++] = (ArrowBuf){NULL, 0};
+  bufs[b++] = (ArrowBuf){st->diff, st->rows * sizeof(*st->diff)};
+  arrow_message_start(&fb, ARROW_MSG_RECORD_BATCH, &headerRef, &bodyLength);
+  arrow_put_batch(&fb, headerRef, st->rows, nulls, ARROW_COLUMNS, bufs, b);
+  arrow_put_message(sink, st, &fb, bodyLength, bufs, b, batchBlock);
+
+  /* Footer { version, schema, dictionaries, recordBatches } */
+  fb.len = 0;
+  size_t root = fb_scalar(&fb, 0, 4);
+  FbTable f = fb_table_start(&fb, 4);
+  fb_point(&fb, root, f.table);
+  fb_field(&fb, &f, 0, ARROW_V5, 2);
+  size_t schemaRef = fb_ref(&fb, &f, 1);
+  size_t dictsRef = fb_ref(&fb, &f, 2);
+  size_t batchesRef = fb_ref(&fb, &f, 3);
+  fb_table_end(&fb, &f);
+  arrow_put_schema(&fb, schemaRef);
+  const unsigned long long *blocks[2] = {dictBlock, batchBlock};
+  size_t blockRefs[2] = {dictsRef, batchesRef};
+  for (size_t i = 0; i < 2; i++) {
+    fb_point(&fb, blockRefs[i], fb_vector(&fb, 1, 8));
+    fb_scalar(&fb, blocks[i][0], 8);
+    fb_scalar(&fb, blocks[i][1], 4);
+    fb_scalar(&fb, blocks[i][2], 8);
+  }
+  /* End-of-stream marker, footer, footer length, magic */
+  static const unsigned char eos[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0};
+  unsigned char trailer[4 + 6];
+  for (size_t i = 0; i < 4; i++)
+    trailer[i] = (unsigned char)(fb.len >> (8 * i));
+  memcpy(trailer + 4, "ARROW1", 6);
+  struct iovec tail[3] = {{(void *)eos, sizeof(eos)},
+                          {fb.buf, fb.len},
+                          {trailer, sizeof(trailer)}};
+  arrow_writev(sink, tail, 3);
+
+  free(fb.buf);
+  free(st->pid);
+  free(st->ppid);
+  free(st->comm);
+  free(st->thread);
+  free(st->diff);
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    free(st->ns[t]);
+    free(st->valid[t]);
+  }
+  free(st->dictData);
+  free(st->dictOffsets);
+  free(st->slots);
+  free(st);
+  sink->state = NULL;
+}
+
+/* ---- metrics: Prometheus text exposition of what was visited ---- */
+
+/**
+ * struct InoSet - Open-addressing set of namespace inode numbers
+ * @slots: Hash slots, 0 marks an empty slot (inode 0 is never used)
+ * @cap:   Number of slots, always a power of two
+ * @count: Number of inodes stored
+ */
+typedef struct {
+  unsigned long long *slots;
+  size_t cap;
+  size_t count;
+} InoSet;
+
+/**
+ * inoset_add - Insert @ino into @set
+ *
+ * Return: 1 if @ino was not in the set before, 0 otherwise.
+ */
+static int inoset_add(InoSet *set, unsigned long long ino) {
+  if (!ino)
+    return 0;
+  if ((set->count + 1) * 2 > set->cap) {
+    size_t newCap = set->cap ? set->cap * 2 : 64;
+    unsigned long long *slots = calloc(newCap, sizeof(*slots));
+    if (!slots) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < set->cap; i++) {
+      unsigned long long v = set->slots[i];
+      if (!v)
+        continue;
+      size_t h = (size_t)(v * 0x9E3779B97F4A7C15ULL) & (newCap - 1);
+      while (slots[h])
+        h = (h + 1) & (newCap - 1);
+      slots[h] = v;
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->cap = newCap;
+  }
+
+  size_t h = (size_t)(ino * 0x9E3779B97F4A7C15ULL) & (set->cap - 1);
+  while (set->slots[h]) {
+    if (set->slots[h] == ino)
+      return 0;
+    h = (h + 1) & (set->cap - 1);
+  }
+  set->slots[h] = ino;
+  set->count++;
+  return 1;
+}
+
+/**
+ * inoset_contains - Check whether @ino is in @set
+ */
+static int inoset_contains(const InoSet *set, unsigned long long ino) {
+  if (!set->cap || !ino)
+    return 0;
+  size_t h = (size_t)(ino * 0x9E3779B97F4A7C15ULL) & (set->cap - 1);
+  while (set->slots[h]) {
+    if (set->slots[h] == ino)
+      return 1;
+    h = (h + 1) & (set->cap - 1);
+  }
+  return 0;
+}
+
+/**
+ * struct MetricsState - Counters accumulated by the metrics sink
+ * @processes:  Visited main processes
+ * @threads:    Visited threads
+ * @unreadable: Visited tasks whose namespaces could not be read
+ * @boundaries: Per type, tasks whose namespace differs from their parent's
+ * @distinct:   Per type, the set of distinct namespaces seen
+ */
+typedef struct {
+  size_t processes;
+  size_t threads;
+  size_t unreadable;
+  size_t boundaries[NS_TYPE_COUNT];
+  InoSet distinct[NS_TYPE_COUNT];
+} MetricsState;
+
+static void metrics_begin(Sink *sink) {
+  MetricsState *m = calloc(1, sizeof(*m));
+  if (!m) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  sink->state = m;
+}
+
+static void metrics_node(Sink *sink, const VisitInfo *visit) {
+  MetricsState *m = sink->state;
+  const ProcInfo *proc = visit->proc;
+
+  if (proc->isThread)
+    m->threads++;
+  else
+    m->processes++;
+  if (!proc->nsReadable)
+    m->unreadable++;
+
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    int t = proc->namespaces[i].typeIdx;
+    if (t < 0)
+      continue;
+    inoset_add(&m->distinct[t], proc->namespaces[i].ino);
+    /* The root has no parent, so it is not a boundary */
+    if (visit->parentNs && (visit->diffMask & (1u << i)))
+      m->boundaries[t]++;
+  }
+}
+
+static void metrics_end(Sink *sink) {
+  MetricsState *m = sink->state;
+
+  sink_puts(sink, "# HELP nstree_tasks Tasks visited in the process tree.\n"
+                  "# TYPE nstree_tasks gauge\n");
+  sink_printf(sink, "nstree_tasks{kind=\"process\"} %zu\n", m->processes);
+  sink_printf(sink, "nstree_tasks{kind=\"thread\"} %zu\n", m->threads);
+
+  sink_puts(sink, "# HELP nstree_unreadable_tasks Tasks whose namespaces "
+                  "could not be read.\n"
+                  "# TYPE nstree_unreadable_tasks gauge\n");
+  sink_printf(sink, "nstree_unreadable_tasks %zu\n", m->unreadable);
+
+  sink_puts(sink, "# HELP nstree_namespaces Distinct namespaces per type.\n"
+                  "# TYPE nstree_namespaces gauge\n");
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (strstr(g_nsTypes[t], "_for_children"))
+      continue;
+    sink_printf(sink, "nstree_namespaces{type=\"%s\"} %zu\n", g_nsTypes[t],
+                m->distinct[t].count);
+  }
+
+  sink_puts(sink, "# HELP nstree_namespace_boundaries Tasks whose namespace "
+                  "differs from their parent's.\n"
+                  "# TYPE nstree_namespace_boundaries gauge\n");
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (strstr(g_nsTypes[t], "_for_children"))
+      continue;
+    sink_printf(sink, "nstree_namespace_boundaries{type=\"%s\"} %zu\n",
+                g_nsTypes[t], m->boundaries[t]);
+  }
+
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++)
+    free(m->distinct[t].slots);
+  free(m);
+  sink->state = NULL;
+}
+
+/* ---- census / by-ns: member counts, optionally estimated from a sample ---- */
+
+/**
+ * struct NsCount - Members of one namespace seen during a traversal
+ * @ino:       Namespace inode; 0 marks an empty slot
+ * @typeIdx:   Index into g_nsTypes
+ * @processes: Processes in the namespace (always counted exactly)
+ * @threads:   Threads in the namespace that were scanned
+ * @cpuTicks:  CPU time used by members over the last interval (cpu, top)
+ * @rssPages:  Resident pages of member processes (top only)
+ * @boundary:  First task met that entered this namespace (top only)
+ */
+typedef struct {
+  unsigned long long ino;
+  int typeIdx;
+  size_t processes;
+  size_t threads;
+  unsigned long long cpuTicks;
+  unsigned long long rssPages;
+  pid_t boundary;
+} NsCount;
+
+/**
+ * struct CensusState - Accumulator shared by the census, by-ns, cpu and top
+ *                       sinks
+ * @slots:        Open-addressing table of NsCount, keyed by inode
+ * @cap:          Number of slots, always a power of two
+ * @count:        Occupied slots
+ * @processes:    Visited processes
+ * @threads:      Visited (scanned) threads
+ * @totalThreads: Threads according to the processes' num_threads, which is
+ *                exact even when only a sample of threads is scanned
+ */
+typedef struct {
+  NsCount *slots;
+  size_t cap;
+  size_t count;
+  size_t processes;
+  size_t threads;
+  size_t totalThreads;
+} CensusState;
+
+static NsCount *census_get(CensusState *c, unsigned long long ino,
+                           int typeIdx) {
+  if ((c->count + 1) * 2 > c->cap) {
+    size_t oldCap = c->cap;
+    NsCount *old = c->slots;
+    c->cap = oldCap ? oldCap * 2 : 64;
+    c->slots = calloc(c->cap, sizeof(*c->slots));
+    if (!c->slots) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < oldCap; i++) {
+      if (!old[i].ino)
+        continue;
+      size_t h = ns_hash(old[i].ino, c->cap);
+      while (c->slots[h].ino)
+        h = (h + 1) & (c->cap - 1);
+      c->slots[h] = old[i];
+    }
+    free(old);
+  }
+
+  size_t h = ns_hash(ino, c->cap);
+  while (c->slots[h].ino && c->slots[h].ino != ino)
+    h = (h + 1) & (c->cap - 1);
+  if (!c->slots[h].ino) {
+    c->slots[h].ino = ino;
+    c->slots[h].typeIdx = typeIdx;
+    c->count++;
+  }
+  return &c->slots[h];
+}
+
+static void census_begin(Sink *sink) {
+  CensusState *c = calloc(1, sizeof(*c));
+  if (!c) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  sink->state = c;
+}
+
+static void census_node(Sink *sink, const VisitInfo *visit) {
+  CensusState *c = sink->state;
+  const ProcInfo *proc = visit->proc;
+
+  if (proc->isThread) {
+    c->threads++;
+  } else {
+    c->processes++;
+    if (proc->numThreads > 1)
+      c->totalThreads += (size_t)proc->numThreads - 1;
+  }
+
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    const NamespaceEntry *ns = &proc->namespaces[i];
+    if (ns->typeIdx < 0 || strstr(g_nsTypes[ns->typeIdx], "_for_children"))
+      continue;
+    NsCount *n = census_get(c, ns->ino, ns->typeIdx);
+    if (proc->isThread)
+      n->threads++;
+    else
+      n->processes++;
+  }
+}
+
+/**
+ * census_put_threads - Print a thread count, scaled if threads are sampled
+ * @sampled: Threads actually scanned
+ *
+ * Threads are sampled independently with probability p = g_sampleRate, so
+ * the Horvitz-Thompson estimate is k/p with variance k(1-p)/p^2; the
+ * interval printed is the normal-approximation 95% interval.
+ */
+static void census_put_threads(Sink *sink, size_t sampled) {
+  if (g_sampleRate >= 1.0) {
+    sink_printf(sink, "%zu", sampled);
+    return;
+  }
+  double p = g_sampleRate;
+  double est = (double)sampled / p;
+  double half = 1.96 * sqrt((double)sampled * (1.0 - p)) / p;
+  sink_printf(sink, "%.0f ±%.0f", est, half);
+}
+
+static void census_free(Sink *sink) {
+  CensusState *c = sink->state;
+  free(c->slots);
+  free(c);
+  sink->state = NULL;
+}
+
+static void census_end(Sink *sink) {
+  CensusState *c = sink->state;
+  size_t perType[NS_TYPE_COUNT] = {0};
+
+  for (size_t i = 0; i < c->cap; i++) {
+    if (c->slots[i].ino)
+      perType[c->slots[i].typeIdx]++;
+  }
+
+  sink_printf(sink, "%-12s %zu\n", "processes", c->processes);
+  sink_printf(sink, "%-12s ", "threads");
+  census_put_threads(sink, c->threads);
+  if (g_sampleRate < 1.0)
+    sink_printf(sink, " (sample rate %g, num_threads total %zu)",
+                g_sampleRate, c->totalThreads);
+  sink_puts(sink, "\n");
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (strstr(g_nsTypes[t], "_for_children"))
+      continue;
+    sink_printf(sink, "%-12s %-6s %zu\n", "namespaces", g_nsTypes[t],
+                perType[t]);
+  }
+  census_free(sink);
+}
+
+static int nscount_compare(const void *a, const void *b) {
+  const NsCount *x = a, *y = b;
+  if (x->typeIdx != y->typeIdx)
+    return x->typeIdx < y->typeIdx ? -1 : 1;
+  size_t xm = x->processes + x->threads, ym = y->processes + y->threads;
+  if (xm != ym)
+    return xm > ym ? -1 : 1;
+  return x->ino < y->ino ? -1 : (x->ino > y->ino);
+}
+
+static void by_ns_end(Sink *sink) {
+  CensusState *c = sink->state;
+
+  /* Compact the table in place and order it by type, then size */
+  size_t n = 0;
+  for (size_t i = 0; i < c->cap; i++) {
+    if (c->slots[i].ino)
+      c->slots[n++] = c->slots[i];
+  }
+  qsort(c->slots, n, sizeof(*c->slots), nscount_compare);
+
+  sink_printf(sink, "%-8s %-12s %10s  %s\n", "TYPE", "INODE", "PROCESSES",
+              "THREADS");
+  for (size_t i = 0; i < n; i++) {
+    const NsCount *e = &c->slots[i];
+    sink_printf(sink, "%-8s %-12llu %10zu  ", g_nsTypes[e->typeIdx], e->ino,
+                e->processes);
+    census_put_threads(sink, e->threads);
+    sink_puts(sink, "\n");
+  }
+  census_free(sink);
+}
+
+/* ---- cpu: CPU use per namespace over the last watch interval ---- */
+
+/**
+ * struct CpuShare - CPU time of exited tasks charged to one namespace
+ * @ino:     Namespace inode
+ * @typeIdx: Index into g_nsTypes
+ * @ticks:   Clock ticks used since the previous listing
+ */
+typedef struct {
+  unsigned long long ino;
+  int typeIdx;
+  unsigned long long ticks;
+} CpuShare;
+
+static int g_cpuAccounting = 0;    /* a cpu output was requested */
+static double g_cpuInterval = 0.0; /* seconds between the last two listings */
+static CpuShare *g_cpuExited = NULL; /* filled by watch_tick() */
+static size_t g_cpuExitedCount = 0;
+static size_t g_cpuExitedCap = 0;
+static unsigned long long g_cpuExitedTicks = 0; /* all exited tasks */
+
+static void cpu_node(Sink *sink, const VisitInfo *visit) {
+  CensusState *c = sink->state;
+  const ProcInfo *proc = visit->proc;
+
+  /* A process's stat already includes all of its threads */
+  if (proc->isThread)
+    return;
+  c->processes++;
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    const NamespaceEntry *ns = &proc->namespaces[i];
+    if (ns->typeIdx < 0 || strstr(g_nsTypes[ns->typeIdx], "_for_children"))
+      continue;
+    NsCount *n = census_get(c, ns->ino, ns->typeIdx);
+    n->processes++;
+    n->cpuTicks += proc->cpuDelta;
+  }
+}
+
+static int cpu_ns_compare(const void *a, const void *b) {
+  const NsCount *x = a, *y = b;
+  if (x->cpuTicks != y->cpuTicks)
+    return x->cpuTicks > y->cpuTicks ? -1 : 1;
+  if (x->typeIdx != y->typeIdx)
+    return x->typeIdx < y->typeIdx ? -1 : 1;
+  return x->ino < y->ino ? -1 : (x->ino > y->ino);
+}
+
+static int cpu_task_compare(const void *a, const void *b) {
+  const ProcInfo *x = *(const ProcInfo *const *)a;
+  const ProcInfo *y = *(const ProcInfo *const *)b;
+  if (x->cpuDelta != y->cpuDelta)
+    return x->cpuDelta > y->cpuDelta ? -1 : 1;
+  return x->pid < y->pid ? -1 : (x->pid > y->pid);
+}
+
+/**
+ * cpu_end - Print CPU% per namespace and per process for the last interval
+ *
+ * Namespaces include the exited tasks' share; processes that used no CPU
+ * and namespaces that saw none are left out.
+ */
+static void cpu_end(Sink *sink) {
+  CensusState *c = sink->state;
+
+  if (g_cpuInterval <= 0.0) {
+    sink_puts(sink, "# waiting for a second sample\n");
+    census_free(sink);
+    return;
+  }
+  double scale = 100.0 / ((double)sysconf(_SC_CLK_TCK) * g_cpuInterval);
+
+  for (size_t i = 0; i < g_cpuExitedCount; i++) {
+    NsCount *n =
+        census_get(c, g_cpuExited[i].ino, g_cpuExited[i].typeIdx);
+    n->cpuTicks += g_cpuExited[i].ticks;
+  }
+
+  size_t n = 0;
+  for (size_t i = 0; i < c->cap; i++) {
+    if (c->slots[i].ino && c->slots[i].cpuTicks)
+      c->slots[n++] = c->slots[i];
+  }
+  qsort(c->slots, n, sizeof(*c->slots), cpu_ns_compare);
+
+  const ProcInfo **busy = malloc((g_procCount + 1) * sizeof(*busy));
+  if (!busy) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  size_t busyCount = 0;
+  unsigned long long total = g_cpuExitedTicks;
+  for (size_t i = 0; i < g_procCount; i++) {
+    const ProcInfo *proc = &g_processes[i];
+    if (proc->keep && !proc->isThread && proc->cpuDelta) {
+      busy[busyCount++] = proc;
+      total += proc->cpuDelta;
+    }
+  }
+  qsort(busy, busyCount, sizeof(*busy), cpu_task_compare);
+
+  sink_printf(sink, "%-12s %.3fs\n", "interval", g_cpuInterval);
+  sink_printf(sink, "%-12s %.1f%% (exited tasks %.1f%%)\n", "cpu",
+              (double)total * scale, (double)g_cpuExitedTicks * scale);
+  sink_printf(sink, "%-8s %-12s %7s %10s\n", "TYPE", "INODE", "CPU%",
+              "PROCESSES");
+  for (size_t i = 0; i < n; i++) {
+    const NsCount *e = &c->slots[i];
+    sink_printf(sink, "%-8s %-12llu %7.1f %10zu\n", g_nsTypes[e->typeIdx],
+                e->ino, (double)e->cpuTicks * scale, e->processes);
+  }
+  sink_printf(sink, "%-8s %7s  %s\n", "PID", "CPU%", "COMM");
+  for (size_t i = 0; i < busyCount; i++)
+    sink_printf(sink, "%-8d %7.1f  %s\n", busy[i]->pid,
+                (double)busy[i]->cpuDelta * scale, busy[i]->comm);
+  free(busy);
+  census_free(sink);
+}
+
+/* ---- creators: namespace creation rates by creating process ---- */
+
+/*
+ * A namespace that gains its first member in watch mode is charged to the
+ * parent of that member: "unshare -n cmd" and container runtimes fork the
+ * task that enters the new namespace, so its parent is the agent asking for
+ * it. Each creator keeps a ring of per-bucket creation counts, which gives
+ * sliding-window rates in constant memory, and at most CREATORS_MAX
+ * creators are tracked at once.
+ */
+
+#ifndef CREATORS_MAX
+#define CREATORS_MAX 256
+#endif
+#define CREATORS_BUCKET 10   /* seconds per ring bucket */
+#define CREATORS_BUCKETS 30  /* ring length: a 5 minute window */
+#define CREATORS_TOP 10      /* creators listed per report */
+
+/**
+ * struct Creator - A process that created namespaces
+ * @pid:       Creating process; 0 = free slot
+ * @starttime: Its start time, to tell a reused PID apart
+ * @comm:      Its command name, "?" if it had already exited
+ * @typeMask:  Namespace types it created (bits over g_nsTypes)
+ * @total:     Namespaces created since it was first seen
+ * @stamp:     Bucket number each @count entry belongs to
+ * @count:     Creations per bucket, indexed by bucket number modulo
+ *             CREATORS_BUCKETS
+ */
+typedef struct {
+  pid_t pid;
+  unsigned long long starttime;
+  char comm[256];
+  unsigned int typeMask;
+  unsigned long long total;
+  unsigned long stamp[CREATORS_BUCKETS];
+  unsigned int count[CREATORS_BUCKETS];
+} Creator;
+
+static int g_creatorTracking = 0;            /* a creators output exists */
+static Creator g_creators[CREATORS_MAX];
+static size_t g_creatorCount = 0;            /* used slots */
+static unsigned long long g_creations = 0;   /* all attributed creations */
+static unsigned long long g_creatorsEvicted = 0; /* creators pushed out */
+static double g_creatorsSince = 0.0;         /* when counting started */
+static unsigned long g_creatorsSortBucket;   /* current bucket, for qsort */
+
+/* Seconds on the monotonic clock */
+static double creators_clock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/* Creations by @c in the last @buckets buckets up to and including @cur */
+static unsigned long long creator_window(const Creator *c, unsigned long cur,
+                                         unsigned long buckets) {
+  unsigned long long sum = 0;
+  for (size_t b = 0; b < CREATORS_BUCKETS; b++) {
+    if (c->stamp[b] + buckets > cur && c->stamp[b] <= cur)
+      sum += c->count[b];
+  }
+  return sum;
+}
+
+/**
+ * creators_record - Charge one new namespace of type @typeIdx to @ppid
+ *
+ * Must run while g_pidIndex is current. When the table is full, the
+ * creator with the fewest creations in the whole window makes room.
+ */
+static void creators_record(pid_t ppid, int typeIdx) {
+  double now = creators_clock();
+  unsigned long cur = (unsigned long)(now / CREATORS_BUCKET);
+  ssize_t idx = pid_index_find(ppid);
+  const ProcInfo *parent = idx >= 0 ? &g_processes[idx] : NULL;
+  unsigned long long starttime = parent ? parent->starttime : 0;
+
+  Creator *c = NULL;
+  for (size_t i = 0; i < g_creatorCount && !c; i++) {
+    if (g_creators[i].pid == ppid && g_creators[i].starttime == starttime)
+      c = &g_creators[i];
+  }
+  if (!c) {
+    if (g_creatorCount < CREATORS_MAX) {
+      c = &g_creators[g_creatorCount++];
+    } else {
+      unsigned long long least = 0;
+      for (size_t i = 0; i < CREATORS_MAX; i++) {
+        unsigned long long n =
+            creator_window(&g_creators[i], cur, CREATORS_BUCKETS);
+        if (!c || n < least) {
+          c = &g_creators[i];
+          least = n;
+        }
+      }
+      g_creatorsEvicted++;
+    }
+    memset(c, 0, sizeof(*c));
+    c->pid = ppid;
+    c->starttime = starttime;
+    if (parent)
+      memcpy(c->comm, parent->comm, sizeof(c->comm));
+    else
+      strcpy(c->comm, "?");
+  }
+
+  size_t b = cur % CREATORS_BUCKETS;
+  if (c->stamp[b] != cur) {
+    c->stamp[b] = cur;
+    c->count[b] = 0;
+  }
+  c->count[b]++;
+  c->total++;
+  c->typeMask |= 1u << typeIdx;
+  g_creations++;
+}
+
+/* Creations are fed by the watch tick, not by the traversal */
+static void creators_node(Sink *sink, const VisitInfo *visit) {
+  (void)sink;
+  (void)visit;
+}
+
+/**
+ * creators_rate - Creations per minute by @c over the last @buckets buckets
+ *
+ * The oldest bucket in the window is only partly inside it, so the count is
+ * divided by the time actually covered, which never predates the start of
+ * counting.
+ */
+static double creators_rate(const Creator *c, double now,
+                            unsigned long buckets) {
+  unsigned long cur = (unsigned long)(now / CREATORS_BUCKET);
+  double from = (double)(cur + 1 - buckets) * CREATORS_BUCKET;
+  if (from < g_creatorsSince)
+    from = g_creatorsSince;
+  double span = now - from > 1.0 ? now - from : 1.0;
+  return (double)creator_window(c, cur, buckets) * 60.0 / span;
+}
+
+static int creators_compare(const void *a, const void *b) {
+  const Creator *x = *(const Creator *const *)a;
+  const Creator *y = *(const Creator *const *)b;
+  unsigned long cur = g_creatorsSortBucket;
+  unsigned long long xm = creator_window(x, cur, 60 / CREATORS_BUCKET);
+  unsigned long long ym = creator_window(y, cur, 60 / CREATORS_BUCKET);
+  if (xm != ym)
+    return xm > ym ? -1 : 1;
+  xm = creator_window(x, cur, CREATORS_BUCKETS);
+  ym = creator_window(y, cur, CREATORS_BUCKETS);
+  if (xm != ym)
+    return xm > ym ? -1 : 1;
+  return x->pid < y->pid ? -1 : (x->pid > y->pid);
+}
+
+/**
+ * creators_end - Print the busiest namespace creators of the last 5 minutes
+ *
+ * Creators are ranked by their creations in the last minute, then in the
+ * last 5 minutes; those idle for the whole window are left out.
+ */
+static void creators_end(Sink *sink) {
+  double now = creators_clock();
+  unsigned long cur = (unsigned long)(now / CREATORS_BUCKET);
+  const Creator *active[CREATORS_MAX];
+  size_t n = 0;
+  for (size_t i = 0; i < g_creatorCount; i++) {
+    if (creator_window(&g_creators[i], cur, CREATORS_BUCKETS))
+      active[n++] = &g_creators[i];
+  }
+  g_creatorsSortBucket = cur;
+  qsort(active, n, sizeof(*active), creators_compare);
+
+  sink_printf(sink, "%-12s %llu (%zu creators tracked, %llu evicted)\n",
+              "created", g_creations, g_creatorCount, g_creatorsEvicted);
+  sink_printf(sink, "%-8s %10s %10s %9s  %-16s %s\n", "PID", "PER-MIN-1M",
+              "PER-MIN-5M", "TOTAL", "COMM", "TYPES");
+  for (size_t i = 0; i < n && i < CREATORS_TOP; i++) {
+    const Creator *c = active[i];
+    sink_printf(sink, "%-8d %10.1f %10.1f %9llu  %-16s ", c->pid,
+                creators_rate(c, now, 60 / CREATORS_BUCKET),
+                creators_rate(c, now, CREATORS_BUCKETS), c->total, c->comm);
+    const char *sep = "";
+    for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+      if (c->typeMask & (1u << t)) {
+        sink_printf(sink, "%s%s", sep, g_nsTypes[t]);
+        sep = ",";
+      }
+    }
+    sink_puts(sink, "\n");
+  }
+}
+
+/* ---- top: the heaviest namespaces entered below the root ---- */
+
+enum { TOP_TASKS, TOP_RSS, TOP_CPU };
+static const char *const g_topMetricNames[] = {"tasks", "rss", "cpu"};
+
+static size_t g_topK = 20;           /* --top=K */
+static int g_topMetric = TOP_TASKS;  /* --top=K:METRIC */
+
+static void top_node(Sink *sink, const VisitInfo *visit) {
+  CensusState *c = sink->state;
+  const ProcInfo *proc = visit->proc;
+
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    const NamespaceEntry *ns = &proc->namespaces[i];
+    if (ns->typeIdx < 0 || strstr(g_nsTypes[ns->typeIdx], "_for_children"))
+      continue;
+    NsCount *n = census_get(c, ns->ino, ns->typeIdx);
+    if (proc->isThread) {
+      n->threads++;
+    } else {
+      /* A process's stat already covers all of its threads */
+      n->processes++;
+      n->cpuTicks += proc->cpuDelta;
+      if (proc->rssPages > 0)
+        n->rssPages += (unsigned long long)proc->rssPages;
+    }
+    /* The root's namespaces are the host's, not a container's */
+    if (!n->boundary && visit->depth > 0 && (visit->diffMask & (1u << i)))
+      n->boundary = proc->pid;
+  }
+}
+
+static unsigned long long top_value(const NsCount *n) {
+  switch (g_topMetric) {
+  case TOP_RSS:
+    return n->rssPages;
+  case TOP_CPU:
+    return n->cpuTicks;
+  default:
+    return n->processes + n->threads;
+  }
+}
+
+/* Restore the min-heap property below @i */
+static void top_sift_down(NsCount **heap, size_t count, size_t i) {
+  for (;;) {
+    size_t min = i, l = 2 * i + 1, r = l + 1;
+    if (l < count && top_value(heap[l]) < top_value(heap[min]))
+      min = l;
+    if (r < count && top_value(heap[r]) < top_value(heap[min]))
+      min = r;
+    if (min == i)
+      return;
+    NsCount *tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+/* Print "comm(pid) > ... > comm(pid)" from the root down to @proc */
+static void top_put_path(Sink *sink, const ProcInfo *proc) {
+  if (proc->parent) {
+    top_put_path(sink, proc->parent);
+    sink_puts(sink, " > ");
+  }
+  sink_printf(sink, "%s(%d)", proc->comm, proc->pid);
+}
+
+/**
+ * top_end - Print the g_topK heaviest namespaces entered below the root
+ *
+ * Candidates go through a min-heap of g_topK entries whose root is the
+ * lightest winner so far, so selection costs O(n log K) instead of a sort
+ * of every namespace, and only the winners are ordered for printing. Each
+ * line ends with the ancestry of the first task that entered the
+ * namespace.
+ */
+static void top_end(Sink *sink) {
+  CensusState *c = sink->state;
+  NsCount **heap = malloc((g_topK ? g_topK : 1) * sizeof(*heap));
+  if (!heap) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  size_t count = 0;
+
+  /* Tasks that exited during the interval still count towards CPU */
+  for (size_t i = 0; g_topMetric == TOP_CPU && i < g_cpuExitedCount; i++) {
+    NsCount *n = census_get(c, g_cpuExited[i].ino, g_cpuExited[i].typeIdx);
+    n->cpuTicks += g_cpuExited[i].ticks;
+  }
+
+  for (size_t i = 0; i < c->cap; i++) {
+    NsCount *n = &c->slots[i];
+    if (!n->ino || !n->boundary)
+      continue;
+    if (count < g_topK) {
+      /* Sift up */
+      size_t j = count++;
+      heap[j] = n;
+      while (j > 0 && top_value(heap[(j - 1) / 2]) > top_value(heap[j])) {
+        NsCount *tmp = heap[j];
+        heap[j] = heap[(j - 1) / 2];
+        heap[(j - 1) / 2] = tmp;
+        j = (j - 1) / 2;
+      }
+    } else if (count && top_value(n) > top_value(heap[0])) {
+      heap[0] = n;
+      top_sift_down(heap, count, 0);
+    }
+  }
+
+  /* Heap sort in place: repeatedly move the lightest to the back */
+  for (size_t end = count; end > 1; end--) {
+    NsCount *tmp = heap[0];
+    heap[0] = heap[end - 1];
+    heap[end - 1] = tmp;
+    top_sift_down(heap, end - 1, 0);
+  }
+
+  double scale = 1.0;
+  const char *header = "TASKS";
+  if (g_topMetric == TOP_RSS) {
+    scale = (double)sysconf(_SC_PAGESIZE) / 1024.0;
+    header = "RSS_KIB";
+  } else if (g_topMetric == TOP_CPU) {
+    scale = g_cpuInterval > 0.0
+                ? 100.0 / ((double)sysconf(_SC_CLK_TCK) * g_cpuInterval)
+                : 0.0;
+    header = "CPU%";
+  }
+
+  sink_printf(sink, "%-4s %-8s %-12s %10s  %s\n", "RANK", "TYPE", "INODE",
+              header, "ENTERED BY");
+  for (size_t i = 0; i < count; i++) {
+    const NsCount *n = heap[i];
+    sink_printf(sink, "%-4zu %-8s %-12llu ", i + 1, g_nsTypes[n->typeIdx],
+                n->ino);
+    if (g_topMetric == TOP_CPU)
+      sink_printf(sink, "%10.1f  ", (double)n->cpuTicks * scale);
+    else
+      sink_printf(sink, "%10.0f  ", (double)top_value(n) * scale);
+    ssize_t idx = pid_index_find(n->boundary);
+    if (idx >= 0)
+      top_put_path(sink, &g_processes[idx]);
+    sink_puts(sink, "\n");
+  }
+  free(heap);
+  census_free(sink);
+}
+
+/**
+ * parse_top - Parse "K[:METRIC]" as given to --top
+ *
+ * Return: 0 on success, -1 on a malformed count or unknown metric.
+ */
+static int parse_top(const char *arg) {
+  char *end;
+  unsigned long k = strtoul(arg, &end, 10);
+  if (end == arg || k == 0 || (*end && *end != ':'))
+    return -1;
+  g_topK = k;
+  if (*end == ':') {
+    size_t m;
+    for (m = 0; m < sizeof(g_topMetricNames) / sizeof(g_topMetricNames[0]);
+         m++) {
+      if (strcmp(end + 1, g_topMetricNames[m]) == 0)
+        break;
+    }
+    if (m == sizeof(g_topMetricNames) / sizeof(g_topMetricNames[0]))
+      return -1;
+    g_topMetric = (int)m;
+  }
+  return 0;
+}
+
+/* ---- groups: tasks joined on a tuple of shared namespaces ---- */
+
+/* --group-by=LIST: the namespace types (bits over g_nsTypes) to join on */
+static unsigned int g_groupMask = 0;
+
+/**
+ * struct NsGroup - Tasks sharing one tuple of the g_groupMask namespaces
+ * @key:     Inode per g_nsTypes index; only g_groupMask types are set
+ * @members: Member roots, i.e. tasks whose tuple differs from their parent's
+ * @tasks:   All visited tasks with this tuple
+ * @first:   Offset of the first member in GroupState.members, later the
+ *           fill cursor of the counting sort
+ * @number:  Printed group number, assigned once the groups are ordered
+ */
+typedef struct {
+  unsigned long long key[NS_TYPE_COUNT];
+  size_t members;
+  size_t tasks;
+  size_t first;
+  size_t number;
+} NsGroup;
+
+/**
+ * struct GroupMember - One member root, in traversal order
+ * @proc:  The task heading the member's subtree
+ * @group: Index into GroupState.groups
+ */
+typedef struct {
+  const ProcInfo *proc;
+  size_t group;
+} GroupMember;
+
+/**
+ * struct GroupState - Hash join of visited tasks on their namespace tuple
+ * @groups:  Groups in order of first appearance
+ * @count:   Number of groups
+ * @cap:     Allocated size of @groups
+ * @slots:   Open-addressing index into @groups (index + 1, 0 = empty)
+ * @slotCap: Number of slots, always a power of two
+ * @members: Member roots in traversal order
+ * @memberCount: Number of member roots
+ * @memberCap:   Allocated size of @members
+ */
+typedef struct {
+  NsGroup *groups;
+  size_t count;
+  size_t cap;
+  size_t *slots;
+  size_t slotCap;
+  GroupMember *members;
+  size_t memberCount;
+  size_t memberCap;
+} GroupState;
+
+static void group_key(const ProcInfo *proc, unsigned long long *key) {
+  memset(key, 0, NS_TYPE_COUNT * sizeof(*key));
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    int t = proc->namespaces[i].typeIdx;
+    if (t >= 0 && (g_groupMask & (1u << t)))
+      key[t] = proc->namespaces[i].ino;
+  }
+}
+
+static size_t group_hash(const unsigned long long *key, size_t cap) {
+  unsigned long long h = 0;
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++)
+    h = (h ^ key[t]) * 0x9E3779B97F4A7C15ULL;
+  return (size_t)(h >> 21) & (cap - 1);
+}
+
+/**
+ * group_find - Look up the group of @key
+ * @create: Add an empty group if there is none yet
+ *
+ * Return: index into g->groups, or -1 if absent and !@create.
+ */
+static ssize_t group_find(GroupState *g, const unsigned long long *key,
+                          int create) {
+  if (create && (g->count + 1) * 2 > g->slotCap) {
+    free(g->slots);
+    g->slotCap = g->slotCap ? g->slotCap * 2 : 64;
+    g->slots = calloc(g->slotCap, sizeof(*g->slots));
+    if (!g->slots) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < g->count; i++) {
+      size_t h = group_hash(g->groups[i].key, g->slotCap);
+      while (g->slots[h])
+        h = (h + 1) & (g->slotCap - 1);
+      g->slots[h] = i + 1;
+    }
+  }
+  if (!g->slotCap)
+    return -1;
+
+  size_t h = group_hash(key, g->slotCap);
+  while (g->slots[h]) {
+    NsGroup *grp = &g->groups[g->slots[h] - 1];
+    if (memcmp(grp->key, key, sizeof(grp->key)) == 0)
+      return (ssize_t)(g->slots[h] - 1);
+    h = (h + 1) & (g->slotCap - 1);
+  }
+  if (!create)
+    return -1;
+
+  if (g->count == g->cap) {
+    size_t newCap = g->cap ? g->cap * 2 : 64;
+    NsGroup *tmp = realloc(g->groups, newCap * sizeof(*tmp));
+    if (!tmp) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    g->groups = tmp;
+    g->cap = newCap;
+  }
+  NsGroup *grp = &g->groups[g->count];
+  memset(grp, 0, sizeof(*grp));
+  memcpy(grp->key, key, sizeof(grp->key));
+  g->slots[h] = ++g->count;
+  return (ssize_t)(g->count - 1);
+}
+
+static void groups_begin(Sink *sink) {
+  GroupState *g = calloc(1, sizeof(*g));
+  if (!g) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  sink->state = g;
+}
+
+static void groups_node(Sink *sink, const VisitInfo *visit) {
+  GroupState *g = sink->state;
+  const ProcInfo *proc = visit->proc;
+  unsigned long long key[NS_TYPE_COUNT];
+
+  group_key(proc, key);
+  size_t idx = (size_t)group_find(g, key, 1);
+  g->groups[idx].tasks++;
+
+  /* A task heads a member unless it shares its parent's whole tuple */
+  int member = (visit->depth == 0);
+  for (size_t i = 0; !member && i < proc->nsCount; i++) {
+    int t = proc->namespaces[i].typeIdx;
+    if (t >= 0 && (g_groupMask & (1u << t)) && (visit->diffMask & (1u << i)))
+      member = 1;
+  }
+  if (!member)
+    return;
+
+  if (g->memberCount == g->memberCap) {
+    size_t newCap = g->memberCap ? g->memberCap * 2 : 64;
+    GroupMember *tmp = realloc(g->members, newCap * sizeof(*tmp));
+    if (!tmp) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    g->members = tmp;
+    g->memberCap = newCap;
+  }
+  g->members[g->memberCount].proc = proc;
+  g->members[g->memberCount].group = idx;
+  g->memberCount++;
+  g->groups[idx].members++;
+}
+
+/**
+ * groups_put_subtree - Print the part of a member's subtree in its group
+ * @group: The member's group
+ *
+ * Descendants that enter another tuple head members of their own group;
+ * they are printed as a single line pointing at that group.
+ */
+static void groups_put_subtree(Sink *sink, GroupState *g, const ProcInfo *proc,
+                               const char *prefix, size_t group) {
+  int lastKeptIdx = -1;
+  for (int i = (int)proc->childCount - 1; i >= 0; i--) {
+    if (proc->children[i]->keep) {
+      lastKeptIdx = i;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < proc->childCount; i++) {
+    const ProcInfo *child = proc->children[i];
+    if (!child->keep)
+      continue;
+    int isLast = ((int)i == lastKeptIdx);
+    unsigned long long key[NS_TYPE_COUNT];
+    group_key(child, key);
+    ssize_t other = group_find(g, key, 0);
+
+    sink_printf(sink, "%s%s%s%s(%d)", prefix, isLast ? "└─" : "├─",
+                child->isThread ? "{" : "", child->comm, child->pid);
+    if (child->isThread)
+      sink_puts(sink, "}");
+    if (other >= 0 && (size_t)other != group) {
+      sink_printf(sink, " -> group %zu\n", g->groups[other].number);
+      continue;
+    }
+    unsigned int mask =
+        namespace_diff_mask(child, proc->namespaces, proc->nsCount);
+    int first = 1;
+    for (size_t n = 0; n < child->nsCount; n++) {
+      if (!(mask & (1u << n)))
+        continue;
+      sink_puts(sink, first ? " [" : ", ");
+      sink_puts(sink, child->namespaces[n].inode);
+      first = 0;
+    }
+    sink_puts(sink, first ? "\n" : "]\n");
+
+    char newPrefix[1024];
+    snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix,
+             isLast ? "  " : "│ ");
+    groups_put_subtree(sink, g, child, newPrefix, group);
+  }
+}
+
+static int group_compare(const void *a, const void *b) {
+  const NsGroup *const *x = a, *const *y = b;
+  if ((*x)->members != (*y)->members)
+    return (*x)->members > (*y)->members ? -1 : 1;
+  return *x < *y ? -1 : (*x > *y);
+}
+
+/**
+ * groups_end - Print every group with its member subtrees
+ *
+ * Groups with the most members come first, so pods sort above the host.
+ * Members are bucketed by group with a counting sort, keeping traversal
+ * order within a group. Each member root lists the namespaces in which it
+ * differs from the group's first member.
+ */
+static void groups_end(Sink *sink) {
+  GroupState *g = sink->state;
+
+  NsGroup **order = malloc((g->count + 1) * sizeof(*order));
+  GroupMember *sorted = malloc((g->memberCount + 1) * sizeof(*sorted));
+  if (!order || !sorted) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < g->count; i++) {
+    order[i] = &g->groups[i];
+    g->groups[i].first = offset;
+    offset += g->groups[i].members;
+  }
+  for (size_t i = 0; i < g->memberCount; i++)
+    sorted[g->groups[g->members[i].group].first++] = g->members[i];
+  for (size_t i = 0; i < g->count; i++)
+    g->groups[i].first -= g->groups[i].members;
+
+  qsort(order, g->count, sizeof(*order), group_compare);
+  for (size_t i = 0; i < g->count; i++)
+    order[i]->number = i + 1;
+
+  for (size_t i = 0; i < g->count; i++) {
+    const NsGroup *grp = order[i];
+    size_t idx = (size_t)(grp - g->groups);
+    if (!grp->members)
+      continue;
+
+    sink_printf(sink, "group %zu", grp->number);
+    for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+      if (!(g_groupMask & (1u << t)))
+        continue;
+      if (grp->key[t])
+        sink_printf(sink, " %s:[%llu]", g_nsTypes[t], grp->key[t]);
+      else
+        sink_printf(sink, " %s:*", g_nsTypes[t]);
+    }
+    sink_printf(sink, " (%zu member%s, %zu task%s)\n", grp->members,
+                grp->members == 1 ? "" : "s", grp->tasks,
+                grp->tasks == 1 ? "" : "s");
+
+    const GroupMember *members = &sorted[grp->first];
+    for (size_t m = 0; m < grp->members; m++) {
+      const ProcInfo *proc = members[m].proc;
+      int isLast = (m + 1 == grp->members);
+      sink_printf(sink, "%s%s%s(%d)", isLast ? "└─" : "├─",
+                  proc->isThread ? "{" : "", proc->comm, proc->pid);
+      if (proc->isThread)
+        sink_puts(sink, "}");
+      if (m > 0) {
+        const ProcInfo *lead = members[0].proc;
+        unsigned int mask =
+            namespace_diff_mask(proc, lead->namespaces, lead->nsCount);
+        int first = 1;
+        for (size_t n = 0; n < proc->nsCount; n++) {
+          if (!(mask & (1u << n)))
+            continue;
+          sink_puts(sink, first ? " [" : ", ");
+          sink_puts(sink, proc->namespaces[n].inode);
+          first = 0;
+        }
+        if (!first)
+          sink_puts(sink, "]");
+      }
+      sink_puts(sink, "\n");
+      groups_put_subtree(sink, g, proc, isLast ? "  " : "│ ", idx);
+    }
+  }
+
+  free(order);
+  free(sorted);
+  free(g->groups);
+  free(g->slots);
+  free(g->members);
+  free(g);
+  sink->state = NULL;
+}
+
+/* ---- policy: namespace rules checked during the traversal ---- */
+
+#define MAX_POLICY_RULES 64
+#define MAX_POLICY_GLOBS 64
+
+/* What a rule's namespaces are compared against */
+enum { POLICY_REF_ANCHOR, POLICY_REF_PARENT, POLICY_REF_HOST };
+static const char *const g_policyRefNames[] = {"anchor", "parent", "host"};
+
+/**
+ * struct PolicyRule - One compiled line of a --policy file
+ * @name:      Rule name, or "FILE:LINE" if the line has none
+ * @under:     Glob (index into g_policyGlobs) the task must be strictly
+ *             below; the nearest matching ancestor is the anchor; -1 = any
+ * @notUnder:  Glob no ancestor may match, -1 = none
+ * @comm:      Glob the task's comm must match, -1 = any
+ * @notComm:   Glob the task's comm must not match, -1 = none
+ * @cgroup:    Glob the task's cgroup path must match, -1 = any
+ * @notCgroup: Glob the task's cgroup path must not match, -1 = none
+ * @own:       1 if @types must differ from the reference, 0 if shared
+ * @types:     Namespace types (bits over g_nsTypes) that are checked
+ * @ref:       POLICY_REF_*
+ */
+typedef struct {
+  char name[64];
+  int under;
+  int notUnder;
+  int comm;
+  int notComm;
+  int cgroup;
+  int notCgroup;
+  int own;
+  unsigned int types;
+  int ref;
+} PolicyRule;
+
+static PolicyRule g_policyRules[MAX_POLICY_RULES];
+static size_t g_policyRuleCount = 0;
+static char *g_policyGlobs[MAX_POLICY_GLOBS]; /* deduplicated patterns */
+static int g_policyGlobIsCgroup[MAX_POLICY_GLOBS];
+static size_t g_policyGlobCount = 0;
+static int g_policyNeedsCgroup = 0; /* some rule looks at cgroups */
+static size_t g_policyViolations = 0;
+
+/**
+ * struct PolicyAnchors - Ancestors on the current path matching one glob
+ * @procs:  The matching ancestors, outermost first
+ * @depths: Their depths
+ * @count:  Entries in use
+ * @cap:    Allocated entries
+ */
+typedef struct {
+  const ProcInfo **procs;
+  size_t *depths;
+  size_t count;
+  size_t cap;
+} PolicyAnchors;
+
+/**
+ * struct PolicyState - Traversal state of the policy sink
+ * @host:    The traversal root, i.e. the host's namespaces
+ * @anchors: Per glob, its matching ancestors of the current node
+ * @path:    Per depth, the last task visited there, so path[depth - 1] is
+ *           the current node's parent (also under --mem-limit, where
+ *           ProcInfo.parent is not set)
+ * @pathCap: Allocated entries in @path
+ */
+typedef struct {
+  const ProcInfo *host;
+  PolicyAnchors anchors[MAX_POLICY_GLOBS];
+  const ProcInfo **path;
+  size_t pathCap;
+} PolicyState;
+
+static int policy_glob(const char *pattern, int isCgroup) {
+  for (size_t i = 0; i < g_policyGlobCount; i++) {
+    if (g_policyGlobIsCgroup[i] == isCgroup &&
+        strcmp(g_policyGlobs[i], pattern) == 0)
+      return (int)i;
+  }
+  if (g_policyGlobCount == MAX_POLICY_GLOBS)
+    return -1;
+  g_policyGlobs[g_policyGlobCount] = strdup(pattern);
+  if (!g_policyGlobs[g_policyGlobCount]) {
+    perror("strdup");
+    exit(EXIT_FAILURE);
+  }
+  g_policyGlobIsCgroup[g_policyGlobCount] = isCgroup;
+  g_policyNeedsCgroup |= isCgroup;
+  return (int)g_policyGlobCount++;
+}
+
+/**
+ * load_policy - Compile the rules in @path
+ *
+ * One rule per line, '#' starts a comment:
+ *
+ *   [NAME:] SELECTOR... => own|share TYPES [from|with anchor|parent|host]
+ *
+ * where SELECTOR is "all", or one of under, not-under, comm, not-comm,
+ * cgroup, not-cgroup followed by a glob. The reference defaults to the
+ * anchor (the nearest "under" match) if the rule has one, otherwise to the
+ * host.
+ *
+ * Return: 0 on success, -1 after reporting the first error.
+ */
+static int load_policy(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp) {
+    perror(path);
+    return -1;
+  }
+
+  char line[1024];
+  int lineNo = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    lineNo++;
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = '\0';
+
+    char *tokens[64];
+    size_t n = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(line, " \t\r\n", &save); tok && n < 64;
+         tok = strtok_r(NULL, " \t\r\n", &save))
+      tokens[n++] = tok;
+    if (!n)
+      continue;
+
+    if (g_policyRuleCount == MAX_POLICY_RULES) {
+      fprintf(stderr, "%s:%d: too many rules (max %d)\n", path, lineNo,
+              MAX_POLICY_RULES);
+      goto fail;
+    }
+    PolicyRule *r = &g_policyRules[g_policyRuleCount];
+    memset(r, 0, sizeof(*r));
+    r->under = r->notUnder = r->comm = r->notComm = -1;
+    r->cgroup = r->notCgroup = -1;
+    r->ref = -1;
+    snprintf(r->name, sizeof(r->name), "%s:%d", path, lineNo);
+
+    size_t i = 0;
+    size_t len = strlen(tokens[0]);
+    if (len > 1 && tokens[0][len - 1] == ':') {
+      tokens[0][len - 1] = '\0';
+      snprintf(r->name, sizeof(r->name), "%s", tokens[0]);
+      i++;
+    }
+
+    for (; i < n && strcmp(tokens[i], "=>") != 0; i++) {
+      if (strcmp(tokens[i], "all") == 0)
+        continue;
+      int *slot = NULL, isCgroup = 0;
+      if (strcmp(tokens[i], "under") == 0)
+        slot = &r->under;
+      else if (strcmp(tokens[i], "not-under") == 0)
+        slot = &r->notUnder;
+      else if (strcmp(tokens[i], "comm") == 0)
+        slot = &r->comm;
+      else if (strcmp(tokens[i], "not-comm") == 0)
+        slot = &r->notComm;
+      else if (strcmp(tokens[i], "cgroup") == 0)
+        slot = &r->cgroup, isCgroup = 1;
+      else if (strcmp(tokens[i], "not-cgroup") == 0)
+        slot = &r->notCgroup, isCgroup = 1;
+      if (!slot || i + 1 >= n || *slot >= 0) {
+        fprintf(stderr, "%s:%d: bad or repeated selector '%s'\n", path,
+                lineNo, tokens[i]);
+        goto fail;
+      }
+      if ((*slot = policy_glob(tokens[++i], isCgroup)) < 0) {
+        fprintf(stderr, "%s:%d: too many patterns (max %d)\n", path, lineNo,
+                MAX_POLICY_GLOBS);
+        goto fail;
+      }
+    }
+
+    /* => own|share TYPES [from|with REF] */
+    size_t rest = n - i;
+    if ((rest != 3 && rest != 5) || (strcmp(tokens[i + 1], "own") != 0 &&
+                                     strcmp(tokens[i + 1], "share") != 0)) {
+      fprintf(stderr, "%s:%d: expected '=> own|share TYPES [from REF]'\n",
+              path, lineNo);
+      goto fail;
+    }
+    r->own = (strcmp(tokens[i + 1], "own") == 0);
+    if (parse_ns_type_mask(tokens[i + 2], &r->types) != 0) {
+      fprintf(stderr, "%s:%d: unknown namespace type in '%s'\n", path,
+              lineNo, tokens[i + 2]);
+      goto fail;
+    }
+    if (rest == 5) {
+      for (int ref = 0; ref < 3; ref++) {
+        if (strcmp(tokens[i + 4], g_policyRefNames[ref]) == 0)
+          r->ref = ref;
+      }
+      if (r->ref < 0 || (strcmp(tokens[i + 3], "from") != 0 &&
+                         strcmp(tokens[i + 3], "with") != 0)) {
+        fprintf(stderr, "%s:%d: expected 'from anchor|parent|host'\n", path,
+                lineNo);
+        goto fail;
+      }
+      if (r->ref == POLICY_REF_ANCHOR && r->under < 0) {
+        fprintf(stderr, "%s:%d: 'anchor' needs an 'under' selector\n", path,
+                lineNo);
+        goto fail;
+      }
+    } else {
+      r->ref = r->under >= 0 ? POLICY_REF_ANCHOR : POLICY_REF_HOST;
+    }
+    g_policyRuleCount++;
+  }
+  fclose(fp);
+  if (!g_policyRuleCount) {
+    fprintf(stderr, "%s: no rules\n", path);
+    return -1;
+  }
+  return 0;
+
+fail:
+  fclose(fp);
+  return -1;
+}
+
+/* Read the cgroup v2 path of @proc, or the first hierarchy's on v1 */
+static void policy_read_cgroup(const ProcInfo *proc, char *buf, size_t size) {
+  char path[PATH_MAX], line[1024];
+  buf[0] = '\0';
+  if (proc->isThread)
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/cgroup", proc->ppid,
+             proc->pid);
+  else
+    snprintf(path, sizeof(path), "/proc/%d/cgroup", proc->pid);
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return;
+  while (fgets(line, sizeof(line), fp)) {
+    char *p = strchr(line, ':');
+    p = p ? strchr(p + 1, ':') : NULL;
+    if (!p)
+      continue;
+    p[strcspn(p, "\n")] = '\0';
+    if (!buf[0] || strncmp(line, "0::", 3) == 0)
+      snprintf(buf, size, "%s", p + 1);
+  }
+  fclose(fp);
+}
+
+static unsigned long long policy_ino(const ProcInfo *proc, int typeIdx) {
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    if (proc->namespaces[i].typeIdx == typeIdx)
+      return proc->namespaces[i].ino;
+  }
+  return 0;
+}
+
+static void policy_begin(Sink *sink) {
+  PolicyState *st = calloc(1, sizeof(*st));
+  if (!st) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  sink->state = st;
+  g_policyViolations = 0;
+}
+
+/**
+ * policy_check - Evaluate one rule's assertion for @proc
+ * @ref:     Task whose namespaces are the reference
+ * @refNs:   The reference namespaces (the parent's for POLICY_REF_PARENT)
+ */
+static void policy_check(Sink *sink, const PolicyRule *r, const ProcInfo *proc,
+                         const ProcInfo *ref, const NamespaceEntry *refNs,
+                         size_t refNsCount) {
+  unsigned int bad = 0, unknown = 0, refUnknown = 0;
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (!(r->types & (1u << t)))
+      continue;
+    unsigned long long mine = policy_ino(proc, (int)t), theirs = 0;
+    for (size_t i = 0; i < refNsCount; i++) {
+      if (refNs[i].typeIdx == (int)t)
+        theirs = refNs[i].ino;
+    }
+    if (!mine)
+      unknown |= 1u << t;
+    else if (!theirs)
+      refUnknown |= 1u << t;
+    else if ((mine == theirs) == r->own)
+      bad |= 1u << t;
+  }
+  if (!bad && !unknown && !refUnknown)
+    return;
+
+  g_policyViolations++;
+  sink_printf(sink, "%s: %s(%d) ", r->name, proc->comm, proc->pid);
+  const char *sep = r->own ? "shares " : "does not share ";
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (bad & (1u << t)) {
+      sink_printf(sink, "%s%s", sep, g_nsTypes[t]);
+      sep = ",";
+    }
+  }
+  if (bad)
+    sink_printf(sink, " with %s %s(%d)", g_policyRefNames[r->ref],
+                ref ? ref->comm : "?", ref ? ref->pid : 0);
+  sep = bad ? "; cannot read " : "cannot read ";
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (unknown & (1u << t)) {
+      sink_printf(sink, "%s%s", sep, g_nsTypes[t]);
+      sep = ",";
+    }
+  }
+  /* The task is fine, it is the reference that could not be read */
+  sep = bad || unknown ? "; cannot compare " : "cannot compare ";
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (refUnknown & (1u << t)) {
+      sink_printf(sink, "%s%s", sep, g_nsTypes[t]);
+      sep = ",";
+    }
+  }
+  if (refUnknown)
+    sink_printf(sink, ": %s reference %s(%d) unreadable",
+                g_policyRefNames[r->ref], ref ? ref->comm : "?",
+                ref ? ref->pid : 0);
+  sink_puts(sink, "\n");
+}
+
+/**
+ * policy_node - Evaluate every rule against one task
+ *
+ * All globs are matched once per task, whatever the number of rules using
+ * them. For "under", each glob keeps the stack of matching ancestors on the
+ * current path; the traversal is pre-order, so entries at the task's depth
+ * or deeper belong to finished subtrees and are popped first.
+ */
+static void policy_node(Sink *sink, const VisitInfo *visit) {
+  PolicyState *st = sink->state;
+  const ProcInfo *proc = visit->proc;
+
+  if (visit->depth == 0)
+    st->host = proc;
+  if (visit->depth >= st->pathCap) {
+    st->pathCap = st->pathCap ? st->pathCap * 2 : 64;
+    while (st->pathCap <= visit->depth)
+      st->pathCap *= 2;
+    st->path = realloc(st->path, st->pathCap * sizeof(*st->path));
+    if (!st->path) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  st->path[visit->depth] = proc;
+
+  unsigned long long match = 0;
+  char cgroup[1024] = "";
+  if (g_policyNeedsCgroup)
+    policy_read_cgroup(proc, cgroup, sizeof(cgroup));
+  for (size_t g = 0; g < g_policyGlobCount; g++) {
+    PolicyAnchors *a = &st->anchors[g];
+    while (a->count && a->depths[a->count - 1] >= visit->depth)
+      a->count--;
+    const char *subject = g_policyGlobIsCgroup[g] ? cgroup : proc->comm;
+    if (fnmatch(g_policyGlobs[g], subject, 0) == 0)
+      match |= 1ULL << g;
+  }
+
+  for (size_t i = 0; i < g_policyRuleCount; i++) {
+    const PolicyRule *r = &g_policyRules[i];
+    const ProcInfo *anchor = NULL;
+    if (r->under >= 0) {
+      const PolicyAnchors *a = &st->anchors[r->under];
+      if (!a->count)
+        continue;
+      anchor = a->procs[a->count - 1];
+      /* The anchor's own threads are part of it, not below it */
+      if (proc->isThread && proc->ppid == anchor->pid)
+        continue;
+    }
+    if (r->notUnder >= 0 && st->anchors[r->notUnder].count)
+      continue;
+    if ((r->comm >= 0 && !(match & (1ULL << r->comm))) ||
+        (r->notComm >= 0 && (match & (1ULL << r->notComm))) ||
+        (r->cgroup >= 0 && !(match & (1ULL << r->cgroup))) ||
+        (r->notCgroup >= 0 && (match & (1ULL << r->notCgroup))))
+      continue;
+
+    if (r->ref == POLICY_REF_PARENT) {
+      if (visit->depth > 0)
+        policy_check(sink, r, proc, st->path[visit->depth - 1],
+                     visit->parentNs, visit->parentNsCount);
+    } else {
+      const ProcInfo *ref = r->ref == POLICY_REF_ANCHOR ? anchor : st->host;
+      if (ref && ref != proc)
+        policy_check(sink, r, proc, ref, ref->namespaces, ref->nsCount);
+    }
+  }
+
+  /* This task anchors its descendants for the comm globs it matches */
+  for (size_t g = 0; g < g_policyGlobCount; g++) {
+    if (g_policyGlobIsCgroup[g] || !(match & (1ULL << g)))
+      continue;
+    PolicyAnchors *a = &st->anchors[g];
+    if (a->count == a->cap) {
+      a->cap = a->cap ? a->cap * 2 : 16;
+      a->procs = realloc(a->procs, a->cap * sizeof(*a->procs));
+      a->depths = realloc(a->depths, a->cap * sizeof(*a->depths));
+      if (!a->procs || !a->depths) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    a->procs[a->count] = proc;
+    a->depths[a->count++] = visit->depth;
+  }
+}
+
+static void policy_end(Sink *sink) {
+  PolicyState *st = sink->state;
+  for (size_t g = 0; g < MAX_POLICY_GLOBS; g++) {
+    free(st->anchors[g].procs);
+    free(st->anchors[g].depths);
+  }
+  free(st->path);
+  free(st);
+  sink->state = NULL;
+}
+
+/* ---- mounts: what each mount namespace looks like ---- */
+
+/*
+ * mountinfo is read once per distinct mount namespace, through the first
+ * task visited in it. Lines are parsed in place into (pointer, length)
+ * fields of the text that was read, without copying. Mount and parent IDs
+ * are unique per mount, so the table is hashed without them and without
+ * regard to line order, and namespaces with identical mount tables (e.g. a
+ * pod's containers) share one parsed table. Tables are found through a
+ * hash map and a hash match is confirmed by comparing the sorted,
+ * ID-stripped lines.
+ */
+
+/**
+ * struct MountStr - A field of a mountinfo line, not NUL-terminated
+ */
+typedef struct {
+  const char *ptr;
+  size_t len;
+} MountStr;
+
+/**
+ * struct MountEntry - One parsed mountinfo line
+ * @shared: Peer group this mount propagates to and from (0: private)
+ * @master: Peer group it receives propagation from (0: not a slave)
+ */
+typedef struct {
+  MountStr mountPoint;
+  MountStr root;
+  MountStr fstype;
+  MountStr source;
+  unsigned int shared;
+  unsigned int master;
+} MountEntry;
+
+/**
+ * struct MountTable - A parsed mount table, shared by identical namespaces
+ * @hash:      mounts_hash() of the text
+ * @text:      The mountinfo text the entries point into
+ * @lines:     Its lines without the mount and parent IDs, sorted, which
+ *             is what identical tables have in common
+ * @byPoint:   @mounts sorted by mount point, for diffs
+ * @groups:    Distinct shared peer groups, sorted
+ * @slaves:    Mounts with a master
+ * @firstIno:  The first namespace seen with this table
+ * @users:     Namespaces using this table
+ */
+typedef struct {
+  unsigned long long hash;
+  char *text;
+  MountStr *lines;
+  size_t lineCount;
+  MountEntry *mounts;
+  size_t count;
+  const MountEntry **byPoint;
+  unsigned int *groups;
+  size_t groupCount;
+  size_t slaves;
+  unsigned long long firstIno;
+  size_t users;
+} MountTable;
+
+/**
+ * struct MountNs - A mount namespace, in order of first visit
+ * @parentIno: Mount namespace of the first visited task's parent, or 0
+ * @table:     Index into MountsState.tables, or -1 if unreadable
+ */
+typedef struct {
+  unsigned long long ino;
+  pid_t pid;
+  char comm[256];
+  unsigned long long parentIno;
+  ssize_t table;
+} MountNs;
+
+typedef struct {
+  InoSet seen;
+  MountNs *ns;
+  size_t nsCount;
+  size_t nsCap;
+  MountTable *tables;
+  size_t tableCount;
+  size_t tableCap;
+  size_t *slots; /* open addressing on hash into @tables, 1-based */
+  size_t slotCap;
+  int mntIdx; /* g_nsTypes index of "mnt" */
+} MountsState;
+
+/* Read all of a /proc file; /proc sizes are not known before reading */
+static char *mounts_read_file(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return NULL;
+  size_t cap = 16384, used = 0;
+  char *buf = malloc(cap);
+  while (buf) {
+    if (used + 1 == cap) {
+      char *tmp = realloc(buf, cap * 2);
+      if (!tmp) {
+        free(buf);
+        buf = NULL;
+        break;
+      }
+      buf = tmp;
+      cap *= 2;
+    }
+    ssize_t n = read(fd, buf + used, cap - 1 - used);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    used += (size_t)n;
+  }
+  close(fd);
+  if (!buf) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  buf[used] = '\0';
+  *len = used;
+  return buf;
+}
+
+/* Advance @p past the next space-separated field of a line, returning it */
+static MountStr mounts_field(const char **p, const char *end) {
+  MountStr f;
+  while (*p < end && **p == ' ')
+    (*p)++;
+  f.ptr = *p;
+  while (*p < end && **p != ' ')
+    (*p)++;
+  f.len = (size_t)(*p - f.ptr);
+  return f;
+}
+
+/**
+ * mounts_hash - Hash a mount table, ignoring the mount and parent IDs
+ *
+ * A copied namespace lists the same mounts in a different order, so each
+ * line is hashed on its own (FNV-1a, then a splitmix64 finalizer) and the
+ * line hashes are summed.
+ */
+static unsigned long long mounts_hash(const char *text, size_t len) {
+  unsigned long long sum = 0;
+  const char *end = text + len;
+  for (const char *line = text; line < end;) {
+    const char *eol = memchr(line, '\n', (size_t)(end - line));
+    if (!eol)
+      eol = end;
+    const char *p = line;
+    mounts_field(&p, eol);
+    mounts_field(&p, eol);
+    unsigned long long h = 1469598103934665603ULL;
+    for (; p < eol; p++)
+      h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+    h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+    sum += h ^ (h >> 31);
+    line = eol + 1;
+  }
+  return sum;
+}
+
+static int mount_str_compare(const MountStr *a, const MountStr *b) {
+  size_t n = a->len < b->len ? a->len : b->len;
+  int c = memcmp(a->ptr, b->ptr, n);
+  if (c)
+    return c;
+  return a->len < b->len ? -1 : a->len > b->len;
+}
+
+static int mount_point_compare(const void *a, const void *b) {
+  const MountEntry *x = *(const MountEntry *const *)a;
+  const MountEntry *y = *(const MountEntry *const *)b;
+  return mount_str_compare(&x->mountPoint, &y->mountPoint);
+}
+
+static int mount_group_compare(const void *a, const void *b) {
+  unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+  return x < y ? -1 : x > y;
+}
+
+static int mount_line_compare(const void *a, const void *b) {
+  return mount_str_compare(a, b);
+}
+
+/* The lines of @text without their mount and parent IDs, sorted */
+static MountStr *mounts_normalize(const char *text, size_t len,
+                                  size_t *count) {
+  const char *end = text + len;
+  size_t cap = 1;
+  for (const char *c = text; c < end; c++)
+    cap += (*c == '\n');
+  MountStr *lines = malloc(cap * sizeof(*lines));
+  if (!lines) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  *count = 0;
+  for (const char *line = text; line < end;) {
+    const char *eol = memchr(line, '\n', (size_t)(end - line));
+    if (!eol)
+      eol = end;
+    const char *p = line;
+    mounts_field(&p, eol);
+    mounts_field(&p, eol);
+    lines[*count].ptr = p;
+    lines[(*count)++].len = (size_t)(eol - p);
+    line = eol + 1;
+  }
+  qsort(lines, *count, sizeof(*lines), mount_line_compare);
+  return lines;
+}
+
+static int mounts_same(const MountTable *t, const MountStr *lines,
+                       size_t count) {
+  if (t->lineCount != count)
+    return 0;
+  for (size_t i = 0; i < count; i++) {
+    if (mount_str_compare(&t->lines[i], &lines[i]) != 0)
+      return 0;
+  }
+  return 1;
+}
+
+/* Rebuild @st->slots with room for one more table */
+static void mounts_slots_grow(MountsState *st) {
+  if ((st->tableCount + 1) * 2 <= st->slotCap)
+    return;
+  free(st->slots);
+  st->slotCap = st->slotCap ? st->slotCap * 2 : 64;
+  st->slots = calloc(st->slotCap, sizeof(*st->slots));
+  if (!st->slots) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < st->tableCount; i++) {
+    size_t h = (size_t)st->tables[i].hash & (st->slotCap - 1);
+    while (st->slots[h])
+      h = (h + 1) & (st->slotCap - 1);
+    st->slots[h] = i + 1;
+  }
+}
+
+/**
+ * mounts_parse - Parse @t->text into @t->mounts and derive the summaries
+ *
+ * Format (proc(5)): ID PARENT MAJ:MIN ROOT POINT OPTIONS [OPTIONAL...] -
+ * FSTYPE SOURCE SUPEROPTIONS. The optional fields carry shared:N and
+ * master:N.
+ */
+static void mounts_parse(MountTable *t, size_t len) {
+  const char *end = t->text + len;
+  size_t cap = 0;
+  for (const char *c = t->text; c < end; c++)
+    cap += (*c == '\n');
+  t->mounts = calloc(cap + 1, sizeof(*t->mounts));
+  t->byPoint = malloc((cap + 1) * sizeof(*t->byPoint));
+  t->groups = malloc((cap + 1) * sizeof(*t->groups));
+  if (!t->mounts || !t->byPoint || !t->groups) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (const char *line = t->text; line < end;) {
+    const char *eol = memchr(line, '\n', (size_t)(end - line));
+    if (!eol)
+      eol = end;
+    const char *p = line;
+    MountEntry *m = &t->mounts[t->count];
+    mounts_field(&p, eol); /* mount ID */
+    mounts_field(&p, eol); /* parent ID */
+    mounts_field(&p, eol); /* major:minor */
+    m->root = mounts_field(&p, eol);
+    m->mountPoint = mounts_field(&p, eol);
+    mounts_field(&p, eol); /* mount options */
+    for (;;) {
+      MountStr opt = mounts_field(&p, eol);
+      if (!opt.len || (opt.len == 1 && opt.ptr[0] == '-'))
+        break;
+      if (opt.len > 7 && memcmp(opt.ptr, "shared:", 7) == 0)
+        m->shared = (unsigned int)strtoul(opt.ptr + 7, NULL, 10);
+      else if (opt.len > 7 && memcmp(opt.ptr, "master:", 7) == 0)
+        m->master = (unsigned int)strtoul(opt.ptr + 7, NULL, 10);
+    }
+    m->fstype = mounts_field(&p, eol);
+    m->source = mounts_field(&p, eol);
+    if (m->mountPoint.len) {
+      t->byPoint[t->count] = m;
+      if (m->shared)
+        t->groups[t->groupCount++] = m->shared;
+      t->slaves += (m->master != 0);
+      t->count++;
+    }
+    line = eol + 1;
+  }
+
+  qsort(t->byPoint, t->count, sizeof(*t->byPoint), mount_point_compare);
+  qsort(t->groups, t->groupCount, sizeof(*t->groups), mount_group_compare);
+  size_t distinct = 0;
+  for (size_t i = 0; i < t->groupCount; i++) {
+    if (!distinct || t->groups[distinct - 1] != t->groups[i])
+      t->groups[distinct++] = t->groups[i];
+  }
+  t->groupCount = distinct;
+}
+
+/**
+ * mounts_load - Find or parse the mount table of @proc's mount namespace
+ *
+ * Return: the index into @st->tables, or -1 if mountinfo is unreadable.
+ */
+static ssize_t mounts_load(MountsState *st, const ProcInfo *proc,
+                           unsigned long long ino) {
+  char path[PATH_MAX];
+  if (proc->isThread)
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/mountinfo", proc->ppid,
+             proc->pid);
+  else
+    snprintf(path, sizeof(path), "/proc/%d/mountinfo", proc->pid);
+  size_t len;
+  char *text = mounts_read_file(path, &len);
+  if (!text)
+    return -1;
+
+  unsigned long long hash = mounts_hash(text, len);
+  size_t lineCount;
+  MountStr *lines = mounts_normalize(text, len, &lineCount);
+  mounts_slots_grow(st);
+  size_t h = (size_t)hash & (st->slotCap - 1);
+  for (; st->slots[h]; h = (h + 1) & (st->slotCap - 1)) {
+    MountTable *t = &st->tables[st->slots[h] - 1];
+    if (t->hash == hash && mounts_same(t, lines, lineCount)) {
+      free(lines);
+      free(text);
+      t->users++;
+      return (ssize_t)(st->slots[h] - 1);
+    }
+  }
+
+  if (st->tableCount == st->tableCap) {
+    st->tableCap = st->tableCap ? st->tableCap * 2 : 16;
+    st->tables = realloc(st->tables, st->tableCap * sizeof(*st->tables));
+    if (!st->tables) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  MountTable *t = &st->tables[st->tableCount];
+  memset(t, 0, sizeof(*t));
+  t->hash = hash;
+  t->text = text;
+  t->lines = lines;
+  t->lineCount = lineCount;
+  t->firstIno = ino;
+  t->users = 1;
+  mounts_parse(t, len);
+  st->slots[h] = ++st->tableCount;
+  return (ssize_t)(st->tableCount - 1);
+}
+
+static void mounts_begin(Sink *sink) {
+  MountsState *st = calloc(1, sizeof(*st));
+  if (!st) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  st->mntIdx = ns_type_index("mnt");
+  sink->state = st;
+}
+
+static void mounts_node(Sink *sink, const VisitInfo *visit) {
+  MountsState *st = sink->state;
+  const ProcInfo *proc = visit->proc;
+  unsigned long long ino = 0, parentIno = 0;
+
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    if (proc->namespaces[i].typeIdx == st->mntIdx)
+      ino = proc->namespaces[i].ino;
+  }
+  if (!inoset_add(&st->seen, ino))
+    return;
+  for (size_t i = 0; visit->parentNs && i < visit->parentNsCount; i++) {
+    if (visit->parentNs[i].typeIdx == st->mntIdx)
+      parentIno = visit->parentNs[i].ino;
+  }
+
+  if (st->nsCount == st->nsCap) {
+    st->nsCap = st->nsCap ? st->nsCap * 2 : 64;
+    st->ns = realloc(st->ns, st->nsCap * sizeof(*st->ns));
+    if (!st->ns) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  MountNs *ns = &st->ns[st->nsCount++];
+  ns->ino = ino;
+  ns->pid = proc->pid;
+  memcpy(ns->comm, proc->comm, sizeof(ns->comm));
+  ns->parentIno = parentIno;
+  ns->table = mounts_load(st, proc, ino);
+}
+
+static int mount_ns_ino_compare(const void *a, const void *b) {
+  const MountNs *x = *(const MountNs *const *)a;
+  const MountNs *y = *(const MountNs *const *)b;
+  return x->ino < y->ino ? -1 : x->ino > y->ino;
+}
+
+/**
+ * mounts_put_diff - Print how @t differs from its parent namespace's @pt
+ *
+ * Both tables are sorted by mount point, so a single merge finds the
+ * mount points only one side has. Propagating mounts are shared peer
+ * groups both sides belong to: mount events in one show up in the other.
+ */
+static void mounts_put_diff(Sink *sink, const MountTable *t,
+                            const MountTable *pt) {
+  size_t added = 0, removed = 0, i = 0, j = 0;
+  while (i < t->count || j < pt->count) {
+    int c = i == t->count    ? 1
+            : j == pt->count ? -1
+                             : mount_str_compare(&t->byPoint[i]->mountPoint,
+                                                 &pt->byPoint[j]->mountPoint);
+    if (c < 0)
+      added++, i++;
+    else if (c > 0)
+      removed++, j++;
+    else
+      i++, j++;
+  }
+
+  size_t propagating = 0;
+  for (size_t g = 0; g < t->groupCount; g++) {
+    if (bsearch(&t->groups[g], pt->groups, pt->groupCount,
+                sizeof(*pt->groups), mount_group_compare))
+      propagating++;
+  }
+  sink_printf(sink, ", +%zu -%zu mount points, %zu peer groups shared",
+              added, removed, propagating);
+}
+
+static void mounts_end(Sink *sink) {
+  MountsState *st = sink->state;
+
+  sink_printf(sink, "%zu mount namespaces, %zu distinct mount tables\n",
+              st->nsCount, st->tableCount);
+
+  /* Parents are found by inode through a sorted index */
+  const MountNs **byIno = malloc((st->nsCount + 1) * sizeof(*byIno));
+  if (!byIno) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < st->nsCount; i++)
+    byIno[i] = &st->ns[i];
+  qsort(byIno, st->nsCount, sizeof(*byIno), mount_ns_ino_compare);
+
+  for (size_t i = 0; i < st->nsCount; i++) {
+    const MountNs *ns = &st->ns[i];
+    sink_printf(sink, "mnt:[%llu] %s(%d)", ns->ino, ns->comm, ns->pid);
+    if (ns->table < 0) {
+      sink_puts(sink, ": mountinfo unreadable\n");
+      continue;
+    }
+    const MountTable *t = &st->tables[ns->table];
+    sink_printf(sink, ": %zu mounts", t->count);
+
+    /* The last mount on "/" is the one on top */
+    for (size_t m = t->count; m-- > 0;) {
+      const MountEntry *e = &t->mounts[m];
+      if (e->mountPoint.len == 1 && e->mountPoint.ptr[0] == '/') {
+        sink_printf(sink, ", / is %.*s %.*s", (int)e->fstype.len,
+                    e->fstype.ptr, (int)e->source.len, e->source.ptr);
+        break;
+      }
+    }
+    sink_printf(sink, ", %zu peer groups, %zu slave mounts", t->groupCount,
+                t->slaves);
+    if (t->users > 1 && t->firstIno != ns->ino)
+      sink_printf(sink, ", same table as mnt:[%llu]", t->firstIno);
+
+    if (ns->parentIno && ns->parentIno != ns->ino) {
+      MountNs key = {.ino = ns->parentIno};
+      const MountNs *keyp = &key;
+      const MountNs **parent =
+          bsearch(&keyp, byIno, st->nsCount, sizeof(*byIno),
+                  mount_ns_ino_compare);
+      sink_printf(sink, "; vs parent mnt:[%llu]", ns->parentIno);
+      if (parent && (*parent)->table >= 0 && (*parent)->table != ns->table)
+        mounts_put_diff(sink, t, &st->tables[(*parent)->table]);
+      else if (parent && (*parent)->table == ns->table)
+        sink_puts(sink, ", identical");
+    }
+    sink_puts(sink, "\n");
+  }
+
+  free(byIno);
+  for (size_t i = 0; i < st->tableCount; i++) {
+    free(st->tables[i].text);
+    free(st->tables[i].lines);
+    free(st->tables[i].mounts);
+    free(st->tables[i].byPoint);
+    free(st->tables[i].groups);
+  }
+  free(st->tables);
+  free(st->slots);
+  free(st->ns);
+  free(st->seen.slots);
+  free(st);
+  sink->state = NULL;
+}
+
+/* ---- quota: live namespaces against the max_*_namespaces limits ---- */
+
+/*
+ * The kernel charges a new namespace to the user namespace that owns it and
+ * to every ancestor of that user namespace, each against its own
+ * /proc/sys/user/max_<type>_namespaces limit. Each distinct namespace is
+ * opened once, through the first task seen in it, to ask for its owner
+ * (NS_GET_USERNS, or NS_GET_PARENT for a user namespace); a user
+ * namespace's ancestors are walked only the first time it is met. The
+ * kernel keeps these counts per creating UID, while this counts all UIDs
+ * together, and the host's own namespaces (never charged) are counted too,
+ * so the headroom shown is never more than the real one.
+ */
+
+/**
+ * struct QuotaUserNs - Namespaces charged to one user namespace
+ * @ino:      The user namespace
+ * @parent:   Its parent, 0 for the initial one or one outside our view
+ * @resolved: @parent has been looked up
+ * @live:     Per type, namespaces owned by it or by a descendant
+ */
+typedef struct {
+  unsigned long long ino;
+  unsigned long long parent;
+  int resolved;
+  unsigned long long live[NS_TYPE_COUNT];
+} QuotaUserNs;
+
+typedef struct {
+  InoSet seen;           /* namespaces already charged */
+  QuotaUserNs *users;
+  size_t userCount;
+  size_t userCap;
+  size_t *slots;         /* open addressing over users, index + 1 */
+  size_t slotCap;
+  size_t unknown;        /* namespaces whose owner could not be read */
+  int userIdx;           /* g_nsTypes index of "user" */
+} QuotaState;
+
+static size_t quota_slot(const QuotaState *st, unsigned long long ino) {
+  size_t h = (size_t)(ino * 0x9E3779B97F4A7C15ULL) & (st->slotCap - 1);
+  while (st->slots[h] && st->users[st->slots[h] - 1].ino != ino)
+    h = (h + 1) & (st->slotCap - 1);
+  return h;
+}
+
+/**
+ * quota_user_get - Look up or add the user namespace @ino
+ *
+ * Return: its index in @st->users, which stays valid across insertions.
+ */
+static size_t quota_user_get(QuotaState *st, unsigned long long ino) {
+  if ((st->userCount + 1) * 2 > st->slotCap) {
+    free(st->slots);
+    st->slotCap = st->slotCap ? st->slotCap * 2 : 64;
+    st->slots = calloc(st->slotCap, sizeof(*st->slots));
+    if (!st->slots) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < st->userCount; i++)
+      st->slots[quota_slot(st, st->users[i].ino)] = i + 1;
+  }
+
+  size_t h = quota_slot(st, ino);
+  if (st->slots[h])
+    return st->slots[h] - 1;
+  if (st->userCount == st->userCap) {
+    st->userCap = st->userCap ? st->userCap * 2 : 64;
+    QuotaUserNs *tmp = realloc(st->users, st->userCap * sizeof(*tmp));
+    if (!tmp) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    st->users = tmp;
+  }
+  memset(&st->users[st->userCount], 0, sizeof(*st->users));
+  st->users[st->userCount].ino = ino;
+  st->slots[h] = ++st->userCount;
+  return st->userCount - 1;
+}
+
+/**
+ * quota_resolve - Enter the user namespace open on @fd and its ancestors
+ *
+ * Consumes @fd. NS_GET_PARENT fails with EPERM at the initial user
+ * namespace and at the edge of the caller's own, which ends the walk.
+ *
+ * Return: the index of the user namespace in @st->users, or -1 with errno
+ * set by the failed fstat().
+ */
+static ssize_t quota_resolve(QuotaState *st, int fd) {
+  ssize_t first = -1;
+  size_t prev = 0;
+  while (fd >= 0) {
+    struct stat sb;
+    if (fstat(fd, &sb) != 0) {
+      int err = errno; /* close() may overwrite it */
+      close(fd);
+      errno = err;
+      break;
+    }
+    size_t u = quota_user_get(st, (unsigned long long)sb.st_ino);
+    if (first < 0)
+      first = (ssize_t)u;
+    else
+      st->users[prev].parent = st->users[u].ino;
+    if (st->users[u].resolved) {
+      close(fd);
+      break;
+    }
+    st->users[u].resolved = 1;
+    prev = u;
+    int parent = ioctl(fd, NS_GET_PARENT);
+    close(fd);
+    fd = parent;
+  }
+  return first;
+}
+
+static void quota_begin(Sink *sink) {
+  QuotaState *st = calloc(1, sizeof(*st));
+  if (!st) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  st->userIdx = ns_type_index("user");
+  sink->state = st;
+}
+
+static void quota_node(Sink *sink, const VisitInfo *visit) {
+  QuotaState *st = sink->state;
+  const ProcInfo *proc = visit->proc;
+
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    const NamespaceEntry *ns = &proc->namespaces[i];
+    if (ns->typeIdx < 0 || strstr(g_nsTypes[ns->typeIdx], "_for_children") ||
+        !inoset_add(&st->seen, ns->ino))
+      continue;
+
+    char path[PATH_MAX];
+    int len = proc->isThread
+                  ? snprintf(path, sizeof(path), "/proc/%d/task/%d/ns/%s",
+                             proc->ppid, proc->pid, g_nsTypes[ns->typeIdx])
+                  : snprintf(path, sizeof(path), "/proc/%d/ns/%s", proc->pid,
+                             g_nsTypes[ns->typeIdx]);
+    int fd = len > 0 && (size_t)len < sizeof(path)
+                 ? open(path, O_RDONLY | O_CLOEXEC)
+                 : -1;
+    int owner = -1, err = 0;
+    if (fd >= 0) {
+      owner = ioctl(fd, ns->typeIdx == st->userIdx ? NS_GET_PARENT
+                                                   : NS_GET_USERNS);
+      err = errno; /* close() may overwrite it */
+      close(fd);
+    }
+    ssize_t u = owner >= 0 ? quota_resolve(st, owner) : -1;
+    if (u < 0) {
+      /* The initial user namespace has no owner and was never created */
+      if (!(ns->typeIdx == st->userIdx && fd >= 0 && owner < 0 &&
+            err == EPERM))
+        st->unknown++;
+      continue;
+    }
+    for (size_t k = (size_t)u;;) {
+      st->users[k].live[ns->typeIdx]++;
+      if (!st->users[k].parent)
+        break;
+      k = quota_user_get(st, st->users[k].parent);
+    }
+  }
+}
+
+/* Read /proc/sys/user/max_<name>_namespaces, or -1 if there is none */
+static long long quota_limit(const char *name) {
+  char path[128];
+  snprintf(path, sizeof(path), "/proc/sys/user/max_%s_namespaces", name);
+  FILE *f = fopen(path, "re");
+  if (!f)
+    return -1;
+  long long v = -1;
+  if (fscanf(f, "%lld", &v) != 1)
+    v = -1;
+  fclose(f);
+  return v;
+}
+
+static int quota_user_compare(const void *a, const void *b) {
+  const QuotaUserNs *x = a, *y = b;
+  unsigned long long xs = 0, ys = 0;
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    xs += x->live[t];
+    ys += y->live[t];
+  }
+  if (xs != ys)
+    return xs > ys ? -1 : 1;
+  return x->ino < y->ino ? -1 : (x->ino > y->ino);
+}
+
+/**
+ * quota_end - Print headroom for our own user namespace, then the others
+ *
+ * Only the limits of the user namespace nstree runs in can be read; a new
+ * user namespace starts without limits of its own, so the others only get
+ * their counts.
+ */
+static void quota_end(Sink *sink) {
+  QuotaState *st = sink->state;
+  struct stat sb;
+  unsigned long long self =
+      stat("/proc/self/ns/user", &sb) == 0 ? (unsigned long long)sb.st_ino : 0;
+  size_t selfIdx = quota_user_get(st, self);
+  QuotaUserNs own = st->users[selfIdx];
+
+  sink_printf(sink, "user:[%llu] (this one), limits from /proc/sys/user\n",
+              self);
+  sink_printf(sink, "%-8s %10s %10s %10s %6s\n", "TYPE", "LIVE", "LIMIT",
+              "HEADROOM", "USED%");
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (strstr(g_nsTypes[t], "_for_children"))
+      continue;
+    long long limit = quota_limit(g_nsTypes[t]);
+    if (limit < 0) {
+      sink_printf(sink, "%-8s %10llu %10s %10s %6s\n", g_nsTypes[t],
+                  own.live[t], "-", "-", "-");
+      continue;
+    }
+    long long headroom = limit - (long long)own.live[t];
+    sink_printf(sink, "%-8s %10llu %10lld %10lld %6.1f\n", g_nsTypes[t],
+                own.live[t], limit, headroom < 0 ? 0 : headroom,
+                limit ? 100.0 * (double)own.live[t] / (double)limit : 100.0);
+  }
+  if (st->unknown)
+    sink_printf(sink, "%zu namespaces with an unreadable owner are not "
+                      "counted\n",
+                st->unknown);
+
+  /* Descendants, busiest first; the slot index is not needed any more */
+  size_t n = 0;
+  for (size_t i = 0; i < st->userCount; i++) {
+    if (i != selfIdx && st->users[i].parent)
+      st->users[n++] = st->users[i];
+  }
+  qsort(st->users, n, sizeof(*st->users), quota_user_compare);
+  for (size_t i = 0; i < n; i++) {
+    const QuotaUserNs *u = &st->users[i];
+    sink_printf(sink, "user:[%llu] (parent user:[%llu]):", u->ino,
+                u->parent);
+    const char *sep = " ";
+    for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+      if (u->live[t]) {
+        sink_printf(sink, "%s%s %llu", sep, g_nsTypes[t], u->live[t]);
+        sep = ", ";
+      }
+    }
+    sink_puts(sink, "\n");
+  }
+
+  free(st->seen.slots);
+  free(st->users);
+  free(st->slots);
+  free(st);
+  sink->state = NULL;
+}
+
+static const SinkFormat g_sinkFormats[] = {
+    {"tree", NULL, tree_node, NULL, 0, 1, 1},
+    {"ndjson", NULL, ndjson_node, NULL, 0, 1, 1},
+    {"arrow", arrow_begin, arrow_node, arrow_end, 0, 0, 0},
+    {"metrics", metrics_begin, metrics_node, metrics_end, 0, 0, 1},
+    {"census", census_begin, census_node, census_end, 1, 0, 1},
+    {"by-ns", census_begin, census_node, by_ns_end, 1, 0, 1},
+    {"cpu", census_begin, cpu_node, cpu_end, 0, 0, 0},
+    {"top", census_begin, top_node, top_end, 0, 0, 0},
+    {"groups", groups_begin, groups_node, groups_end, 0, 0, 0},
+    /* Policy anchors are ancestors, which are still on the stack */
+    {"policy", policy_begin, policy_node, policy_end, 0, 0, 1},
+    {"mounts", mounts_begin, mounts_node, mounts_end, 0, 0, 1},
+    {"quota", quota_begin, quota_node, quota_end, 0, 0, 1},
+    {"creators", NULL, creators_node, creators_end, 0, 0, 0},
+};
+
+/**
+ * add_sink - Register an output sink from a "FORMAT[:DEST]" specification
+ * @spec: e.g. "tree", "ndjson:-" or "metrics:/var/lib/node_exporter/ns.prom"
+ *
+ * DEST defaults to stdout. Files are created or truncated up front so a bad
+ * path is reported before any scanning is done; one that cannot be opened
+ * ends the program. Destinations are told apart by device and inode, not
+ * by name: two outputs may share stdout (or a pipe or terminal reached
+ * another way, such as /dev/stdout), and are then flushed whole, one after
+ * the other, but never a regular file.
+ *
+ * Return: 0 on success, -1 if the format is unknown, there are too many
+ * sinks or the file is already another output's.
+ */
+static int add_sink(const char *spec) {
+  if (g_sinkCount >= MAX_SINKS) {
+    fprintf(stderr, "Too many outputs (max %d)\n", MAX_SINKS);
+    return -1;
+  }
+
+  const char *colon = strchr(spec, ':');
+  size_t nameLen = colon ? (size_t)(colon - spec) : strlen(spec);
+  const char *dest = (colon && colon[1]) ? colon + 1 : "-";
+
+  const SinkFormat *format = NULL;
+  for (size_t i = 0; i < sizeof(g_sinkFormats) / sizeof(g_sinkFormats[0]);
+       i++) {
+    if (strlen(g_sinkFormats[i].name) == nameLen &&
+        strncmp(g_sinkFormats[i].name, spec, nameLen) == 0) {
+      format = &g_sinkFormats[i];
+      break;
+    }
+  }
+  if (!format) {
+    fprintf(stderr, "Unknown output format in: %s\n", spec);
+    return -1;
+  }
+
+  /* Truncate only once it is known not to be another output's file */
+  int fd = STDOUT_FILENO;
+  if (strcmp(dest, "-") != 0) {
+    fd = open(dest, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      perror(dest);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  struct stat st;
+  int shared = 0, haveStat = (fstat(fd, &st) == 0);
+  for (size_t s = 0; haveStat && s < g_sinkCount; s++) {
+    struct stat other;
+    if (fstat(g_sinks[s].fd, &other) != 0 || other.st_dev != st.st_dev ||
+        other.st_ino != st.st_ino)
+      continue;
+    if (S_ISREG(st.st_mode) && (fd != STDOUT_FILENO ||
+                                g_sinks[s].fd != STDOUT_FILENO)) {
+      fprintf(stderr, "Two outputs cannot write to the same file: %s\n",
+              dest);
+      if (fd != STDOUT_FILENO)
+        close(fd);
+      return -1;
+    }
+    g_sinks[s].shared = shared = 1;
+  }
+  if (fd != STDOUT_FILENO && haveStat && S_ISREG(st.st_mode) &&
+      ftruncate(fd, 0) != 0) {
+    perror(dest);
+    exit(EXIT_FAILURE);
+  }
+
+  Sink *sink = &g_sinks[g_sinkCount++];
+  memset(sink, 0, sizeof(*sink));
+  sink->format = format;
+  sink->dest = dest;
+  sink->fd = fd;
+  sink->shared = shared;
+
+  /* Only files opened here are rewound; stdout may be an append redirect */
+  sink->isFile = (fd != STDOUT_FILENO && haveStat && S_ISREG(st.st_mode));
+  return 0;
+}
+
+/*
+ * Watch mode re-renders after every change, but usually only a handful of
+ * tasks changed. For cacheable formats each node remembers where its
+ * subtree landed in the previous rendering (relative to its parent's, so a
+ * copied subtree stays valid inside), and an unchanged subtree drawn at the
+ * same position is replayed from there verbatim.
+ */
+
+/**
+ * struct RenderSpan - A subtree's bytes in a sink's previous rendering
+ * @start: Offset from the parent's own start (the root's is absolute)
+ * @len:   Length of the subtree's output
+ */
+typedef struct RenderSpan {
+  size_t start;
+  size_t len;
+} RenderSpan;
+
+/**
+ * struct RenderDirty - A task whose cached output went stale this tick
+ * @pid:       The task (looked up once the tree is rebuilt)
+ * @nsChanged: Its namespaces changed, so its children's diffs did too
+ */
+typedef struct {
+  pid_t pid;
+  int nsChanged;
+} RenderDirty;
+
+static int g_renderCache = 0; /* replay unchanged subtrees */
+static RenderDirty *g_renderDirty = NULL;
+static size_t g_renderDirtyCount = 0;
+static size_t g_renderDirtyCap = 0;
+
+/**
+ * render_mark_dirty - Remember that @pid's output must be regenerated
+ * @pid:       Task that appeared, changed, or lost or gained a child
+ * @nsChanged: Non-zero if @pid's namespaces changed
+ *
+ * Parent links are only valid after build_process_tree(), so the marks are
+ * collected here and applied by render_cache_invalidate().
+ */
+static void render_mark_dirty(pid_t pid, int nsChanged) {
+  if (!g_renderCache)
+    return;
+  if (g_renderDirtyCount == g_renderDirtyCap) {
+    size_t newCap = g_renderDirtyCap ? g_renderDirtyCap * 2 : 64;
+    RenderDirty *tmp = realloc(g_renderDirty, newCap * sizeof(*tmp));
+    if (!tmp) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    g_renderDirty = tmp;
+    g_renderDirtyCap = newCap;
+  }
+  g_renderDirty[g_renderDirtyCount].pid = pid;
+  g_renderDirty[g_renderDirtyCount].nsChanged = nsChanged;
+  g_renderDirtyCount++;
+}
+
+/**
+ * render_invalidate - Drop @proc's cached output and that of its ancestors
+ *
+ * The walk stops at the first ancestor that is already invalid: its own
+ * ancestors were invalidated together with it, or it is pruned and its
+ * output does not appear in theirs.
+ */
+static void render_invalidate(ProcInfo *proc) {
+  proc->renderValid = 0;
+  for (ProcInfo *q = proc->parent; q && q->renderValid; q = q->parent)
+    q->renderValid = 0;
+}
+
+/**
+ * render_cache_invalidate - Apply this tick's render_mark_dirty() calls
+ */
+static void render_cache_invalidate(void) {
+  for (size_t i = 0; i < g_renderDirtyCount; i++) {
+    ssize_t idx = pid_index_find(g_renderDirty[i].pid);
+    if (idx < 0)
+      continue;
+    ProcInfo *proc = &g_processes[idx];
+    render_invalidate(proc);
+    if (g_renderDirty[i].nsChanged) {
+      for (size_t c = 0; c < proc->childCount; c++)
+        proc->children[c]->renderValid = 0;
+    }
+  }
+  g_renderDirtyCount = 0;
+}
+
+/**
+ * render_cache_forget - Release a task's cached spans when it goes away
+ */
+static void render_cache_forget(ProcInfo *proc) {
+  free(proc->spans);
+  proc->spans = NULL;
+  proc->renderValid = 0;
+}
+
+/* FNV-1a over the tree prefix, which encodes the node's position */
+static unsigned long long render_prefix_hash(const char *prefix) {
+  unsigned long long h = 1469598103934665603ULL;
+  for (const unsigned char *c = (const unsigned char *)prefix; *c; c++)
+    h = (h ^ *c) * 1099511628211ULL;
+  return h;
+}
+
+/**
+ * render_can_replay - Check whether @proc's cached subtree is still usable
+ * @proc:      Node about to be rendered
+ * @hash:      Hash of the prefix it is rendered with now
+ * @isLast:    Whether it is the last kept sibling now
+ * @depth:     Its depth now
+ * @parentOld: Per sink, where the parent started in the previous rendering
+ */
+static int render_can_replay(const ProcInfo *proc, unsigned long long hash,
+                             int isLast, size_t depth,
+                             const size_t *parentOld) {
+  if (!proc->renderValid || !proc->spans || proc->renderIsLast != isLast ||
+      proc->renderDepth != depth || proc->renderPrefixHash != hash)
+    return 0;
+  for (size_t s = 0; s < g_sinkCount; s++) {
+    if (!g_sinks[s].format->cacheable)
+      continue;
+    size_t start = parentOld[s] + proc->spans[s].start;
+    if (start + proc->spans[s].len > g_sinks[s].prevLen)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * render_tree - Walk the kept tree once, feeding every node to every sink
+ * @proc:           pointer to the current ProcInfo
+ * @prefix:         prefix string for tree indentation
+ * @isLast:         bool indicating if this child is last among siblings
+ * @depth:          distance from the traversal root
+ * @parentNs:       parent's namespace array
+ * @parentNsCount:  how many namespaces in parent's array
+ * @parentOld:      per sink, the parent's offset in the previous rendering
+ * @parentNew:      per sink, the parent's offset in this rendering
+ * @replayed:       an ancestor's output was replayed for cacheable sinks
+ *
+ * Each child's namespaces are compared to its parent's exactly once; the
+ * resulting VisitInfo is shared by all sinks. The tree lines are updated so
+ * that if the node is the last kept child, "└─" is used instead of "├─".
+ *
+ * With the render cache on, cacheable sinks copy a clean subtree from their
+ * previous rendering instead; the walk only continues below it if some
+ * other sink still needs to see every node.
+ */
+static void render_tree(ProcInfo *proc, const char *prefix, int isLast,
+                        size_t depth, const NamespaceEntry *parentNs,
+                        size_t parentNsCount, const size_t *parentOld,
+                        const size_t *parentNew, int replayed) {
+  /* If this node is pruned, skip it. */
+  if (!proc->keep) {
+    return;
+  }
+
+  int caching = g_renderCache && !replayed;
+  int replay = 0;
+  if (caching) {
+    unsigned long long hash = render_prefix_hash(prefix);
+    replay = render_can_replay(proc, hash, isLast, depth, parentOld);
+    if (!proc->spans) {
+      proc->spans = calloc(g_sinkCount, sizeof(RenderSpan));
+      if (!proc->spans) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+      }
+    }
+    proc->renderPrefixHash = hash;
+    proc->renderIsLast = isLast;
+    proc->renderDepth = depth;
+  }
+
+  unsigned int diffMask = namespace_diff_mask(proc, parentNs, parentNsCount);
+  VisitInfo visit = {proc,     prefix,        isLast, depth,
+                     parentNs, parentNsCount, diffMask};
+  size_t oldStart[MAX_SINKS], newStart[MAX_SINKS];
+  int walk = !caching || !replay; /* someone needs the children */
+  for (size_t s = 0; s < g_sinkCount; s++) {
+    Sink *sink = &g_sinks[s];
+    if (!g_renderCache || !sink->format->cacheable) {
+      sink->format->node(sink, &visit);
+      walk = 1;
+      continue;
+    }
+    if (replayed)
+      continue;
+    oldStart[s] = parentOld[s] + proc->spans[s].start;
+    newStart[s] = sink->len;
+    if (replay)
+      sink_write(sink, sink->prev + oldStart[s], proc->spans[s].len);
+    else
+      sink->format->node(sink, &visit);
+  }
+
+  if (walk) {
+    /* Prepare prefix for children */
+    char newPrefix[1024];
+    snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix,
+             (isLast ? "  " : "│ "));
+
+    /*
+     * Find which child is actually the last 'kept' child
+     * so that we show "└─" instead of "├─" for that child.
+     */
+    int lastKeptIdx = -1;
+    for (int i = (int)proc->childCount - 1; i >= 0; i--) {
+      if (proc->children[i]->keep) {
+        lastKeptIdx = i;
+        break;
+      }
+    }
+
+    /* Recurse for children */
+    for (size_t i = 0; i < proc->childCount; i++) {
+      if (!proc->children[i]->keep) {
+        continue;
+      }
+      render_tree(proc->children[i], newPrefix, (int)i == lastKeptIdx,
+                  depth + 1, proc->namespaces, proc->nsCount, oldStart,
+                  newStart, replayed || replay);
+    }
+  }
+
+  if (caching) {
+    for (size_t s = 0; s < g_sinkCount; s++) {
+      if (!g_sinks[s].format->cacheable)
+        continue;
+      proc->spans[s].start = newStart[s] - parentNew[s];
+      if (!replay)
+        proc->spans[s].len = g_sinks[s].len - newStart[s];
+    }
+    proc->renderValid = 1;
+  }
+}
+
+/**
+ * walk_tree - render_tree() for runs without the render cache
+ */
+static void walk_tree(const ProcInfo *proc, const char *prefix, int isLast,
+                      size_t depth, const NamespaceEntry *parentNs,
+                      size_t parentNsCount) {
+  unsigned int diffMask = namespace_diff_mask(proc, parentNs, parentNsCount);
+  VisitInfo visit = {proc,     prefix,        isLast, depth,
+                     parentNs, parentNsCount, diffMask};
+  for (size_t s = 0; s < g_sinkCount; s++)
+    g_sinks[s].format->node(&g_sinks[s], &visit);
+
+  char newPrefix[1024];
+  snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix,
+           (isLast ? "  " : "│ "));
+
+  size_t end = proc->childCount;
+  while (end && !proc->children[end - 1]->keep)
+    end--;
+  for (size_t i = 0; i < end; i++) {
+    if (proc->children[i]->keep)
+      walk_tree(proc->children[i], newPrefix, i == end - 1, depth + 1,
+                proc->namespaces, proc->nsCount);
+  }
+}
+
+/**
+ * walk_flat - Visit the kept tree for sinks that do not draw it
+ *
+ * Nothing needs the indentation or to know which sibling is last, so
+ * VisitInfo.prefix is empty and isLast is 0 throughout.
+ */
+static void walk_flat(const ProcInfo *proc, size_t depth,
+                      const NamespaceEntry *parentNs, size_t parentNsCount) {
+  unsigned int diffMask = namespace_diff_mask(proc, parentNs, parentNsCount);
+  VisitInfo visit = {proc,     "",            0, depth,
+                     parentNs, parentNsCount, diffMask};
+  for (size_t s = 0; s < g_sinkCount; s++)
+    g_sinks[s].format->node(&g_sinks[s], &visit);
+
+  for (size_t i = 0; i < proc->childCount; i++) {
+    if (proc->children[i]->keep)
+      walk_flat(proc->children[i], depth + 1, proc->namespaces,
+                proc->nsCount);
+  }
+}
+
+static void walk_cached_root(ProcInfo *root) {
+  size_t origin[MAX_SINKS] = {0};
+  render_tree(root, "", 1, 0, NULL, 0, origin, origin, 0);
+}
+static void walk_tree_root(ProcInfo *root) {
+  walk_tree(root, "", 1, 0, NULL, 0);
+}
+static void walk_flat_root(ProcInfo *root) { walk_flat(root, 0, NULL, 0); }
+
+enum { WALK_CACHED, WALK_TREE, WALK_FLAT };
+static void (*const g_walkKernels[])(ProcInfo *root) = {
+    walk_cached_root, walk_tree_root, walk_flat_root};
+static void (*g_walkKernel)(ProcInfo *root) = walk_tree_root;
+
+/**
+ * traversal_select - Pick the keep and walk kernels for the current options
+ *
+ * Called once the outputs are known, again when watch mode turns on the
+ * render cache, and whenever the TUI edits the filters, so the kernels can
+ * leave out every per-node test on options that are fixed for the run.
+ */
+static void traversal_select(void) {
+  g_filterAny = 0;
+  g_filterKinds = 0;
+  for (size_t f = 0; f < g_filterCount; f++) {
+    int t = ns_type_index(g_filters[f]);
+    if (strcmp(g_filters[f], "*") == 0)
+      g_filterAny = 1;
+    else if (t >= 0 && g_nsKinds[t] == t)
+      g_filterKinds |= 1u << t; /* *_for_children is never an entry type */
+  }
+  g_keepKernel = g_keepKernels[!g_filterCount ? KEEP_ALL
+                               : g_filterAny  ? KEEP_ANY
+                                              : KEEP_TYPED];
+
+  int drawn = 0;
+  for (size_t s = 0; s < g_sinkCount; s++)
+    drawn |= (g_sinks[s].format->node == tree_node);
+  g_walkKernel = g_walkKernels[g_renderCache ? WALK_CACHED
+                               : drawn       ? WALK_TREE
+                                             : WALK_FLAT];
+}
+
+/**
+ * sinks_begin - Start a rendering on every sink
+ */
+static void sinks_begin(void) {
+  for (size_t s = 0; s < g_sinkCount; s++) {
+    /* Files always hold the latest rendering only */
+    if (g_sinks[s].isFile) {
+      if (lseek(g_sinks[s].fd, 0, SEEK_SET) < 0 ||
+          ftruncate(g_sinks[s].fd, 0) < 0) {
+        perror(g_sinks[s].dest);
+        exit(EXIT_FAILURE);
+      }
+    }
+    g_sinks[s].retain = g_renderCache && g_sinks[s].format->cacheable;
+    if (g_sinks[s].format->begin)
+      g_sinks[s].format->begin(&g_sinks[s]);
+  }
+}
+
+/**
+ * sinks_end - Finish a rendering on every sink and write it out
+ */
+static void sinks_end(void) {
+  for (size_t s = 0; s < g_sinkCount; s++) {
+    Sink *sink = &g_sinks[s];
+    if (sink->format->end)
+      sink->format->end(sink);
+    if (!sink->retain) {
+      sink_flush(sink);
+      continue;
+    }
+
+    /* Keep this rendering around as the next one's source */
+    size_t len = sink->len;
+    sink_flush(sink);
+    char *buf = sink->buf;
+    size_t cap = sink->cap;
+    sink->buf = sink->prev;
+    sink->cap = sink->prevCap;
+    sink->prev = buf;
+    sink->prevCap = cap;
+    sink->prevLen = len;
+  }
+}
+
+/**
+ * render_all_sinks - Run one traversal from @root through every sink
+ */
+static void render_all_sinks(ProcInfo *root) {
+  if (g_renderCache) {
+    /* A task pruned or unpruned by the filters changes its parent's output */
+    for (size_t i = 0; i < g_procCount; i++) {
+      ProcInfo *proc = &g_processes[i];
+      if (proc->keep != proc->renderedKeep) {
+        render_invalidate(proc);
+        proc->renderedKeep = proc->keep;
+      }
+    }
+  }
+
+  sinks_begin();
+  if (root && root->keep)
+    g_walkKernel(root);
+  sinks_end();
+}
+
+/**
+ * rescue_setup - Point every growable table at its static --rescue array
+ *
+ * The tables are sized for RESCUE_MAX_TASKS up front, so none of them
+ * ever reaches its growth path.
+ */
+static void rescue_setup(void) {
+  static pid_t pidKeys[2 * RESCUE_MAX_TASKS];
+  static size_t pidVals[2 * RESCUE_MAX_TASKS];
+  static size_t order[RESCUE_MAX_TASKS], orderTmp[RESCUE_MAX_TASKS];
+  static char sinkBufs[MAX_SINKS][2 * SINK_FLUSH_THRESHOLD];
+
+  g_processes = g_rescueTasks;
+  g_procCapacity = RESCUE_MAX_TASKS;
+  g_pidIndex.keys = pidKeys;
+  g_pidIndex.vals = pidVals;
+  g_pidIndex.cap = 2 * RESCUE_MAX_TASKS;
+  g_order = order;
+  g_orderTmp = orderTmp;
+  g_orderCap = RESCUE_MAX_TASKS;
+  for (size_t s = 0; s < g_sinkCount; s++) {
+    g_sinks[s].buf = sinkBufs[s];
+    g_sinks[s].cap = sizeof(sinkBufs[s]);
+  }
+}
+
+/* ---- --mem-limit: external-memory scan and traversal ---- */
+
+/*
+ * With --mem-limit, tasks are never held as ProcInfo entries. Each one is
+ * packed into a SpillRec, the records are sorted by (ppid, child order) in
+ * runs that fit the limit and merged into one temporary file, and the tree
+ * is walked from that file: a task's children are the contiguous records
+ * carrying its PID as ppid, found by binary search. Only the current path
+ * is unpacked, so memory stays within the limit plus the tree depth.
+ */
+
+/**
+ * struct SpillNs - One namespace link of a SpillRec
+ * @ino:     The namespace inode
+ * @typeIdx: Index of the link name in g_nsTypes
+ * @kind:    Index of the link target's type in g_nsTypes
+ */
+typedef struct {
+  unsigned long long ino;
+  signed char typeIdx;
+  signed char kind;
+} SpillNs;
+
+/**
+ * struct SpillRec - A task packed for the spill file
+ * @seq:  Position in the /proc scan, the key for --sort=scan
+ * @keep: Set on disk by spill_mark_keep() when filters are used
+ *
+ * comm is cut to the kernel's TASK_COMM_LEN and namespace types that
+ * g_nsTypes does not know are dropped; everything else matches ProcInfo.
+ */
+typedef struct {
+  pid_t pid;
+  pid_t ppid;
+  unsigned long long starttime;
+  long numThreads;
+  unsigned int seq;
+  unsigned char isThread;
+  unsigned char nsReadable;
+  unsigned char nsCount;
+  unsigned char keep;
+  char comm[16];
+  SpillNs ns[MAX_NAMESPACES];
+} SpillRec;
+
+/**
+ * struct SpillRun - A sorted run in the run file
+ * @off:   Index of the run's first record
+ * @count: Records in the run
+ * @pos:   Records of the run consumed by the merge so far
+ * @buf:   Merge read buffer
+ * @len:   Records in @buf
+ * @next:  Next record of @buf to hand out
+ */
+typedef struct {
+  size_t off;
+  size_t count;
+  size_t pos;
+  SpillRec *buf;
+  size_t len;
+  size_t next;
+} SpillRun;
+
+static size_t g_memLimit = 0; /* --mem-limit in bytes, 0 = off */
+static SpillRec *g_spillBuf = NULL;
+static size_t g_spillBufCap = 0; /* records that fit the limit */
+static size_t g_spillBufLen = 0;
+static SpillRun *g_spillRuns = NULL;
+static size_t g_spillRunCount = 0;
+static size_t g_spillRunCap = 0;
+static int g_spillRunFd = -1; /* sorted runs, back to back */
+static int g_spillFd = -1;    /* all records, merged */
+static size_t g_spillCount = 0;
+static SpillRec g_spillRoot;
+static int g_spillHaveRoot = 0;
+
+/**
+ * parse_size - Parse a byte count with an optional K, M or G suffix
+ *
+ * Return: 0 on success, -1 if @arg is not a positive size.
+ */
+static int parse_size(const char *arg, size_t *size) {
+  char *end;
+  unsigned long long v = strtoull(arg, &end, 10);
+  switch (*end) {
+  case 'k':
+  case 'K':
+    v <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    v <<= 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    v <<= 30;
+    end++;
+    break;
+  }
+  if (end == arg || *end || v == 0)
+    return -1;
+  *size = (size_t)v;
+  return 0;
+}
+
+/* An unlinked file in $TMPDIR (or /tmp) that disappears with the process */
+static int spill_tmpfile(void) {
+  const char *dir = getenv("TMPDIR");
+  if (!dir || !*dir)
+    dir = "/tmp";
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_EXCL | O_CLOEXEC, 0600);
+  if (fd >= 0)
+    return fd;
+
+  /* Filesystems without O_TMPFILE */
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/nstree.XXXXXX", dir);
+  fd = mkstemp(path);
+  if (fd < 0) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  unlink(path);
+  return fd;
+}
+
+static void spill_pwrite(int fd, const void *data, size_t len, off_t off) {
+  const char *p = data;
+  while (len) {
+    ssize_t n = pwrite(fd, p, len, off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("spill file");
+      exit(EXIT_FAILURE);
+    }
+    p += n;
+    len -= (size_t)n;
+    off += n;
+  }
+}
+
+static void spill_pread(int fd, void *data, size_t len, off_t off) {
+  char *p = data;
+  while (len) {
+    ssize_t n = pread(fd, p, len, off);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      fprintf(stderr, "spill file: short read\n");
+      exit(EXIT_FAILURE);
+    }
+    p += n;
+    len -= (size_t)n;
+    off += n;
+  }
+}
+
+/**
+ * spill_compare - Order records by parent, then by g_childOrder
+ *
+ * Ties are broken by PID, as child_order_sort() does, so --mem-limit
+ * prints the same tree as the in-memory build.
+ */
+static int spill_compare(const void *a, const void *b) {
+  const SpillRec *x = a, *y = b;
+  if (x->ppid != y->ppid)
+    return x->ppid < y->ppid ? -1 : 1;
+  switch (g_childOrder) {
+  case CHILD_ORDER_SCAN:
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+  case CHILD_ORDER_START:
+    if (x->starttime != y->starttime)
+      return x->starttime < y->starttime ? -1 : 1;
+    break;
+  case CHILD_ORDER_COMM: {
+    int c = memcmp(x->comm, y->comm, sizeof(x->comm));
+    if (c)
+      return c;
+    break;
+  }
+  }
+  unsigned int px = (unsigned int)x->pid, py = (unsigned int)y->pid;
+  return px < py ? -1 : px > py;
+}
+
+static void spill_pack(const ProcInfo *proc, SpillRec *rec) {
+  memset(rec, 0, sizeof(*rec));
+  rec->pid = proc->pid;
+  rec->ppid = proc->ppid;
+  rec->starttime = proc->starttime;
+  rec->numThreads = proc->numThreads;
+  rec->isThread = (unsigned char)proc->isThread;
+  rec->nsReadable = (unsigned char)proc->nsReadable;
+  size_t commLen = strlen(proc->comm);
+  memcpy(rec->comm, proc->comm,
+         commLen < sizeof(rec->comm) ? commLen : sizeof(rec->comm));
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    int kind = ns_type_index(proc->namespaces[i].type);
+    if (kind < 0 || proc->namespaces[i].typeIdx < 0)
+      continue;
+    SpillNs *ns = &rec->ns[rec->nsCount++];
+    ns->ino = proc->namespaces[i].ino;
+    ns->typeIdx = (signed char)proc->namespaces[i].typeIdx;
+    ns->kind = (signed char)kind;
+  }
+}
+
+static void spill_unpack(const SpillRec *rec, ProcInfo *proc) {
+  memset(proc, 0, sizeof(*proc));
+  proc->pid = rec->pid;
+  proc->ppid = rec->ppid;
+  proc->starttime = rec->starttime;
+  proc->numThreads = rec->numThreads;
+  proc->isThread = rec->isThread;
+  proc->nsReadable = rec->nsReadable;
+  memcpy(proc->comm, rec->comm, sizeof(rec->comm));
+  proc->nsCount = rec->nsCount;
+  for (size_t i = 0; i < rec->nsCount; i++) {
+    NamespaceEntry *ns = &proc->namespaces[i];
+    const char *kind = g_nsTypes[(int)rec->ns[i].kind];
+    snprintf(ns->type, sizeof(ns->type), "%s", kind);
+    snprintf(ns->inode, sizeof(ns->inode), "%s:[%llu]", kind,
+             rec->ns[i].ino);
+    ns->ino = rec->ns[i].ino;
+    ns->typeIdx = rec->ns[i].typeIdx;
+  }
+}
+
+/* Sort the buffered records and append them to the run file */
+static void spill_flush_run(void) {
+  if (!g_spillBufLen)
+    return;
+  qsort(g_spillBuf, g_spillBufLen, sizeof(*g_spillBuf), spill_compare);
+
+  if (g_spillRunCount == g_spillRunCap) {
+    g_spillRunCap = g_spillRunCap ? g_spillRunCap * 2 : 16;
+    g_spillRuns = realloc(g_spillRuns, g_spillRunCap * sizeof(*g_spillRuns));
+    if (!g_spillRuns) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+  }
+  SpillRun *run = &g_spillRuns[g_spillRunCount++];
+  memset(run, 0, sizeof(*run));
+  run->off = g_spillCount;
+  run->count = g_spillBufLen;
+  spill_pwrite(g_spillRunFd, g_spillBuf, g_spillBufLen * sizeof(SpillRec),
+               (off_t)(g_spillCount * sizeof(SpillRec)));
+  g_spillCount += g_spillBufLen;
+  g_spillBufLen = 0;
+}
+
+/* scan_proc() visitor: read one task and pack it into the run buffer */
+static void spill_visit(const char *statPath, int isThread) {
+  static ProcInfo scratch;
+
+  if (read_stat_file(statPath, isThread, &scratch) != 0)
+    return;
+  char pidPath[PATH_MAX];
+  stat_path_to_dir(statPath, pidPath);
+  read_namespaces(&scratch, pidPath);
+
+  if (g_spillBufLen == g_spillBufCap)
+    spill_flush_run();
+  SpillRec *rec = &g_spillBuf[g_spillBufLen++];
+  spill_pack(&scratch, rec);
+  rec->seq = (unsigned int)(g_spillCount + g_spillBufLen);
+  if (rec->pid == 1 && !rec->isThread && !g_spillHaveRoot) {
+    g_spillRoot = *rec;
+    g_spillHaveRoot = 1;
+  }
+}
+
+/* Refill @run's merge buffer; returns its next record or NULL at the end */
+static const SpillRec *spill_run_head(SpillRun *run, size_t bufRecs) {
+  if (run->next == run->len) {
+    size_t n = run->count - run->pos;
+    if (n > bufRecs)
+      n = bufRecs;
+    if (!n)
+      return NULL;
+    spill_pread(g_spillRunFd, run->buf, n * sizeof(SpillRec),
+                (off_t)((run->off + run->pos) * sizeof(SpillRec)));
+    run->pos += n;
+    run->len = n;
+    run->next = 0;
+  }
+  return &run->buf[run->next];
+}
+
+static void spill_heap_sift_down(SpillRun **heap, size_t count, size_t i) {
+  for (;;) {
+    size_t min = i, l = 2 * i + 1, r = l + 1;
+    if (l < count && spill_compare(&heap[l]->buf[heap[l]->next],
+                                   &heap[min]->buf[heap[min]->next]) < 0)
+      min = l;
+    if (r < count && spill_compare(&heap[r]->buf[heap[r]->next],
+                                   &heap[min]->buf[heap[min]->next]) < 0)
+      min = r;
+    if (min == i)
+      return;
+    SpillRun *tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+/**
+ * spill_merge - Merge the sorted runs into g_spillFd
+ *
+ * A single k-way merge: the record budget is split evenly between the k
+ * read buffers and the write buffer, so the merge stays within the limit.
+ * A single run is already the final file.
+ */
+static void spill_merge(void) {
+  if (g_spillRunCount <= 1) {
+    g_spillFd = g_spillRunFd;
+    g_spillRunFd = -1;
+    return;
+  }
+
+  size_t bufRecs = g_spillBufCap / (g_spillRunCount + 1);
+  if (!bufRecs)
+    bufRecs = 1;
+  SpillRun **heap = malloc(g_spillRunCount * sizeof(*heap));
+  SpillRec *out = malloc(bufRecs * sizeof(*out));
+  if (!heap || !out) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  size_t heapCount = 0;
+  for (size_t r = 0; r < g_spillRunCount; r++) {
+    SpillRun *run = &g_spillRuns[r];
+    run->buf = malloc(bufRecs * sizeof(*run->buf));
+    if (!run->buf) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    if (spill_run_head(run, bufRecs))
+      heap[heapCount++] = run;
+  }
+  for (size_t i = heapCount / 2; i-- > 0;)
+    spill_heap_sift_down(heap, heapCount, i);
+
+  g_spillFd = spill_tmpfile();
+  size_t outLen = 0, written = 0;
+  while (heapCount) {
+    SpillRun *run = heap[0];
+    out[outLen++] = run->buf[run->next++];
+    if (outLen == bufRecs) {
+      spill_pwrite(g_spillFd, out, outLen * sizeof(*out),
+                   (off_t)(written * sizeof(*out)));
+      written += outLen;
+      outLen = 0;
+    }
+    if (!spill_run_head(run, bufRecs))
+      heap[0] = heap[--heapCount];
+    spill_heap_sift_down(heap, heapCount, 0);
+  }
+  spill_pwrite(g_spillFd, out, outLen * sizeof(*out),
+               (off_t)(written * sizeof(*out)));
+
+  for (size_t r = 0; r < g_spillRunCount; r++)
+    free(g_spillRuns[r].buf);
+  free(heap);
+  free(out);
+  close(g_spillRunFd);
+  g_spillRunFd = -1;
+}
+
+static void spill_read(size_t idx, SpillRec *rec) {
+  spill_pread(g_spillFd, rec, sizeof(*rec), (off_t)(idx * sizeof(*rec)));
+}
+
+/**
+ * spill_children - Locate the records of @pid's children
+ * @first: Set to the index of the first child
+ *
+ * Return: the number of records with @pid as ppid (which may include @pid
+ *         itself if it claims to be its own parent).
+ */
+static size_t spill_children(pid_t pid, size_t *first) {
+  SpillRec rec;
+  size_t lo = 0, hi = g_spillCount;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    spill_read(mid, &rec);
+    if (rec.ppid < pid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  *first = lo;
+  hi = g_spillCount;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    spill_read(mid, &rec);
+    if (rec.ppid <= pid)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - *first;
+}
+
+static int spill_kept(const SpillRec *rec) {
+  return rec->pid != rec->ppid && (g_filterCount == 0 || rec->keep);
+}
+
+/**
+ * spill_mark_keep - mark_keep_processes() over the spill file
+ *
+ * Kept records get their keep byte set in place; the traversal only holds
+ * the current path in memory.
+ */
+static int spill_mark_keep(ProcInfo *proc, const NamespaceEntry *parentNs,
+                           size_t parentNsCount) {
+  proc->keep = filter_keeps(proc, parentNs, parentNsCount);
+
+  size_t first, count = spill_children(proc->pid, &first);
+  for (size_t i = first; i < first + count; i++) {
+    SpillRec rec;
+    spill_read(i, &rec);
+    if (rec.pid == rec.ppid)
+      continue;
+    ProcInfo child;
+    spill_unpack(&rec, &child);
+    if (spill_mark_keep(&child, proc->namespaces, proc->nsCount)) {
+      unsigned char one = 1;
+      spill_pwrite(g_spillFd, &one, 1,
+                   (off_t)(i * sizeof(rec) + offsetof(SpillRec, keep)));
+      proc->keep = 1;
+    }
+  }
+  return proc->keep;
+}
+
+/**
+ * spill_render - render_tree() over the spill file
+ *
+ * Every sink is streamable, so the VisitInfo may point at a ProcInfo that
+ * only lives in this frame.
+ */
+static void spill_render(const ProcInfo *proc, const char *prefix,
+                         int isLast, size_t depth,
+                         const NamespaceEntry *parentNs,
+                         size_t parentNsCount) {
+  unsigned int diffMask = namespace_diff_mask(proc, parentNs, parentNsCount);
+  VisitInfo visit = {proc,     prefix,        isLast, depth,
+                     parentNs, parentNsCount, diffMask};
+  for (size_t s = 0; s < g_sinkCount; s++)
+    g_sinks[s].format->node(&g_sinks[s], &visit);
+
+  char newPrefix[1024];
+  snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix,
+           (isLast ? "  " : "│ "));
+
+  /* Siblings are contiguous, so the last kept one is found from the end */
+  SpillRec rec;
+  size_t first, last = 0;
+  size_t end = spill_children(proc->pid, &first);
+  end += first;
+  for (size_t i = end; i > first; i--) {
+    spill_read(i - 1, &rec);
+    if (spill_kept(&rec)) {
+      last = i - 1;
+      end = i;
+      break;
+    }
+    end = i - 1;
+  }
+
+  for (size_t i = first; i < end; i++) {
+    spill_read(i, &rec);
+    if (!spill_kept(&rec))
+      continue;
+    ProcInfo child;
+    spill_unpack(&rec, &child);
+    spill_render(&child, newPrefix, i == last, depth + 1, proc->namespaces,
+                 proc->nsCount);
+  }
+}
+
+/**
+ * run_spill - One-shot scan and rendering within --mem-limit
+ */
+static void run_spill(void) {
+  g_spillBufCap = g_memLimit / sizeof(SpillRec);
+  if (g_spillBufCap < 16)
+    g_spillBufCap = 16;
+  g_spillBuf = malloc(g_spillBufCap * sizeof(*g_spillBuf));
+  if (!g_spillBuf) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  g_spillRunFd = spill_tmpfile();
+
+  scan_proc(spill_visit);
+  spill_flush_run();
+  /* The run buffer's memory is handed over to the merge */
+  free(g_spillBuf);
+  g_spillBuf = NULL;
+  spill_merge();
+  free(g_spillRuns);
+
+  if (g_unreadableFound) {
+	  fprintf(stderr, "Warning, namespaces that could not be read is marked with an asterisk. Run as root for full info.\n");
+  }
+
+  sinks_begin();
+  if (g_spillHaveRoot) {
+    ProcInfo *root = malloc(sizeof(*root));
+    if (!root) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    spill_unpack(&g_spillRoot, root);
+    if (g_filterCount == 0 || spill_mark_keep(root, NULL, 0))
+      spill_render(root, "", 1, 0, NULL, 0);
+    free(root);
+  }
+  sinks_end();
+  close(g_spillFd);
+}
+
+/**
+ * struct WatchStats - What changed during one watch tick
+ * @added:   Tasks that appeared (including PIDs reused by a new task)
+ * @removed: Tasks that disappeared
+ * @changed: Survivors whose parent, comm or namespaces changed
+ */
+typedef struct {
+  size_t added;
+  size_t removed;
+  size_t changed;
+} WatchStats;
+
+static int g_watch = 0;                /* --watch given */
+static double g_watchMin = 0.25;       /* fastest poll interval, seconds */
+static double g_watchMax = 2.0;        /* slowest poll interval, seconds */
+static size_t g_nsSample = 64;         /* survivors whose ns are re-read */
+static unsigned long g_tick = 0;       /* current watch generation */
+static size_t g_nsCursor = 0;          /* rotating ns revalidation cursor */
+static WatchStats g_tickStats;         /* accumulated by watch_visit_task */
+static volatile sig_atomic_t g_stop = 0;
+
+/* Poll so that roughly this many changes are picked up per tick */
+#define WATCH_TARGET_CHURN 8.0
+
+/**
+ * struct NsRecord - One live namespace known to watch mode
+ * @ino:         Namespace inode, unique across all types; 0 = empty slot
+ * @typeIdx:     Index into g_nsTypes
+ * @members:     Tasks currently in this namespace
+ * @prevMembers: @members at the start of the tick that last touched it
+ * @touchedTick: Tick in which @prevMembers was recorded
+ * @pid:         The task that last moved @members to or from zero
+ * @ppid:        Its parent
+ * @comm:        Its command name
+ *
+ * Counting starts from the first full scan; namespaces without any member
+ * task (held only by a bind mount or an open fd) are not seen.
+ */
+typedef struct {
+  unsigned long long ino;
+  int typeIdx;
+  size_t members;
+  size_t prevMembers;
+  unsigned long touchedTick;
+  pid_t pid;
+  pid_t ppid;
+  char comm[32];
+} NsRecord;
+
+static NsRecord *g_nsTable = NULL;       /* open addressing by ino */
+static size_t g_nsTableCap = 0;          /* power of two */
+static size_t g_nsTableCount = 0;        /* occupied slots */
+static unsigned long long *g_nsDirty = NULL; /* inos touched this tick */
+static size_t g_nsDirtyCount = 0;
+static size_t g_nsDirtyCap = 0;
+
+/**
+ * ns_table_slot - Find the slot of @ino, or the empty slot it would use
+ */
+static size_t ns_table_slot(unsigned long long ino) {
+  size_t h = ns_hash(ino, g_nsTableCap);
+  while (g_nsTable[h].ino && g_nsTable[h].ino != ino)
+    h = (h + 1) & (g_nsTableCap - 1);
+  return h;
+}
+
+/**
+ * ns_table_find - Look up a namespace record by inode
+ *
+ * Return: the record, or NULL if the namespace has no known member.
+ */
+static NsRecord *ns_table_find(unsigned long long ino) {
+  if (!g_nsTableCap)
+    return NULL;
+  size_t h = ns_table_slot(ino);
+  return g_nsTable[h].ino ? &g_nsTable[h] : NULL;
+}
+
+/**
+ * ns_table_resize - Rehash the table into @newCap slots (a power of two)
+ */
+static void ns_table_resize(size_t newCap) {
+  size_t oldCap = g_nsTableCap;
+  NsRecord *old = g_nsTable;
+  g_nsTableCap = newCap;
+  g_nsTable = calloc(g_nsTableCap, sizeof(*g_nsTable));
+  if (!g_nsTable) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < oldCap; i++) {
+    if (old[i].ino)
+      g_nsTable[ns_table_slot(old[i].ino)] = old[i];
+  }
+  free(old);
+}
+
+/**
+ * ns_table_get - Look up or insert the record for @ino
+ */
+static NsRecord *ns_table_get(unsigned long long ino, int typeIdx) {
+  if ((g_nsTableCount + 1) * 2 > g_nsTableCap)
+    ns_table_resize(g_nsTableCap ? g_nsTableCap * 2 : 256);
+
+  size_t h = ns_table_slot(ino);
+  if (!g_nsTable[h].ino) {
+    memset(&g_nsTable[h], 0, sizeof(g_nsTable[h]));
+    g_nsTable[h].ino = ino;
+    g_nsTable[h].typeIdx = typeIdx;
+    g_nsTableCount++;
+  }
+  return &g_nsTable[h];
+}
+
+/**
+ * ns_table_delete - Remove @ino, shifting back later entries of its cluster
+ */
+static void ns_table_delete(unsigned long long ino) {
+  size_t hole = ns_table_slot(ino);
+  if (!g_nsTable[hole].ino)
+    return;
+  g_nsTable[hole].ino = 0;
+  g_nsTableCount--;
+
+  size_t i = hole;
+  for (;;) {
+    i = (i + 1) & (g_nsTableCap - 1);
+    if (!g_nsTable[i].ino)
+      return;
+    size_t home = ns_hash(g_nsTable[i].ino, g_nsTableCap);
+    /* Move the entry into the hole unless its home lies in (hole, i] */
+    int between = hole <= i ? (home > hole && home <= i)
+                            : (home > hole || home <= i);
+    if (!between) {
+      g_nsTable[hole] = g_nsTable[i];
+      g_nsTable[i].ino = 0;
+      hole = i;
+    }
+  }
+}
+
+/**
+ * ns_table_adjust - Add @delta (+1/-1) members to every namespace of @proc
+ *
+ * The first adjustment of a namespace in a tick remembers its previous
+ * member count, so ns_events_flush can tell creation and destruction apart
+ * from a task merely being replaced within the same tick.
+ */
+static void ns_table_adjust(const ProcInfo *proc, int delta) {
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    const NamespaceEntry *ns = &proc->namespaces[i];
+    if (ns->typeIdx < 0 || !ns->ino ||
+        strstr(g_nsTypes[ns->typeIdx], "_for_children"))
+      continue;
+
+    NsRecord *rec = ns_table_get(ns->ino, ns->typeIdx);
+    if (rec->touchedTick != g_tick) {
+      rec->touchedTick = g_tick;
+      rec->prevMembers = rec->members;
+      if (g_nsDirtyCount == g_nsDirtyCap) {
+        g_nsDirtyCap = g_nsDirtyCap ? g_nsDirtyCap * 2 : 64;
+        unsigned long long *tmp =
+            realloc(g_nsDirty, g_nsDirtyCap * sizeof(*tmp));
+        if (!tmp) {
+          perror("realloc");
+          exit(EXIT_FAILURE);
+        }
+        g_nsDirty = tmp;
+      }
+      g_nsDirty[g_nsDirtyCount++] = ns->ino;
+    }
+
+    int crossedZero;
+    if (delta > 0)
+      crossedZero = (rec->members++ == 0);
+    else
+      crossedZero = (rec->members > 0 && --rec->members == 0);
+
+    if (crossedZero) {
+      rec->pid = proc->pid;
+      rec->ppid = proc->ppid;
+      snprintf(rec->comm, sizeof(rec->comm), "%.*s",
+               (int)sizeof(rec->comm) - 1, proc->comm);
+    }
+  }
+}
+
+/* ---- ad-hoc aggregation over the task table (--query) ---- */
+
+/*
+ * "count,sum(rss) by ns:pid,comm where ns:user!=host and thread=0" is
+ * compiled once into field references, then run in a single pass over a
+ * snapshot of the task table right after the scan: no tree is built or
+ * rendered. Groups are found through an open-addressing hash on the key
+ * fields; a group keeps its first task, against which later tasks' keys
+ * are compared, so keys (comm included) are never copied.
+ */
+
+#define QUERY_MAX_TERMS 8
+
+/* Task fields, then one per namespace type (QUERY_NS + typeIdx) */
+enum { QUERY_PID, QUERY_PPID, QUERY_COMM, QUERY_THREAD, QUERY_THREADS,
+       QUERY_RSS, QUERY_CPU, QUERY_START, QUERY_NS };
+static const char *const g_queryFieldNames[] = {
+    "pid", "ppid", "comm", "thread", "threads", "rss", "cpu", "start"};
+
+enum { QUERY_COUNT, QUERY_SUM, QUERY_MIN, QUERY_MAX };
+static const char *const g_queryAggNames[] = {"count", "sum", "min", "max"};
+
+enum { QUERY_EQ, QUERY_NE, QUERY_LT, QUERY_LE, QUERY_GT, QUERY_GE };
+static const char *const g_queryOpNames[] = {"=", "!=", "<", "<=", ">", ">="};
+
+/**
+ * struct QueryCond - One "FIELD OP VALUE" of the where clause
+ * @field: QUERY_* field
+ * @op:    QUERY_EQ..QUERY_GE
+ * @host:  Compare with PID 1's namespace of that type instead of @value
+ * @value: Number to compare with
+ * @glob:  Pattern for comm, which only supports = and !=
+ */
+typedef struct {
+  int field;
+  int op;
+  int host;
+  long long value;
+  char glob[64];
+} QueryCond;
+
+/**
+ * struct QueryTask - What a query sees of one task
+ * @rssKb: Resident set in KiB, 0 if unknown
+ * @ino:   Namespace inode per g_nsTypes index, 0 if unreadable
+ * @comm:  The command name; /proc/<pid>/stat never reports more than 63
+ *         bytes, so this is the whole of it
+ *
+ * Queries run on these compact copies rather than on ProcInfo, so that
+ * a published snapshot of the table (see --query-socket) stays small.
+ */
+typedef struct {
+  pid_t pid;
+  pid_t ppid;
+  int isThread;
+  long numThreads;
+  long long rssKb;
+  unsigned long long cpuTime;
+  unsigned long long starttime;
+  unsigned long long ino[NS_TYPE_COUNT];
+  char comm[64];
+} QueryTask;
+
+/**
+ * struct Query - A compiled "AGGS [by KEYS] [where COND [and COND]...]"
+ * @keys:      Group-by fields
+ * @aggs:      QUERY_COUNT..QUERY_MAX
+ * @aggFields: Field of each sum/min/max, -1 for count
+ * @conds:     The where clause
+ */
+typedef struct {
+  int keys[QUERY_MAX_TERMS];
+  size_t keyCount;
+  int aggs[QUERY_MAX_TERMS];
+  int aggFields[QUERY_MAX_TERMS];
+  size_t aggCount;
+  QueryCond conds[QUERY_MAX_TERMS];
+  size_t condCount;
+} Query;
+
+static int g_query = 0;        /* --query given */
+static Query g_queryPlan;      /* ... and compiled */
+static long g_queryPageKb = 4; /* RSS pages to KiB */
+
+/* Parse a field name: a task field or ns:TYPE */
+static int query_field(const char *name, size_t len) {
+  for (size_t f = 0; f < QUERY_NS; f++) {
+    if (strlen(g_queryFieldNames[f]) == len &&
+        strncmp(name, g_queryFieldNames[f], len) == 0)
+      return (int)f;
+  }
+  if (len > 3 && strncmp(name, "ns:", 3) == 0) {
+    for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+      if (strlen(g_nsTypes[t]) == len - 3 &&
+          strncmp(name + 3, g_nsTypes[t], len - 3) == 0)
+        return QUERY_NS + (int)t;
+    }
+  }
+  return -1;
+}
+
+/* Print field @f as it was written */
+static void query_put_field(FILE *fp, int f) {
+  if (f >= QUERY_NS)
+    fprintf(fp, "ns:%s", g_nsTypes[f - QUERY_NS]);
+  else
+    fputs(g_queryFieldNames[f], fp);
+}
+
+/* Parse "count", "sum(F)", "min(F)" or "max(F)" into @q */
+static int query_parse_agg(Query *q, const char *s, size_t len) {
+  if (q->aggCount == QUERY_MAX_TERMS)
+    return -1;
+  size_t n = q->aggCount;
+  if (len == 5 && strncmp(s, "count", 5) == 0) {
+    q->aggs[n] = QUERY_COUNT;
+    q->aggFields[n] = -1;
+    q->aggCount++;
+    return 0;
+  }
+  for (int a = QUERY_SUM; a <= QUERY_MAX; a++) {
+    if (len > 5 && strncmp(s, g_queryAggNames[a], 3) == 0 && s[3] == '(' &&
+        s[len - 1] == ')') {
+      int f = query_field(s + 4, len - 5);
+      if (f < 0 || f == QUERY_COMM)
+        return -1;
+      q->aggs[n] = a;
+      q->aggFields[n] = f;
+      q->aggCount++;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/* Parse one "FIELD OP VALUE" word into @c */
+static int query_parse_cond(const char *s, QueryCond *c) {
+  size_t nameLen = strcspn(s, "=!<>");
+  memset(c, 0, sizeof(*c));
+  if ((c->field = query_field(s, nameLen)) < 0)
+    return -1;
+
+  const char *rest = s + nameLen;
+  c->op = -1;
+  for (int op = QUERY_EQ; op <= QUERY_GE; op++) {
+    size_t opLen = strlen(g_queryOpNames[op]);
+    if (strncmp(rest, g_queryOpNames[op], opLen) == 0 &&
+        (c->op < 0 || opLen > strlen(g_queryOpNames[c->op])))
+      c->op = op;
+  }
+  if (c->op < 0)
+    return -1;
+  const char *value = rest + strlen(g_queryOpNames[c->op]);
+
+  if (c->field == QUERY_COMM) {
+    if ((c->op != QUERY_EQ && c->op != QUERY_NE) ||
+        strlen(value) >= sizeof(c->glob))
+      return -1;
+    strcpy(c->glob, value);
+  } else if (c->field >= QUERY_NS && strcmp(value, "host") == 0) {
+    c->host = 1;
+  } else {
+    char *end;
+    errno = 0;
+    c->value = strtoll(value, &end, 10);
+    if (errno || end == value || *end)
+      return -1;
+  }
+  return 0;
+}
+
+/**
+ * query_parse_where - Parse "COND [and COND]..." into @conds
+ * @text: The clause, modified by tokenizing
+ *
+ * Return: the number of conditions, or -1 on a syntax error.
+ */
+static ssize_t query_parse_where(char *text, QueryCond *conds) {
+  size_t count = 0;
+  int expectCond = 1;
+  char *save = NULL;
+  for (char *tok = strtok_r(text, " \t", &save); tok;
+       tok = strtok_r(NULL, " \t", &save)) {
+    if (!expectCond && strcmp(tok, "and") == 0) {
+      expectCond = 1;
+    } else if (!expectCond || count == QUERY_MAX_TERMS ||
+               query_parse_cond(tok, &conds[count]) != 0) {
+      return -1;
+    } else {
+      count++;
+      expectCond = 0;
+    }
+  }
+  return count && !expectCond ? (ssize_t)count : -1;
+}
+
+/**
+ * query_compile - Compile "AGGS [by KEYS] [where COND [and COND]...]"
+ * @text:   The query; AGGS and KEYS are comma-separated lists without spaces
+ * @q:      Filled in
+ * @err:    Receives what is wrong on failure
+ * @errLen: Size of @err
+ *
+ * Return: 0 on success, -1 on a syntax error.
+ */
+static int query_compile(const char *text, Query *q, char *err,
+                         size_t errLen) {
+  char buf[1024];
+  memset(q, 0, sizeof(*q));
+  if (strlen(text) >= sizeof(buf)) {
+    snprintf(err, errLen, "query is too long");
+    return -1;
+  }
+  strcpy(buf, text);
+
+  enum { AGGS, BY, KEYS, WHERE } expect = AGGS;
+  char *save = NULL;
+  for (char *tok = strtok_r(buf, " \t", &save); tok;
+       tok = strtok_r(NULL, " \t", &save)) {
+    if (expect == BY && strcmp(tok, "by") == 0) {
+      expect = KEYS;
+      continue;
+    }
+    if ((expect == BY || expect == WHERE) && strcmp(tok, "where") == 0) {
+      ssize_t n = query_parse_where(save, q->conds);
+      if (n < 0) {
+        snprintf(err, errLen, "expected 'where COND [and COND]...'");
+        return -1;
+      }
+      q->condCount = (size_t)n;
+      expect = WHERE;
+      break;
+    }
+
+    int ok = (expect == AGGS || expect == KEYS);
+    for (char *p = tok; ok && *p;) {
+      size_t len = strcspn(p, ",");
+      if (expect == AGGS) {
+        ok = (query_parse_agg(q, p, len) == 0);
+      } else {
+        int f = query_field(p, len);
+        ok = (f >= 0 && q->keyCount < QUERY_MAX_TERMS);
+        if (ok)
+          q->keys[q->keyCount++] = f;
+      }
+      p += len + (p[len] == ',');
+    }
+    if (!ok) {
+      snprintf(err, errLen, "near '%.64s'", tok);
+      return -1;
+    }
+    expect = (expect == AGGS) ? BY : WHERE;
+  }
+  if (!q->aggCount || expect == KEYS) {
+    snprintf(err, errLen,
+             "expected 'AGGS [by KEYS] [where COND [and COND]...]'");
+    return -1;
+  }
+  return 0;
+}
+
+/* --query=TEXT */
+static int parse_query(const char *text) {
+  char err[128];
+  if (query_compile(text, &g_queryPlan, err, sizeof(err)) != 0) {
+    fprintf(stderr, "Bad --query: %s\n", err);
+    return -1;
+  }
+  g_query = 1;
+  return 0;
+}
+
+/* Copy what a query can see of @proc into @t */
+static void query_task_pack(const ProcInfo *proc, QueryTask *t) {
+  memset(t, 0, sizeof(*t)); /* snapshots compare tasks bytewise */
+  t->pid = proc->pid;
+  t->ppid = proc->ppid;
+  t->isThread = proc->isThread;
+  t->numThreads = proc->numThreads;
+  t->rssKb = proc->rssPages > 0 ? proc->rssPages * g_queryPageKb : 0;
+  t->cpuTime = proc->cpuTime;
+  t->starttime = proc->starttime;
+  for (size_t i = proc->nsCount; i-- > 0;) {
+    int type = proc->namespaces[i].typeIdx;
+    if (type >= 0)
+      t->ino[type] = proc->namespaces[i].ino;
+  }
+  memcpy(t->comm, proc->comm, strnlen(proc->comm, sizeof(t->comm) - 1));
+}
+
+/* Numeric value of field @f of @t; namespaces are 0 when unknown */
+static long long query_value(const QueryTask *t, int f) {
+  switch (f) {
+  case QUERY_PID:
+    return t->pid;
+  case QUERY_PPID:
+    return t->ppid;
+  case QUERY_THREAD:
+    return t->isThread;
+  case QUERY_THREADS:
+    return t->numThreads;
+  case QUERY_RSS:
+    return t->rssKb;
+  case QUERY_CPU:
+    return (long long)t->cpuTime;
+  case QUERY_START:
+    return (long long)t->starttime;
+  default:
+    return (long long)t->ino[f - QUERY_NS];
+  }
+}
+
+/*
+ * Check @t against every condition; @host is PID 1, or NULL. An unknown
+ * namespace (inode 0) on either side never satisfies a "host" condition.
+ */
+static int query_matches(const QueryCond *conds, size_t count,
+                         const QueryTask *t, const QueryTask *host) {
+  for (size_t i = 0; i < count; i++) {
+    const QueryCond *c = &conds[i];
+    if (c->field == QUERY_COMM) {
+      int match = (fnmatch(c->glob, t->comm, 0) == 0);
+      if (match != (c->op == QUERY_EQ))
+        return 0;
+      continue;
+    }
+    long long v = query_value(t, c->field);
+    long long ref = c->host ? (host ? query_value(host, c->field) : 0)
+                            : c->value;
+    if (c->host && (!v || !ref))
+      return 0;
+    int cmp = v < ref ? -1 : (v > ref);
+    int ok[] = {cmp == 0, cmp != 0, cmp < 0, cmp <= 0, cmp > 0, cmp >= 0};
+    if (!ok[c->op])
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * query_host_check - Make sure "host" can be resolved for @conds
+ * @host: PID 1, or NULL if it was not listed
+ *
+ * Return: 0 if it can, -1 with the reason in @err if PID 1 or one of the
+ * namespaces compared with "host" could not be read.
+ */
+static int query_host_check(const QueryCond *conds, size_t count,
+                            const QueryTask *host, char *err, size_t errLen) {
+  for (size_t i = 0; i < count; i++) {
+    if (!conds[i].host)
+      continue;
+    if (!host) {
+      snprintf(err, errLen, "PID 1, which 'host' refers to, is not listed");
+      return -1;
+    }
+    if (!query_value(host, conds[i].field)) {
+      snprintf(err, errLen,
+               "cannot read the %s namespace of PID 1, which 'host' "
+               "refers to",
+               g_nsTypes[conds[i].field - QUERY_NS]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static unsigned long long query_key_hash(const Query *q, const QueryTask *t) {
+  unsigned long long h = 1469598103934665603ULL;
+  for (size_t k = 0; k < q->keyCount; k++) {
+    if (q->keys[k] == QUERY_COMM) {
+      for (const char *c = t->comm; *c; c++)
+        h = (h ^ (unsigned char)*c) * 1099511628211ULL;
+    } else {
+      h = (h ^ (unsigned long long)query_value(t, q->keys[k])) *
+          0x9E3779B97F4A7C15ULL;
+    }
+  }
+  return h ^ (h >> 29);
+}
+
+static int query_key_equal(const Query *q, const QueryTask *a,
+                           const QueryTask *b) {
+  for (size_t k = 0; k < q->keyCount; k++) {
+    int f = q->keys[k];
+    if (f == QUERY_COMM ? strcmp(a->comm, b->comm) != 0
+                        : query_value(a, f) != query_value(b, f))
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * struct QueryGroup - One row of the result
+ * @first: The group's first task, which holds its key
+ * @hash:  query_key_hash() of the key
+ * @acc:   One accumulator per aggregate
+ */
+typedef struct {
+  const QueryTask *first;
+  unsigned long long hash;
+  long long acc[QUERY_MAX_TERMS];
+} QueryGroup;
+
+/**
+ * struct QueryRun - One evaluation of a query, fed a task at a time
+ * @q:     The query
+ * @host:  PID 1, which "host" refers to, or NULL
+ * @slots: Open-addressing hash into @groups (1-based, 0 = empty)
+ *
+ * The tasks fed to query_add() must stay put until query_finish().
+ */
+typedef struct {
+  const Query *q;
+  const QueryTask *host;
+  QueryGroup *groups;
+  size_t count;
+  size_t cap;
+  size_t *slots;
+  size_t slotCap;
+} QueryRun;
+
+/* Order rows by the first aggregate, largest first */
+static int query_group_compare(const void *a, const void *b) {
+  const QueryGroup *x = a, *y = b;
+  if (x->acc[0] != y->acc[0])
+    return x->acc[0] > y->acc[0] ? -1 : 1;
+  return x->first->pid < y->first->pid ? -1 : (x->first->pid > y->first->pid);
+}
+
+/* Fold @t into its group, if it matches the where clause */
+static void query_add(QueryRun *run, const QueryTask *t) {
+  const Query *q = run->q;
+  if (!query_matches(q->conds, q->condCount, t, run->host))
+    return;
+
+  if ((run->count + 1) * 2 > run->slotCap) {
+    free(run->slots);
+    run->slotCap = run->slotCap ? run->slotCap * 2 : 64;
+    run->slots = calloc(run->slotCap, sizeof(*run->slots));
+    if (!run->slots) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t g = 0; g < run->count; g++) {
+      size_t h = (size_t)run->groups[g].hash & (run->slotCap - 1);
+      while (run->slots[h])
+        h = (h + 1) & (run->slotCap - 1);
+      run->slots[h] = g + 1;
+    }
+  }
+
+  unsigned long long hash = query_key_hash(q, t);
+  size_t h = (size_t)hash & (run->slotCap - 1);
+  while (run->slots[h] &&
+         (run->groups[run->slots[h] - 1].hash != hash ||
+          !query_key_equal(q, run->groups[run->slots[h] - 1].first, t)))
+    h = (h + 1) & (run->slotCap - 1);
+
+  QueryGroup *grp;
+  int fresh = !run->slots[h];
+  if (fresh) {
+    if (run->count == run->cap) {
+      run->cap = run->cap ? run->cap * 2 : 64;
+      QueryGroup *tmp = realloc(run->groups, run->cap * sizeof(*tmp));
+      if (!tmp) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+      run->groups = tmp;
+    }
+    grp = &run->groups[run->count];
+    grp->first = t;
+    grp->hash = hash;
+    run->slots[h] = ++run->count;
+  } else {
+    grp = &run->groups[run->slots[h] - 1];
+  }
+
+  for (size_t a = 0; a < q->aggCount; a++) {
+    long long v =
+        q->aggs[a] == QUERY_COUNT ? 1 : query_value(t, q->aggFields[a]);
+    switch (q->aggs[a]) {
+    case QUERY_MIN:
+      if (fresh || v < grp->acc[a])
+        grp->acc[a] = v;
+      break;
+    case QUERY_MAX:
+      if (fresh || v > grp->acc[a])
+        grp->acc[a] = v;
+      break;
+    default:
+      grp->acc[a] = (fresh ? 0 : grp->acc[a]) + v;
+    }
+  }
+}
+
+/**
+ * query_finish - Print one tab-separated row per group to @fp, with a
+ *                header naming the columns, and free the run
+ */
+static void query_finish(QueryRun *run, FILE *fp) {
+  const Query *q = run->q;
+  free(run->slots);
+  if (run->count)
+    qsort(run->groups, run->count, sizeof(*run->groups),
+          query_group_compare);
+
+  for (size_t k = 0; k < q->keyCount; k++) {
+    query_put_field(fp, q->keys[k]);
+    fputc('\t', fp);
+  }
+  for (size_t a = 0; a < q->aggCount; a++) {
+    fputs(g_queryAggNames[q->aggs[a]], fp);
+    if (q->aggs[a] != QUERY_COUNT) {
+      fputc('(', fp);
+      query_put_field(fp, q->aggFields[a]);
+      fputc(')', fp);
+    }
+    fputc(a + 1 < q->aggCount ? '\t' : '\n', fp);
+  }
+  for (size_t g = 0; g < run->count; g++) {
+    const QueryGroup *grp = &run->groups[g];
+    for (size_t k = 0; k < q->keyCount; k++) {
+      if (q->keys[k] == QUERY_COMM)
+        fprintf(fp, "%s\t", grp->first->comm);
+      else
+        fprintf(fp, "%lld\t", query_value(grp->first, q->keys[k]));
+    }
+    for (size_t a = 0; a < q->aggCount; a++)
+      fprintf(fp, "%lld%c", grp->acc[a], a + 1 < q->aggCount ? '\t' : '\n');
+  }
+  free(run->groups);
+}
+
+/* ---- versioned snapshots for concurrent queries (--query-socket) ---- */
+
+/*
+ * Watch mode applies each tick to g_processes in place, which no other
+ * thread may look at meanwhile. Queries therefore run on an immutable
+ * snapshot instead: after every tick the updater publishes a new Epoch by
+ * swapping one pointer, and reader threads pin whichever Epoch is current
+ * when a query arrives. Neither side ever waits for the other.
+ *
+ * An Epoch is a list of fixed-size chunks of QueryTask slots. A task keeps
+ * its slot for as long as it lives, however g_processes is compacted or
+ * re-laid out, and the tick records which tasks it touched and which
+ * slots it released. The next Epoch starts out sharing every chunk of the
+ * previous one and copies a chunk only when one of its slots is written,
+ * so its cost follows the changes rather than the table size. Once fewer
+ * than half the slots are in use, all tasks are packed into fresh chunks
+ * again.
+ *
+ * Reclamation is epoch-based: a reader announces the value of
+ * g_epochClock in its own pin slot before loading g_epoch, and the updater
+ * bumps the clock after each swap and stamps the replaced Epoch with it.
+ * A retired Epoch is freed once no pin older than its stamp is left; a
+ * reader that pinned later can only have loaded a newer Epoch. Only the
+ * updater allocates and frees, so chunk reference counts need no atomics.
+ */
+
+#define EPOCH_CHUNK 256
+#ifndef QUERY_SERVER_THREADS
+#define QUERY_SERVER_THREADS 4
+#endif
+
+/**
+ * struct EpochChunk - EPOCH_CHUNK task slots, shared between Epochs
+ * @refs:  Epochs holding this chunk (updater only)
+ * @count: Slots in use; a free slot has pid 0
+ */
+typedef struct {
+  size_t refs;
+  size_t count;
+  QueryTask tasks[EPOCH_CHUNK];
+} EpochChunk;
+
+/**
+ * struct Epoch - One immutable version of the task table
+ * @tick:       The watch tick it reflects
+ * @taskCount:  Tasks over all chunks
+ * @chunks:     @chunkCount chunks of EPOCH_CHUNK slots
+ * @host:       PID 1, if it was listed
+ * @retiredAt:  g_epochClock after it was replaced
+ * @nextRetired: Next older Epoch waiting to be freed
+ */
+typedef struct Epoch {
+  unsigned long tick;
+  size_t taskCount;
+  EpochChunk **chunks;
+  size_t chunkCount;
+  QueryTask host;
+  int hasHost;
+  unsigned long retiredAt;
+  struct Epoch *nextRetired;
+} Epoch;
+
+static Epoch *g_epoch = NULL;             /* current, swapped atomically */
+static unsigned long g_epochClock = 1;    /* bumped after every swap */
+static unsigned long g_epochPins[QUERY_SERVER_THREADS]; /* 0 = not reading */
+static Epoch *g_epochRetired = NULL;      /* replaced, maybe still pinned */
+
+/* Updater only: slot bookkeeping between one Epoch and the next */
+static size_t g_epochSlotCount = 0; /* slots handed out, free or not */
+static size_t *g_epochFree = NULL;  /* free slots, 0-based */
+static size_t g_epochFreeCount = 0;
+static size_t g_epochFreeCap = 0;
+static size_t *g_epochReleased = NULL; /* to be cleared by the next build */
+static size_t g_epochReleasedCount = 0;
+static size_t g_epochReleasedCap = 0;
+static pid_t *g_epochTouched = NULL; /* to be re-packed by the next build */
+static size_t g_epochTouchedCount = 0;
+static size_t g_epochTouchedCap = 0;
+
+/* Append @v to a growable array of size_t */
+static void epoch_push(size_t **arr, size_t *count, size_t *cap, size_t v) {
+  if (*count == *cap) {
+    *cap = *cap ? *cap * 2 : 64;
+    size_t *tmp = realloc(*arr, *cap * sizeof(*tmp));
+    if (!tmp) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    *arr = tmp;
+  }
+  (*arr)[(*count)++] = v;
+}
+
+/* Something queries can see of @pid changed, or it is new */
+static void epoch_touch(pid_t pid) {
+  if (!g_epoch)
+    return; /* the first Epoch packs everything anyway */
+  if (g_epochTouchedCount == g_epochTouchedCap) {
+    g_epochTouchedCap = g_epochTouchedCap ? g_epochTouchedCap * 2 : 64;
+    pid_t *tmp = realloc(g_epochTouched, g_epochTouchedCap * sizeof(*tmp));
+    if (!tmp) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    g_epochTouched = tmp;
+  }
+  g_epochTouched[g_epochTouchedCount++] = pid;
+}
+
+/* @proc is going away: its slot is cleared and reused from the next build */
+static void epoch_forget(ProcInfo *proc) {
+  if (g_epoch && proc->epochSlot)
+    epoch_push(&g_epochReleased, &g_epochReleasedCount, &g_epochReleasedCap,
+               proc->epochSlot - 1);
+  proc->epochSlot = 0;
+}
+
+static void epoch_free(Epoch *e) {
+  for (size_t c = 0; c < e->chunkCount; c++) {
+    if (--e->chunks[c]->refs == 0)
+      free(e->chunks[c]);
+  }
+  free(e->chunks);
+  free(e);
+}
+
+static Epoch *epoch_alloc(size_t chunkCap) {
+  Epoch *e = calloc(1, sizeof(*e));
+  EpochChunk **chunks = calloc(chunkCap ? chunkCap : 1, sizeof(*chunks));
+  if (!e || !chunks) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  e->chunks = chunks;
+  e->tick = g_tick;
+  e->taskCount = g_procCount;
+  return e;
+}
+
+/**
+ * epoch_build_full - Pack every task into fresh chunks, in table order
+ *
+ * Hands out the slots anew, so it also resets the bookkeeping of what
+ * changed since the previous Epoch.
+ */
+static Epoch *epoch_build_full(void) {
+  size_t chunkCount = (g_procCount + EPOCH_CHUNK - 1) / EPOCH_CHUNK;
+  Epoch *e = epoch_alloc(chunkCount);
+  e->chunkCount = chunkCount;
+  for (size_t c = 0; c < chunkCount; c++) {
+    EpochChunk *chunk = calloc(1, sizeof(*chunk));
+    if (!chunk) {
+      perror("calloc");
+      exit(EXIT_FAILURE);
+    }
+    size_t first = c * EPOCH_CHUNK;
+    chunk->count = g_procCount - first < EPOCH_CHUNK ? g_procCount - first
+                                                     : EPOCH_CHUNK;
+    for (size_t i = 0; i < chunk->count; i++) {
+      ProcInfo *proc = &g_processes[first + i];
+      query_task_pack(proc, &chunk->tasks[i]);
+      proc->epochSlot = first + i + 1;
+      if (proc->pid == 1 && !proc->isThread) {
+        e->host = chunk->tasks[i];
+        e->hasHost = 1;
+      }
+    }
+    chunk->refs = 1;
+    e->chunks[c] = chunk;
+  }
+  g_epochSlotCount = g_procCount;
+  g_epochFreeCount = 0;
+  g_epochReleasedCount = 0;
+  g_epochTouchedCount = 0;
+  return e;
+}
+
+/* Give @e its own copy of chunk @c before one of its slots is written */
+static EpochChunk *epoch_chunk_own(Epoch *e, size_t c, unsigned char *owned) {
+  if (!owned[c]) {
+    EpochChunk *chunk = malloc(sizeof(*chunk));
+    if (!chunk) {
+      perror("malloc");
+      exit(EXIT_FAILURE);
+    }
+    if (e->chunks[c])
+      memcpy(chunk, e->chunks[c], sizeof(*chunk));
+    else
+      memset(chunk, 0, sizeof(*chunk));
+    chunk->refs = 0;
+    e->chunks[c] = chunk;
+    owned[c] = 1;
+  }
+  return e->chunks[c];
+}
+
+/**
+ * epoch_build - Snapshot g_processes, sharing unchanged chunks with @prev
+ * @prev: The current Epoch, or NULL
+ *
+ * Only the slots released and the tasks touched since @prev are written;
+ * every other chunk is @prev's own.
+ */
+static Epoch *epoch_build(const Epoch *prev) {
+  if (!prev || (g_epochSlotCount > EPOCH_CHUNK &&
+                g_procCount < g_epochSlotCount / 2))
+    return epoch_build_full();
+
+  /* Every touched task may need a new slot at the end */
+  size_t chunkCap =
+      (g_epochSlotCount + g_epochTouchedCount + EPOCH_CHUNK - 1) / EPOCH_CHUNK;
+  Epoch *e = epoch_alloc(chunkCap);
+  unsigned char *owned = calloc(chunkCap ? chunkCap : 1, 1);
+  if (!owned) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  memcpy(e->chunks, prev->chunks, prev->chunkCount * sizeof(*e->chunks));
+
+  for (size_t i = 0; i < g_epochReleasedCount; i++) {
+    size_t slot = g_epochReleased[i];
+    EpochChunk *chunk = epoch_chunk_own(e, slot / EPOCH_CHUNK, owned);
+    memset(&chunk->tasks[slot % EPOCH_CHUNK], 0, sizeof(*chunk->tasks));
+    chunk->count--;
+    epoch_push(&g_epochFree, &g_epochFreeCount, &g_epochFreeCap, slot);
+  }
+  g_epochReleasedCount = 0;
+
+  for (size_t i = 0; i < g_epochTouchedCount; i++) {
+    ssize_t idx = pid_index_find(g_epochTouched[i]);
+    if (idx < 0)
+      continue; /* gone again, and released */
+    ProcInfo *proc = &g_processes[idx];
+    int fresh = !proc->epochSlot;
+    if (fresh) {
+      proc->epochSlot = g_epochFreeCount ? g_epochFree[--g_epochFreeCount] + 1
+                                         : ++g_epochSlotCount;
+    }
+    size_t slot = proc->epochSlot - 1;
+    EpochChunk *chunk = epoch_chunk_own(e, slot / EPOCH_CHUNK, owned);
+    query_task_pack(proc, &chunk->tasks[slot % EPOCH_CHUNK]);
+    chunk->count += fresh;
+  }
+  g_epochTouchedCount = 0;
+
+  e->chunkCount = (g_epochSlotCount + EPOCH_CHUNK - 1) / EPOCH_CHUNK;
+  for (size_t c = 0; c < e->chunkCount; c++)
+    e->chunks[c]->refs++;
+  free(owned);
+
+  ssize_t host = pid_index_find(1);
+  if (host >= 0 && !g_processes[host].isThread &&
+      g_processes[host].epochSlot) {
+    size_t slot = g_processes[host].epochSlot - 1;
+    e->host = e->chunks[slot / EPOCH_CHUNK]->tasks[slot % EPOCH_CHUNK];
+    e->hasHost = 1;
+  }
+  return e;
+}
+
+/* Free every retired Epoch that no reader can still hold */
+static void epoch_reclaim(void) {
+  unsigned long oldest = 0;
+  for (size_t r = 0; r < QUERY_SERVER_THREADS; r++) {
+    unsigned long pin = __atomic_load_n(&g_epochPins[r], __ATOMIC_SEQ_CST);
+    if (pin && (!oldest || pin < oldest))
+      oldest = pin;
+  }
+  Epoch **link = &g_epochRetired;
+  while (*link) {
+    Epoch *e = *link;
+    if (!oldest || oldest >= e->retiredAt) {
+      *link = e->nextRetired;
+      epoch_free(e);
+    } else {
+      link = &e->nextRetired;
+    }
+  }
+}
+
+/**
+ * epoch_publish - Make the current g_processes the Epoch new queries see
+ *
+ * Called by the updater at the end of each tick, once the table is
+ * consistent again.
+ */
+static void epoch_publish(void) {
+  Epoch *next = epoch_build(g_epoch);
+  Epoch *old = g_epoch;
+  __atomic_store_n(&g_epoch, next, __ATOMIC_SEQ_CST);
+  if (old) {
+    old->retiredAt = __atomic_add_fetch(&g_epochClock, 1, __ATOMIC_SEQ_CST);
+    old->nextRetired = g_epochRetired;
+    g_epochRetired = old;
+  }
+  epoch_reclaim();
+}
+
+/* Pin the current Epoch for reader @slot until epoch_unpin() */
+static const Epoch *epoch_pin(size_t slot) {
+  __atomic_store_n(&g_epochPins[slot],
+                   __atomic_load_n(&g_epochClock, __ATOMIC_SEQ_CST),
+                   __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&g_epoch, __ATOMIC_SEQ_CST);
+}
+
+static void epoch_unpin(size_t slot) {
+  __atomic_store_n(&g_epochPins[slot], 0, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * Run @q over every task of @e and print the result to @fp; fails without
+ * printing anything if "host" cannot be resolved, see query_host_check()
+ */
+static int query_epoch(const Query *q, const Epoch *e, FILE *fp, char *err,
+                       size_t errLen) {
+  QueryRun run;
+  memset(&run, 0, sizeof(run));
+  run.q = q;
+  run.host = e->hasHost ? &e->host : NULL;
+  if (query_host_check(q->conds, q->condCount, run.host, err, errLen) != 0)
+    return -1;
+  for (size_t c = 0; c < e->chunkCount; c++) {
+    const EpochChunk *chunk = e->chunks[c];
+    for (size_t i = 0, seen = 0; seen < chunk->count; i++) {
+      if (!chunk->tasks[i].pid)
+        continue; /* free slot */
+      query_add(&run, &chunk->tasks[i]);
+      seen++;
+    }
+  }
+  query_finish(&run, fp);
+  return 0;
+}
+
+/**
+ * run_query - Answer --query from a snapshot of the scan
+ *
+ * Return: 0 on success, 1 if the query compares with "host" and PID 1's
+ * namespaces could not be read.
+ */
+static int run_query(void) {
+  char err[128];
+  Epoch *e = epoch_build(NULL);
+  int rc = query_epoch(&g_queryPlan, e, stdout, err, sizeof(err));
+  epoch_free(e);
+  if (rc != 0) {
+    fprintf(stderr, "--query: %s\n", err);
+    return 1;
+  }
+  return 0;
+}
+
+static const char *g_querySocketPath = NULL; /* --query-socket=PATH */
+static int g_queryListenFd = -1;
+static int g_queryEpollFd = -1;           /* listener, stop pipe, clients */
+static int g_queryStopPipe[2] = {-1, -1}; /* closed to stop the readers */
+static pthread_t g_queryThreads[QUERY_SERVER_THREADS];
+static size_t g_queryThreadCount = 0;
+
+/**
+ * struct QueryClient - A connection to --query-socket
+ * @fd:   The socket, non-blocking
+ * @len:  Bytes of an unfinished line in @buf
+ * @prev: Doubly linked through g_queryClients
+ *
+ * Registered with EPOLLONESHOT, so exactly one reader handles a client
+ * at a time and no client ties up a reader while it is idle.
+ */
+typedef struct QueryClient {
+  int fd;
+  size_t len;
+  char buf[1024];
+  struct QueryClient *prev;
+  struct QueryClient *next;
+} QueryClient;
+
+static QueryClient *g_queryClients = NULL; /* for closing them at exit */
+static pthread_mutex_t g_queryClientsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Give up on a client that does not take its answer for this long */
+#define QUERY_SEND_TIMEOUT_MS 10000
+
+/* Write all of @data to @fd; a client that went away is not an error */
+static int query_send_all(int fd, const char *data, size_t len) {
+  while (len) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      if (errno == EAGAIN && poll(&pfd, 1, QUERY_SEND_TIMEOUT_MS) <= 0)
+        return -1;
+      continue;
+    }
+    if (n <= 0)
+      return -1;
+    data += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+/**
+ * query_serve_line - Answer one query line of a --query-socket client
+ * @slot: The reader's pin slot
+ *
+ * The result is formatted into memory while the Epoch is pinned and sent
+ * after unpinning, so a slow client never holds back reclamation.
+ */
+static int query_serve_line(int fd, size_t slot, const char *line) {
+  char *out = NULL;
+  size_t outLen = 0;
+  FILE *fp = open_memstream(&out, &outLen);
+  if (!fp)
+    return -1;
+
+  Query q;
+  char err[128];
+  if (query_compile(line, &q, err, sizeof(err)) != 0) {
+    fprintf(fp, "error: %s\n", err);
+  } else {
+    const Epoch *e = epoch_pin(slot);
+    if (e) {
+      fprintf(fp, "# tick %lu, %zu tasks\n", e->tick, e->taskCount);
+      if (query_epoch(&q, e, fp, err, sizeof(err)) != 0)
+        fprintf(fp, "error: %s\n", err);
+    } else {
+      fputs("error: no snapshot yet\n", fp);
+    }
+    epoch_unpin(slot);
+  }
+  fputc('\n', fp); /* an empty line ends each answer */
+  fclose(fp);
+
+  int rc = query_send_all(fd, out, outLen);
+  free(out);
+  return rc;
+}
+
+static void query_client_close(QueryClient *c) {
+  pthread_mutex_lock(&g_queryClientsLock);
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    g_queryClients = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  pthread_mutex_unlock(&g_queryClientsLock);
+  close(c->fd); /* also drops it from the epoll set */
+  free(c);
+}
+
+static void query_client_accept(void) {
+  int fd = accept4(g_queryListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0)
+    return; /* another reader took it */
+  QueryClient *c = calloc(1, sizeof(*c));
+  if (!c) {
+    close(fd);
+    return;
+  }
+  c->fd = fd;
+  pthread_mutex_lock(&g_queryClientsLock);
+  c->next = g_queryClients;
+  if (g_queryClients)
+    g_queryClients->prev = c;
+  g_queryClients = c;
+  pthread_mutex_unlock(&g_queryClientsLock);
+
+  struct epoll_event ev = {EPOLLIN | EPOLLRDHUP | EPOLLONESHOT, {.ptr = c}};
+  if (epoll_ctl(g_queryEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    query_client_close(c);
+}
+
+/**
+ * query_client_read - Answer every complete line @c has sent so far
+ *
+ * Return: 0 to keep the client, -1 once it is gone or misbehaved.
+ */
+static int query_client_read(QueryClient *c, size_t slot) {
+  for (;;) {
+    ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && errno == EAGAIN)
+      return 0;
+    if (n <= 0)
+      return -1;
+    c->len += (size_t)n;
+
+    char *nl;
+    while ((nl = memchr(c->buf, '\n', c->len)) != NULL) {
+      *nl = '\0';
+      if (nl > c->buf && nl[-1] == '\r')
+        nl[-1] = '\0';
+      if (c->buf[0] && query_serve_line(c->fd, slot, c->buf) != 0)
+        return -1;
+      c->len -= (size_t)(nl + 1 - c->buf);
+      memmove(c->buf, nl + 1, c->len);
+    }
+    if (c->len == sizeof(c->buf) - 1)
+      return -1; /* a line longer than any query */
+  }
+}
+
+/**
+ * query_server_worker - One reader thread of --query-socket
+ *
+ * Readers accept connections and answer queries themselves, so the
+ * updater is not involved in serving them at all. Closing the write end
+ * of g_queryStopPipe wakes every reader up for good.
+ */
+static void *query_server_worker(void *arg) {
+  size_t slot = (size_t)arg;
+  for (;;) {
+    struct epoll_event ev;
+    int n = epoll_wait(g_queryEpollFd, &ev, 1, -1);
+    if (n < 0 && errno != EINTR)
+      return NULL;
+    if (n <= 0)
+      continue;
+    if (ev.data.ptr == &g_queryStopPipe)
+      return NULL;
+    if (ev.data.ptr == &g_queryListenFd) {
+      query_client_accept();
+      continue;
+    }
+
+    QueryClient *c = ev.data.ptr;
+    if (query_client_read(c, slot) != 0) {
+      query_client_close(c);
+      continue;
+    }
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    if (epoll_ctl(g_queryEpollFd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+      query_client_close(c);
+  }
+}
+
+/**
+ * query_server_open - Listen on g_querySocketPath and start the readers
+ */
+static void query_server_open(void) {
+  if (!g_querySocketPath)
+    return;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(g_querySocketPath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", g_querySocketPath);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, g_querySocketPath);
+
+  g_queryListenFd =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  g_queryEpollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (g_queryListenFd < 0 || g_queryEpollFd < 0 ||
+      pipe2(g_queryStopPipe, O_CLOEXEC) < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  unlink(g_querySocketPath);
+  if (bind(g_queryListenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(g_queryListenFd, 64) < 0) {
+    perror(g_querySocketPath);
+    exit(EXIT_FAILURE);
+  }
+  struct epoll_event listenEv = {EPOLLIN, {.ptr = &g_queryListenFd}};
+  struct epoll_event stopEv = {EPOLLIN, {.ptr = &g_queryStopPipe}};
+  if (epoll_ctl(g_queryEpollFd, EPOLL_CTL_ADD, g_queryListenFd,
+                &listenEv) < 0 ||
+      epoll_ctl(g_queryEpollFd, EPOLL_CTL_ADD, g_queryStopPipe[0],
+                &stopEv) < 0) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+
+  /* SIGINT and SIGTERM must reach the updater, not a reader */
+  sigset_t block, old;
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  for (size_t r = 0; r < QUERY_SERVER_THREADS; r++) {
+    if (pthread_create(&g_queryThreads[g_queryThreadCount], NULL,
+                       query_server_worker, (void *)r) != 0)
+      break;
+    g_queryThreadCount++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (!g_queryThreadCount) {
+    fprintf(stderr, "Could not start any query thread\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * query_server_close - Stop the readers, drop their clients and free every
+ *                      Epoch
+ */
+static void query_server_close(void) {
+  if (g_queryListenFd >= 0) {
+    close(g_queryStopPipe[1]); /* level-triggered: wakes every reader */
+    for (size_t r = 0; r < g_queryThreadCount; r++)
+      pthread_join(g_queryThreads[r], NULL);
+    while (g_queryClients)
+      query_client_close(g_queryClients);
+    close(g_queryStopPipe[0]);
+    close(g_queryEpollFd);
+    close(g_queryListenFd);
+    unlink(g_querySocketPath);
+    g_queryListenFd = -1;
+  }
+  if (g_epoch) {
+    epoch_free(g_epoch);
+    g_epoch = NULL;
+  }
+  epoch_reclaim();
+  free(g_epochFree);
+  free(g_epochReleased);
+  free(g_epochTouched);
+  g_epochFree = g_epochReleased = NULL;
+  g_epochTouched = NULL;
+  g_epochFreeCount = g_epochReleasedCount = g_epochTouchedCount = 0;
+  g_epochFreeCap = g_epochReleasedCap = g_epochTouchedCap = 0;
+}
+
+/* ---- namespace lifecycle events ---- */
+
+#define MAX_SUBSCRIBERS 64
+
+/**
+ * struct Subscriber - A client connected to the event socket
+ * @fd:       Connected socket, -1 if the slot is free
+ * @typeMask: Namespace types (bits over g_nsTypes) the client wants
+ * @inbuf:    Partially received subscription line
+ * @inlen:    Bytes in @inbuf
+ * @conds:    Standing query, see standing_register()
+ * @condCount: Conditions in @conds, 0 if there is no standing query
+ */
+typedef struct {
+  int fd;
+  unsigned int typeMask;
+  char inbuf[256];
+  size_t inlen;
+  QueryCond conds[QUERY_MAX_TERMS];
+  size_t condCount;
+} Subscriber;
+
+static int g_eventStdout = 0;             /* --events=- */
+static const char *g_eventSocketPath = NULL; /* --events=unix:PATH */
+static unsigned int g_eventTypeMask = NS_TYPE_MASK_ALL; /* --event-types */
+static int g_eventListenFd = -1;
+static Subscriber g_subs[MAX_SUBSCRIBERS];
+static Sink g_eventOut = {NULL, "stdout", STDOUT_FILENO, NULL, 0, 0, 0, NULL,
+                          0, NULL, 0, 0, 0};
+static Sink g_eventLine = {NULL, "event", -1, NULL, 0, 0, 0, NULL,
+                           0, NULL, 0, 0, 0};
+
+/* Standing queries: one bit per g_subs slot, as in ProcInfo.queryMask */
+static unsigned long long g_standingMask = 0;
+static pid_t *g_standingDirty = NULL; /* tasks to re-check this tick */
+static size_t g_standingDirtyCount = 0;
+static size_t g_standingDirtyCap = 0;
+
+static void subscriber_close(Subscriber *sub) {
+  close(sub->fd);
+  sub->fd = -1;
+  sub->condCount = 0;
+  g_standingMask &= ~(1ULL << (sub - g_subs));
+}
+
+/**
+ * events_open - Set up the event socket, if one was requested
+ */
+static void events_open(void) {
+  for (size_t i = 0; i < MAX_SUBSCRIBERS; i++)
+    g_subs[i].fd = -1;
+  if (!g_eventSocketPath)
+    return;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(g_eventSocketPath) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", g_eventSocketPath);
+    exit(EXIT_FAILURE);
+  }
+  strcpy(addr.sun_path, g_eventSocketPath);
+
+  g_eventListenFd =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (g_eventListenFd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  unlink(g_eventSocketPath);
+  if (bind(g_eventListenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(g_eventListenFd, 16) < 0) {
+    perror(g_eventSocketPath);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * events_close - Disconnect all subscribers and remove the socket
+ */
+static void events_close(void) {
+  for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (g_subs[i].fd >= 0)
+      subscriber_close(&g_subs[i]);
+  }
+  if (g_eventListenFd >= 0) {
+    close(g_eventListenFd);
+    unlink(g_eventSocketPath);
+    g_eventListenFd = -1;
+  }
+  free(g_eventOut.buf);
+  free(g_eventLine.buf);
+  free(g_standingDirty);
+}
+
+/**
+ * subscriber_send - Deliver one complete line to @sub
+ *
+ * Sends never block the watch loop; a client that cannot keep up (or has
+ * gone away) is disconnected rather than buffered for.
+ */
+static void subscriber_send(Subscriber *sub, const char *data, size_t len) {
+  ssize_t n = send(sub->fd, data, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (n < 0 || (size_t)n != len)
+    subscriber_close(sub);
+}
+
+/* ---- standing queries pushed to event subscribers ---- */
+
+/*
+ * A socket client may register "where COND [and COND]..." (the --query
+ * syntax) once; the daemon then pushes changes to the set of tasks that
+ * match instead of being polled. Membership is one bit per subscriber in
+ * ProcInfo.queryMask. Each tick, only the tasks that appeared, exec'd,
+ * were reparented or changed namespaces are re-checked, against every
+ * standing query; tasks that exit leave the sets of the queries they
+ * matched without any evaluation.
+ */
+
+/**
+ * standing_emit - Push one membership change of @proc to @sub
+ * @event: "enter", "leave" (no longer matches) or "exit"
+ */
+static void standing_emit(Subscriber *sub, const char *event,
+                          const ProcInfo *proc) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  Sink *line = &g_eventLine;
+  line->len = 0;
+  sink_printf(line,
+              "{\"time\":%lld.%03ld,\"event\":\"%s\",\"pid\":%d,"
+              "\"ppid\":%d,\"thread\":%s,\"comm\":",
+              (long long)now.tv_sec, now.tv_nsec / 1000000, event, proc->pid,
+              proc->ppid, proc->isThread ? "true" : "false");
+  sink_put_json_string(line, proc->comm);
+  sink_puts(line, "}\n");
+  subscriber_send(sub, line->buf, line->len);
+}
+
+/* Queue @pid to be re-checked against the standing queries */
+static void standing_touch(pid_t pid) {
+  if (!g_standingMask)
+    return;
+  if (g_standingDirtyCount == g_standingDirtyCap) {
+    g_standingDirtyCap = g_standingDirtyCap ? g_standingDirtyCap * 2 : 64;
+    pid_t *tmp =
+        realloc(g_standingDirty, g_standingDirtyCap * sizeof(*tmp));
+    if (!tmp) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    g_standingDirty = tmp;
+  }
+  g_standingDirty[g_standingDirtyCount++] = pid;
+}
+
+/* @proc is going away: it leaves every set it was in */
+static void standing_leave(const ProcInfo *proc) {
+  unsigned long long mask = proc->queryMask & g_standingMask;
+  for (size_t s = 0; mask; s++, mask >>= 1) {
+    if ((mask & 1) && g_subs[s].fd >= 0)
+      standing_emit(&g_subs[s], "exit", proc);
+  }
+}
+
+/* PID 1, which "host" in a query refers to, packed into @buf */
+static const QueryTask *standing_host(QueryTask *buf) {
+  ssize_t idx = pid_index_find(1);
+  if (idx < 0)
+    return NULL;
+  query_task_pack(&g_processes[idx], buf);
+  return buf;
+}
+
+static int standing_matches(const Subscriber *sub, const ProcInfo *proc,
+                            const QueryTask *host) {
+  QueryTask t;
+  query_task_pack(proc, &t);
+  return query_matches(sub->conds, sub->condCount, &t, host);
+}
+
+/**
+ * standing_flush - Re-check this tick's touched tasks against every query
+ *
+ * Runs once the PID index is current again.
+ */
+static void standing_flush(void) {
+  QueryTask hostBuf;
+  const QueryTask *host = standing_host(&hostBuf);
+  for (size_t i = 0; i < g_standingDirtyCount; i++) {
+    ssize_t idx = pid_index_find(g_standingDirty[i]);
+    if (idx < 0)
+      continue;
+    ProcInfo *proc = &g_processes[idx];
+    for (size_t s = 0; s < MAX_SUBSCRIBERS; s++) {
+      Subscriber *sub = &g_subs[s];
+      unsigned long long bit = 1ULL << s;
+      if (!(g_standingMask & bit))
+        continue;
+      int match = standing_matches(sub, proc, host);
+      if (match == !!(proc->queryMask & bit))
+        continue;
+      proc->queryMask ^= bit;
+      standing_emit(sub, match ? "enter" : "leave", proc);
+    }
+  }
+  g_standingDirtyCount = 0;
+}
+
+/**
+ * standing_register - Install @sub's standing query from "where ..."
+ * @clause: The text after "where", modified by parsing
+ *
+ * Acknowledged with a "query" event, followed by an "enter" for every
+ * task matching now and a "synced" event with their count; from then on
+ * only changes are pushed.
+ */
+static void standing_register(Subscriber *sub, char *clause) {
+  QueryCond conds[QUERY_MAX_TERMS];
+  ssize_t n = query_parse_where(clause, conds);
+  char reply[128];
+  if (n < 0) {
+    int len = snprintf(reply, sizeof(reply),
+                       "{\"event\":\"error\",\"message\":\"bad query\"}\n");
+    subscriber_send(sub, reply, (size_t)len);
+    return;
+  }
+  /*
+   * Only changes to a task's identity, parentage, comm or namespaces are
+   * re-checked each tick, so fields that drift without any of those
+   * changing cannot be kept current.
+   */
+  for (ssize_t i = 0; i < n; i++) {
+    int f = conds[i].field;
+    if (f == QUERY_THREADS || f == QUERY_RSS || f == QUERY_CPU) {
+      int len = snprintf(reply, sizeof(reply),
+                         "{\"event\":\"error\",\"message\":\"%s is not "
+                         "supported in standing queries\"}\n",
+                         g_queryFieldNames[f]);
+      subscriber_send(sub, reply, (size_t)len);
+      return;
+    }
+  }
+  QueryTask hostBuf;
+  const QueryTask *host = standing_host(&hostBuf);
+  char err[96];
+  if (query_host_check(conds, (size_t)n, host, err, sizeof(err)) != 0) {
+    int len = snprintf(reply, sizeof(reply),
+                       "{\"event\":\"error\",\"message\":\"%s\"}\n", err);
+    subscriber_send(sub, reply, (size_t)len);
+    return;
+  }
+  memcpy(sub->conds, conds, (size_t)n * sizeof(*conds));
+  sub->condCount = (size_t)n;
+  unsigned long long bit = 1ULL << (sub - g_subs);
+  g_standingMask |= bit;
+  int len = snprintf(reply, sizeof(reply),
+                     "{\"event\":\"query\",\"conditions\":%zd}\n", n);
+  subscriber_send(sub, reply, (size_t)len);
+
+  /* The slot may have served an earlier client, so set every bit afresh */
+  size_t members = 0;
+  for (size_t i = 0; i < g_procCount && sub->fd >= 0; i++) {
+    ProcInfo *proc = &g_processes[i];
+    proc->queryMask &= ~bit;
+    if (standing_matches(sub, proc, host)) {
+      proc->queryMask |= bit;
+      members++;
+      standing_emit(sub, "enter", proc);
+    }
+  }
+  if (sub->fd >= 0) {
+    len = snprintf(reply, sizeof(reply),
+                   "{\"event\":\"synced\",\"members\":%zu}\n", members);
+    subscriber_send(sub, reply, (size_t)len);
+  }
+}
+
+/**
+ * subscriber_handle_line - Apply a subscription line sent by a client
+ *
+ * A line lists the namespace types the client wants events for, e.g.
+ * "net,user", or "none"; it is acknowledged with a "subscribed" event. A
+ * line starting with "where" registers a standing query instead.
+ */
+static void subscriber_handle_line(Subscriber *sub, char *line) {
+  unsigned int mask = 0;
+  char reply[128];
+  if (strncmp(line, "where", 5) == 0 && (!line[5] || line[5] == ' ')) {
+    standing_register(sub, line + 5);
+    return;
+  }
+  if (strcmp(line, "none") != 0 && parse_ns_type_mask(line, &mask) != 0) {
+    int len = snprintf(reply, sizeof(reply),
+                       "{\"event\":\"error\",\"message\":\"unknown type\"}\n");
+    subscriber_send(sub, reply, (size_t)len);
+    return;
+  }
+  sub->typeMask = mask;
+  int len = snprintf(reply, sizeof(reply),
+                     "{\"event\":\"subscribed\",\"mask\":%u}\n", mask);
+  subscriber_send(sub, reply, (size_t)len);
+}
+
+/**
+ * events_poll - Accept new subscribers and read subscription lines
+ * @pfds:  Descriptors returned by poll(), listen socket first
+ * @nfds:  Number of entries in @pfds
+ */
+static void events_poll(const struct pollfd *pfds, size_t nfds) {
+  for (size_t p = 0; p < nfds; p++) {
+    if (!pfds[p].revents)
+      continue;
+
+    if (pfds[p].fd == g_eventListenFd) {
+      int fd;
+      while ((fd = accept4(g_eventListenFd, NULL, NULL,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        Subscriber *sub = NULL;
+        for (size_t i = 0; i < MAX_SUBSCRIBERS && !sub; i++) {
+          if (g_subs[i].fd < 0)
+            sub = &g_subs[i];
         }
+        if (!sub) {
+          close(fd);
+          continue;
+        }
+        sub->fd = fd;
+        sub->typeMask = g_eventTypeMask;
+        sub->inlen = 0;
+      }
+      continue;
+    }
+
+    for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+      Subscriber *sub = &g_subs[i];
+      if (sub->fd != pfds[p].fd)
+        continue;
+      ssize_t n = recv(sub->fd, sub->inbuf + sub->inlen,
+                       sizeof(sub->inbuf) - 1 - sub->inlen, 0);
+      if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+          subscriber_close(sub);
+        break;
+      }
+      sub->inlen += (size_t)n;
+      sub->inbuf[sub->inlen] = '\0';
+
+      char *nl;
+      while (sub->fd >= 0 && (nl = strchr(sub->inbuf, '\n')) != NULL) {
+        *nl = '\0';
+        subscriber_handle_line(sub, sub->inbuf);
+        size_t rest = sub->inlen - (size_t)(nl + 1 - sub->inbuf);
+        memmove(sub->inbuf, nl + 1, rest + 1);
+        sub->inlen = rest;
+      }
+      if (sub->fd >= 0 && sub->inlen == sizeof(sub->inbuf) - 1)
+        subscriber_close(sub); /* line too long */
+      break;
+    }
+  }
+}
+
+/**
+ * events_emit - Format one namespace event and hand it to every consumer
+ */
+static void events_emit(const char *event, const NsRecord *rec) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  Sink *line = &g_eventLine;
+  line->len = 0;
+  sink_printf(line,
+              "{\"time\":%lld.%03ld,\"event\":\"%s\",\"type\":\"%s\","
+              "\"ino\":%llu,\"members\":%zu,\"pid\":%d,\"ppid\":%d,"
+              "\"comm\":",
+              (long long)now.tv_sec, now.tv_nsec / 1000000, event,
+              g_nsTypes[rec->typeIdx], rec->ino, rec->members, rec->pid,
+              rec->ppid);
+  sink_put_json_string(line, rec->comm);
+  sink_puts(line, "}\n");
+
+  unsigned int bit = 1u << rec->typeIdx;
+  if (g_eventStdout && (g_eventTypeMask & bit))
+    sink_write(&g_eventOut, line->buf, line->len);
+  for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+    if (g_subs[i].fd >= 0 && (g_subs[i].typeMask & bit))
+      subscriber_send(&g_subs[i], line->buf, line->len);
+  }
+}
+
+/**
+ * ns_events_flush - Turn this tick's member count changes into events
+ *
+ * Namespaces that went from no members to some are reported as created,
+ * those that lost their last member as destroyed (and forgotten). The
+ * first tick only establishes the baseline and reports nothing.
+ */
+static void ns_events_flush(void) {
+  for (size_t i = 0; i < g_nsDirtyCount; i++) {
+    NsRecord *rec = ns_table_find(g_nsDirty[i]);
+    if (!rec)
+      continue;
+    if (g_tick > 1 && rec->prevMembers == 0 && rec->members > 0) {
+      events_emit("ns_created", rec);
+      if (g_creatorTracking)
+        creators_record(rec->ppid, rec->typeIdx);
+    } else if (g_tick > 1 && rec->prevMembers > 0 && rec->members == 0) {
+      events_emit("ns_destroyed", rec);
+    }
+    if (rec->members == 0)
+      ns_table_delete(rec->ino);
+  }
+  g_nsDirtyCount = 0;
+  if (g_eventOut.len)
+    sink_flush(&g_eventOut);
+}
+
+/**
+ * task_dir_path - Build the /proc directory of an entry in g_processes
+ * @proc: The task
+ * @buf:  Output buffer of PATH_MAX bytes
+ *
+ * Threads hang off their thread group leader, which read_stat_file stored
+ * in @proc->ppid.
+ */
+static void task_dir_path(const ProcInfo *proc, char *buf) {
+  if (proc->isThread)
+    snprintf(buf, PATH_MAX, "/proc/%d/task/%d", proc->ppid, proc->pid);
+  else
+    snprintf(buf, PATH_MAX, "/proc/%d", proc->pid);
+}
+
+/**
+ * namespaces_equal - Compare the namespace sets of two entries
+ */
+static int namespaces_equal(const ProcInfo *a, const ProcInfo *b) {
+  if (a->nsCount != b->nsCount || a->nsReadable != b->nsReadable)
+    return 0;
+  for (size_t i = 0; i < a->nsCount; i++) {
+    if (a->namespaces[i].ino != b->namespaces[i].ino ||
+        a->namespaces[i].typeIdx != b->namespaces[i].typeIdx)
+      return 0;
+  }
+  return 1;
+}
+
+/**
+ * struct FdCacheEntry - Open file descriptors kept for one task
+ * @pid:      The task, 0 if the entry is free
+ * @dirFd:    O_PATH descriptor of /proc/<pid> (or /proc/<tgid>/task/<tid>)
+ * @statFd:   The task's stat file, re-read with pread() at offset 0
+ * @next:     Next free entry (1-based, 0 = none)
+ *
+ * Both descriptors pin the task's struct pid, not its number: once the task
+ * has exited, reads fail with ESRCH even if the PID was reused meanwhile.
+ */
+typedef struct {
+  pid_t pid;
+  int dirFd;
+  int statFd;
+  size_t next;
+} FdCacheEntry;
+
+static FdCacheEntry *g_fdCache = NULL; /* slots, addressed 1-based */
+static size_t g_fdCacheAlloc = 0;      /* allocated slots */
+static size_t g_fdCacheUsed = 0;       /* slots holding open fds */
+static size_t g_fdCacheLimit = 0;      /* effective bound on used slots */
+static size_t g_fdCacheMax = 16384;    /* --fd-cache, 0 disables */
+static size_t g_fdCacheFree = 0;       /* free list through @next */
+
+/* Descriptors left for sinks, sockets and directory scans */
+#define FD_CACHE_RESERVE 64
+
+/**
+ * fd_cache_init - Size the cache from --fd-cache and RLIMIT_NOFILE
+ *
+ * Each entry holds two descriptors, and FD_CACHE_RESERVE are kept free for
+ * everything else.
+ */
+static void fd_cache_init(void) {
+  struct rlimit rl;
+  size_t avail = g_fdCacheMax * 2 + FD_CACHE_RESERVE;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+      rl.rlim_cur < avail)
+    avail = (size_t)rl.rlim_cur;
+  g_fdCacheLimit = avail > FD_CACHE_RESERVE ? (avail - FD_CACHE_RESERVE) / 2
+                                            : 0;
+}
+
+/**
+ * fd_cache_release - Close the descriptors in @slot and free it
+ */
+static void fd_cache_release(size_t slot) {
+  FdCacheEntry *e = &g_fdCache[slot - 1];
+  close(e->statFd);
+  close(e->dirFd);
+  e->pid = 0;
+  e->next = g_fdCacheFree;
+  g_fdCacheFree = slot;
+  g_fdCacheUsed--;
+}
+
+/**
+ * fd_cache_evict - Drop the cached descriptors of @proc, if any
+ */
+static void fd_cache_evict(ProcInfo *proc) {
+  if (proc->fdSlot) {
+    fd_cache_release(proc->fdSlot);
+    proc->fdSlot = 0;
+  }
+}
+
+/**
+ * fd_cache_open - Open and cache the descriptors of one task
+ * @dirPath: The task directory, e.g. "/proc/1234/task/5678"
+ * @pid:     The task's PID or TID
+ *
+ * Entries are only ever freed for tasks that are gone, by fd_cache_evict()
+ * when a read fails or the task is dropped from the table. A scan is no
+ * time to recycle anything else: an entry not yet read this tick most
+ * likely belongs to a live task further down the listing. When the cache
+ * is full the task thus stays uncached and is read by path; it gets an
+ * entry on a later tick, once exits have made room. Running into
+ * EMFILE/ENFILE lowers the limit to what is in use, so later ticks stop
+ * trying.
+ *
+ * Return: the 1-based slot, or 0 if the task is not cached.
+ */
+static size_t fd_cache_open(const char *dirPath, pid_t pid) {
+  if (g_fdCacheUsed >= g_fdCacheLimit)
+    return 0;
+
+  int dirFd = open(dirPath, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  int statFd = dirFd >= 0 ? openat(dirFd, "stat", O_RDONLY | O_CLOEXEC) : -1;
+  if (statFd < 0) {
+    int err = errno;
+    if (dirFd >= 0)
+      close(dirFd);
+    if (err == EMFILE || err == ENFILE) {
+      if (g_fdCacheLimit > g_fdCacheUsed)
+        fprintf(stderr, "Note: descriptor limit reached, caching %zu tasks\n",
+                g_fdCacheUsed);
+      g_fdCacheLimit = g_fdCacheUsed;
+    }
+    return 0;
+  }
+
+  size_t slot = g_fdCacheFree;
+  if (!slot) {
+    size_t newAlloc = g_fdCacheAlloc ? g_fdCacheAlloc * 2 : 256;
+    FdCacheEntry *tmp = realloc(g_fdCache, newAlloc * sizeof(*tmp));
+    if (!tmp) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    g_fdCache = tmp;
+    /* Thread the new slots onto the free list, lowest first */
+    for (size_t i = newAlloc; i > g_fdCacheAlloc; i--) {
+      g_fdCache[i - 1].pid = 0;
+      g_fdCache[i - 1].next = g_fdCacheFree;
+      g_fdCacheFree = i;
+    }
+    g_fdCacheAlloc = newAlloc;
+    slot = g_fdCacheFree;
+  }
+  g_fdCacheFree = g_fdCache[slot - 1].next;
+
+  FdCacheEntry *e = &g_fdCache[slot - 1];
+  e->pid = pid;
+  e->dirFd = dirFd;
+  e->statFd = statFd;
+  g_fdCacheUsed++;
+  return slot;
+}
+
+/**
+ * fd_cache_read_stat - pread() the cached stat file of @proc
+ * @proc: A task with a cached descriptor
+ * @line: Output buffer
+ * @len:  Size of @line
+ *
+ * Return: 0 on success. On failure (ESRCH once the task has exited) the
+ * entry is evicted and -1 returned.
+ */
+static int fd_cache_read_stat(ProcInfo *proc, char *line, size_t len) {
+  ssize_t n = pread(g_fdCache[proc->fdSlot - 1].statFd, line, len - 1, 0);
+  if (n <= 0) {
+    fd_cache_evict(proc);
+    return -1;
+  }
+  line[n] = '\0';
+  return 0;
+}
+
+/**
+ * fd_cache_destroy - Close every cached descriptor
+ */
+static void fd_cache_destroy(void) {
+  for (size_t slot = 1; slot <= g_fdCacheAlloc; slot++) {
+    if (g_fdCache[slot - 1].pid)
+      fd_cache_release(slot);
+  }
+  free(g_fdCache);
+  g_fdCache = NULL;
+  g_fdCacheAlloc = g_fdCacheFree = 0;
+}
+
+/* ---- per-namespace CPU accounting (cpu output) ---- */
+
+/**
+ * struct CpuExit - Last sample of a process that vanished this tick
+ * @pid:    The process
+ * @ppid:   Its parent, whose cutime/cstime receive its final CPU time
+ * @last:   cpuTime + childCpuTime when it was last listed
+ * @nested: @last of its descendants that vanished in the same tick, which
+ *          it reaped into its own child time before being reaped itself
+ * @ns:     Its namespace inode per g_nsTypes index (0 if unknown)
+ */
+typedef struct {
+  pid_t pid;
+  pid_t ppid;
+  unsigned long long last;
+  unsigned long long nested;
+  unsigned long long ns[NS_TYPE_COUNT];
+} CpuExit;
+
+static CpuExit *g_cpuExits = NULL;
+static size_t g_cpuExitCount = 0;
+static size_t g_cpuExitCap = 0;
+static struct timespec g_cpuClock; /* when the last listing started */
+
+/**
+ * cpu_begin_tick - Time the new listing and drop the last tick's shares
+ */
+static void cpu_begin_tick(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (g_tick > 1)
+    g_cpuInterval = (double)(now.tv_sec - g_cpuClock.tv_sec) +
+                    (double)(now.tv_nsec - g_cpuClock.tv_nsec) / 1e9;
+  g_cpuClock = now;
+  g_cpuExitedCount = 0;
+  g_cpuExitedTicks = 0;
+}
+
+/**
+ * cpu_sample - Update @proc's CPU counters from a fresh stat read
+ * @proc:  Entry to update
+ * @fresh: The new sample, or NULL if @proc itself was just read
+ *
+ * A task that is new since the last listing was born during the interval,
+ * so everything it used counts, except on the very first tick.
+ */
+static void cpu_sample(ProcInfo *proc, const ProcInfo *fresh) {
+  if (!fresh) {
+    proc->cpuDelta = g_tick > 1 ? proc->cpuTime : 0;
+    proc->childCpuDelta = g_tick > 1 ? proc->childCpuTime : 0;
+    return;
+  }
+  proc->cpuDelta =
+      fresh->cpuTime > proc->cpuTime ? fresh->cpuTime - proc->cpuTime : 0;
+  proc->childCpuDelta = fresh->childCpuTime > proc->childCpuTime
+                            ? fresh->childCpuTime - proc->childCpuTime
+                            : 0;
+  proc->cpuTime = fresh->cpuTime;
+  proc->childCpuTime = fresh->childCpuTime;
+}
+
+static void cpu_ns_of(const ProcInfo *proc, unsigned long long *ns) {
+  memset(ns, 0, NS_TYPE_COUNT * sizeof(*ns));
+  for (size_t i = 0; i < proc->nsCount; i++) {
+    int t = proc->namespaces[i].typeIdx;
+    if (t >= 0 && !strstr(g_nsTypes[t], "_for_children"))
+      ns[t] = proc->namespaces[i].ino;
+  }
+}
+
+/**
+ * cpu_charge - Charge @ticks used by a task that is gone to its namespaces
+ */
+static void cpu_charge(const unsigned long long *ns, unsigned long long ticks) {
+  if (!ticks)
+    return;
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (!ns[t])
+      continue;
+    if (g_cpuExitedCount == g_cpuExitedCap) {
+      size_t newCap = g_cpuExitedCap ? g_cpuExitedCap * 2 : 64;
+      CpuShare *tmp = realloc(g_cpuExited, newCap * sizeof(*tmp));
+      if (!tmp) {
+        perror("realloc");
+        exit(EXIT_FAILURE);
+      }
+      g_cpuExited = tmp;
+      g_cpuExitedCap = newCap;
+    }
+    g_cpuExited[g_cpuExitedCount].ino = ns[t];
+    g_cpuExited[g_cpuExitedCount].typeIdx = (int)t;
+    g_cpuExited[g_cpuExitedCount].ticks = ticks;
+    g_cpuExitedCount++;
+  }
+}
+
+/**
+ * cpu_record_exit - Remember a vanished process until its parent is read
+ */
+static void cpu_record_exit(const ProcInfo *proc) {
+  if (!g_cpuAccounting || proc->isThread || g_tick < 2)
+    return;
+  if (g_cpuExitCount == g_cpuExitCap) {
+    size_t newCap = g_cpuExitCap ? g_cpuExitCap * 2 : 64;
+    CpuExit *tmp = realloc(g_cpuExits, newCap * sizeof(*tmp));
+    if (!tmp) {
+      perror("realloc");
+      exit(EXIT_FAILURE);
+    }
+    g_cpuExits = tmp;
+    g_cpuExitCap = newCap;
+  }
+  CpuExit *e = &g_cpuExits[g_cpuExitCount++];
+  e->pid = proc->pid;
+  e->ppid = proc->ppid;
+  e->last = proc->cpuTime + proc->childCpuTime;
+  e->nested = 0;
+  cpu_ns_of(proc, e->ns);
+}
+
+static int cpu_exit_compare_pid(const void *a, const void *b) {
+  const CpuExit *x = a, *y = b;
+  return x->pid < y->pid ? -1 : (x->pid > y->pid);
+}
+
+static int cpu_exit_compare(const void *a, const void *b) {
+  const CpuExit *x = a, *y = b;
+  return x->ppid < y->ppid ? -1 : (x->ppid > y->ppid);
+}
+
+/* The part of cpu_attribute_exits() for the exits recorded this tick */
+static void cpu_attribute_vanished(void) {
+  if (!g_cpuExitCount)
+    return; /* and g_cpuExits may still be NULL */
+  qsort(g_cpuExits, g_cpuExitCount, sizeof(*g_cpuExits),
+        cpu_exit_compare_pid);
+  for (size_t i = 0; i < g_cpuExitCount; i++) {
+    CpuExit key = {.pid = g_cpuExits[i].ppid};
+    CpuExit *up;
+    while ((up = bsearch(&key, g_cpuExits, g_cpuExitCount, sizeof(key),
+                         cpu_exit_compare_pid)) != NULL) {
+      up->nested += g_cpuExits[i].last;
+      key.pid = up->ppid;
+    }
+  }
+  qsort(g_cpuExits, g_cpuExitCount, sizeof(*g_cpuExits), cpu_exit_compare);
+
+  for (size_t i = 0; i < g_cpuExitCount;) {
+    size_t j = i;
+    unsigned long long seen = 0;
+    for (; j < g_cpuExitCount && g_cpuExits[j].ppid == g_cpuExits[i].ppid; j++)
+      seen += g_cpuExits[j].last + g_cpuExits[j].nested;
+
+    ssize_t idx = pid_index_find(g_cpuExits[i].ppid);
+    if (idx >= 0 && !g_processes[idx].isThread) {
+      ProcInfo *parent = &g_processes[idx];
+      unsigned long long unseen = parent->childCpuDelta > seen
+                                      ? parent->childCpuDelta - seen
+                                      : 0;
+      parent->childCpuDelta = 0;
+      g_cpuExitedTicks += unseen;
+      for (size_t k = i; k < j; k++) {
+        unsigned long long share = unseen / (j - i);
+        if (k == i)
+          share += unseen % (j - i);
+        cpu_charge(g_cpuExits[k].ns, share);
+      }
+    }
+    i = j;
+  }
+  g_cpuExitCount = 0;
+}
+
+/* The part of cpu_attribute_exits() for child time no vanished task explains */
+static void cpu_attribute_unseen(void) {
+  for (size_t i = 0; i < g_procCount; i++) {
+    ProcInfo *proc = &g_processes[i];
+    if (proc->isThread || !proc->childCpuDelta)
+      continue;
+    unsigned long long ns[NS_TYPE_COUNT];
+    cpu_ns_of(proc, ns);
+    cpu_charge(ns, proc->childCpuDelta);
+    g_cpuExitedTicks += proc->childCpuDelta;
+    proc->childCpuDelta = 0;
+  }
+}
+
+/**
+ * cpu_attribute_exits - Charge what exited processes used since last seen
+ *
+ * A process's final CPU time is never read, but once reaped it is added to
+ * its parent's cutime/cstime. Whatever the parent's child time grew by,
+ * beyond what its vanished children had already used when last listed, is
+ * split between them. Growth with no vanished child comes from children
+ * that lived and died between two listings and is charged to the parent's
+ * namespaces. When a whole chain vanished, what the innermost tasks had
+ * used is credited to the outermost one, whose parent sees it all at once.
+ */
+static void cpu_attribute_exits(void) {
+  cpu_attribute_vanished();
+  cpu_attribute_unseen();
+}
+
+/**
+ * watch_load_task - Read a task that is not in the table yet
+ * @statPath: The task's stat file
+ * @isThread: 0 = main process, 1 = thread
+ * @tgid:     Thread group leader (equal to the PID for processes)
+ * @pid:      The task's PID or TID
+ * @fresh:    Entry to fill, including namespaces
+ *
+ * The task's directory and stat file are opened into the fd cache first, so
+ * the namespaces are read relative to the pinned directory and later ticks
+ * revalidate it with a single pread().
+ *
+ * Return: 0 on success, -1 if the task is already gone.
+ */
+static int watch_load_task(const char *statPath, int isThread, pid_t tgid,
+                           pid_t pid, ProcInfo *fresh) {
+  char pidPath[PATH_MAX];
+  stat_path_to_dir(statPath, pidPath);
+
+  size_t slot = fd_cache_open(pidPath, pid);
+  if (!slot) {
+    if (read_stat_file(statPath, isThread, fresh) != 0)
+      return -1;
+    read_namespaces(fresh, pidPath);
+    return 0;
+  }
+
+  char line[1024];
+  ssize_t n = pread(g_fdCache[slot - 1].statFd, line, sizeof(line) - 1, 0);
+  if (n <= 0) {
+    fd_cache_release(slot);
+    return -1;
+  }
+  line[n] = '\0';
+  init_from_stat_line(line, isThread, tgid, fresh);
+  read_namespaces_at(fresh, g_fdCache[slot - 1].dirFd, "ns");
+  fresh->fdSlot = slot;
+  return 0;
+}
+
+/**
+ * watch_visit_task - scan_proc visitor for one watch tick
+ * @statPath: The task's stat file
+ * @isThread: 0 = main process, 1 = thread
+ *
+ * Known tasks are only revalidated through their stat file, with a single
+ * pread() when their descriptors are cached: a changed starttime (or ESRCH
+ * on the cached descriptor) means the PID was reused and the entry is
+ * replaced, otherwise ppid, comm, RSS and thread count are refreshed in
+ * place. Only unknown PIDs get their namespaces read.
+ */
+static void watch_visit_task(const char *statPath, int isThread) {
+  pid_t tgid = (pid_t)atoi(statPath + 6); /* skip "/proc/" */
+  pid_t pid = tgid;
+  if (isThread) {
+    const char *slashTask = strstr(statPath, "/task/");
+    if (!slashTask)
+      return;
+    pid = (pid_t)atoi(slashTask + 6);
+  }
+
+  ProcInfo fresh;
+  ssize_t idx = pid_index_find(pid);
+  if (idx >= 0 && g_processes[idx].isThread == isThread) {
+    ProcInfo *known = &g_processes[idx];
+    char line[1024];
+    int ok;
+
+    if (known->fdSlot && fd_cache_read_stat(known, line, sizeof(line)) == 0) {
+      init_from_stat_line(line, isThread, tgid, &fresh);
+      ok = 1;
+    } else {
+      ok = (read_stat_file(statPath, isThread, &fresh) == 0);
+    }
+    if (!ok)
+      return; /* exited between readdir and open */
+
+    if (fresh.starttime == known->starttime) {
+      int touched = known->cpuTime != fresh.cpuTime ||
+                    known->rssPages != fresh.rssPages ||
+                    known->numThreads != fresh.numThreads;
+      cpu_sample(known, &fresh);
+      if (known->ppid != fresh.ppid ||
+          strcmp(known->comm, fresh.comm) != 0) {
+        render_mark_dirty(known->ppid, 0); /* may lose this child */
+        render_mark_dirty(known->pid, 0);
+        known->ppid = fresh.ppid;
+        memcpy(known->comm, fresh.comm, sizeof(known->comm));
+        standing_touch(known->pid);
+        touched = 1;
+        g_tickStats.changed++;
+      }
+      known->rssPages = fresh.rssPages;
+      known->numThreads = fresh.numThreads;
+      if (touched)
+        epoch_touch(known->pid);
+      known->lastSeen = g_tick;
+      if (!known->fdSlot && g_fdCacheUsed < g_fdCacheLimit) {
+        char pidPath[PATH_MAX];
+        stat_path_to_dir(statPath, pidPath);
+        known->fdSlot = fd_cache_open(pidPath, pid);
+      }
+      return;
+    }
+    fd_cache_evict(known);
+  }
+
+  if (watch_load_task(statPath, isThread, tgid, pid, &fresh) != 0)
+    return;
+  fresh.lastSeen = g_tick;
+  cpu_sample(&fresh, NULL);
+
+  if (idx >= 0) {
+    /* PID reuse: the old task is gone, this is a new one */
+    fd_cache_evict(&g_processes[idx]);
+    standing_leave(&g_processes[idx]);
+    epoch_forget(&g_processes[idx]);
+    ns_table_adjust(&g_processes[idx], -1);
+    render_mark_dirty(g_processes[idx].ppid, 0);
+    render_cache_forget(&g_processes[idx]);
+    cpu_record_exit(&g_processes[idx]);
+    g_processes[idx] = fresh;
+    g_tickStats.removed++;
+  } else {
+    ensure_capacity();
+    g_processes[g_procCount] = fresh;
+    pid_index_insert(fresh.pid, g_procCount);
+    idx = (ssize_t)g_procCount++;
+  }
+  ns_table_adjust(&g_processes[idx], +1);
+  render_mark_dirty(fresh.pid, 0);
+  standing_touch(fresh.pid);
+  epoch_touch(fresh.pid);
+  g_tickStats.added++;
+}
+
+/**
+ * watch_revalidate_namespaces - Re-read the namespaces of a few survivors
+ *
+ * setns() and unshare() change a task's namespaces without touching its
+ * stat file, so each tick re-reads the ns links of the next g_nsSample
+ * entries, cycling through the whole table over successive ticks.
+ */
+static void watch_revalidate_namespaces(void) {
+  size_t budget = g_nsSample < g_procCount ? g_nsSample : g_procCount;
+
+  for (size_t n = 0; n < budget; n++) {
+    if (g_nsCursor >= g_procCount)
+      g_nsCursor = 0;
+    ProcInfo *proc = &g_processes[g_nsCursor++];
+
+    ProcInfo fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    if (proc->fdSlot) {
+      read_namespaces_at(&fresh, g_fdCache[proc->fdSlot - 1].dirFd, "ns");
+    } else {
+      char pidPath[PATH_MAX];
+      task_dir_path(proc, pidPath);
+      read_namespaces(&fresh, pidPath);
+    }
+    if (!fresh.nsReadable)
+      continue; /* most likely exited; the next listing will tell */
+
+    if (!namespaces_equal(proc, &fresh)) {
+      ns_table_adjust(proc, -1);
+      memcpy(proc->namespaces, fresh.namespaces, sizeof(proc->namespaces));
+      proc->nsCount = fresh.nsCount;
+      proc->nsReadable = fresh.nsReadable;
+      ns_table_adjust(proc, +1);
+      render_mark_dirty(proc->pid, 1);
+      standing_touch(proc->pid);
+      epoch_touch(proc->pid);
+      g_tickStats.changed++;
+    }
+  }
+}
+
+/* Tasks that came or went since g_processes was last laid out */
+static size_t g_layoutChurn = 0;
+
+/**
+ * watch_relayout - Re-pack g_processes in DFS order into a right-sized array
+ *
+ * Exited entries are compacted away every tick and their slots refilled by
+ * new tasks, so the table never holds dead entries, but its capacity only
+ * ever grows and new tasks land at the end, far from their parents. Once
+ * churn has replaced a good part of the table, or the table has shrunk to
+ * a fraction of its capacity, the live entries are copied in pre-order
+ * (siblings keep their order, so --sort=scan is unaffected) into an array
+ * sized for the live count, and the old one is released. The PID index,
+ * the namespace table and the sort scratch shrink along with it.
+ *
+ * Needs the tree built; rebuilds it for the new array.
+ */
+static void watch_relayout(void) {
+  size_t cap = 128;
+  while (cap < g_procCount + g_procCount / 4)
+    cap *= 2;
+  ProcInfo *next = malloc(cap * sizeof(*next));
+  if (!next) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  /* child_order_sort() sized both scratch arrays for g_procCount */
+  size_t *newIdx = g_order, *stack = g_orderTmp;
+  for (size_t i = 0; i < g_procCount; i++)
+    newIdx[i] = SIZE_MAX;
+
+  /* Roots first; then whatever a ppid cycle made unreachable from them */
+  size_t n = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (size_t r = 0; r < g_procCount; r++) {
+      if (newIdx[r] != SIZE_MAX || (pass == 0 && g_processes[r].parent))
+        continue;
+      size_t top = 0;
+      stack[top++] = r;
+      while (top) {
+        size_t i = stack[--top];
+        if (newIdx[i] != SIZE_MAX)
+          continue;
+        newIdx[i] = n;
+        next[n++] = g_processes[i];
+        const ProcInfo *proc = &g_processes[i];
+        for (size_t c = proc->childCount; c-- > 0;)
+          stack[top++] = (size_t)(proc->children[c] - g_processes);
+      }
+    }
+  }
+
+  free(g_processes);
+  g_processes = next;
+  g_procCapacity = cap;
+  if (g_orderCap > 1024 && g_orderCap / 4 > g_procCount) {
+    free(g_order);
+    free(g_orderTmp);
+    g_order = g_orderTmp = NULL;
+    g_orderCap = 0;
+  }
+  size_t nsCap = g_nsTableCap;
+  while (nsCap > 256 && g_nsTableCount * 8 < nsCap)
+    nsCap /= 2;
+  if (nsCap != g_nsTableCap)
+    ns_table_resize(nsCap);
+
+  free_process_tree();
+  build_process_tree();
+  g_layoutChurn = 0;
+}
+
+/**
+ * watch_tick - Bring g_processes up to date with one listing of /proc
+ *
+ * Return: what changed since the previous tick.
+ */
+static WatchStats watch_tick(void) {
+  memset(&g_tickStats, 0, sizeof(g_tickStats));
+  g_tick++;
+  if (g_cpuAccounting)
+    cpu_begin_tick();
+
+  free_process_tree();
+  scan_proc(watch_visit_task);
+
+  /* Drop every task that was not listed this time, keeping the order */
+  size_t kept = 0;
+  for (size_t i = 0; i < g_procCount; i++) {
+    if (g_processes[i].lastSeen != g_tick) {
+      fd_cache_evict(&g_processes[i]);
+      standing_leave(&g_processes[i]);
+      epoch_forget(&g_processes[i]);
+      ns_table_adjust(&g_processes[i], -1);
+      render_mark_dirty(g_processes[i].ppid, 0);
+      render_cache_forget(&g_processes[i]);
+      cpu_record_exit(&g_processes[i]);
+      g_tickStats.removed++;
+      continue;
+    }
+    if (kept != i)
+      g_processes[kept] = g_processes[i];
+    kept++;
+  }
+  g_procCount = kept;
+
+  watch_revalidate_namespaces();
+  build_process_tree();
+  g_layoutChurn += g_tickStats.added + g_tickStats.removed;
+  if (g_layoutChurn > g_procCount / 2 + 64 ||
+      (g_procCapacity > 1024 && g_procCapacity / 4 > g_procCount))
+    watch_relayout();
+  ns_events_flush(); /* after the re-index, so creators can be looked up */
+  standing_flush();
+  if (g_querySocketPath)
+    epoch_publish();
+  render_cache_invalidate();
+  if (g_cpuAccounting)
+    cpu_attribute_exits();
+  return g_tickStats;
+}
+
+/* ---- warm restart from a state checkpoint (--checkpoint) ---- */
+
+/*
+ * A restarted daemon would otherwise begin with an empty table: the first
+ * tick reads the namespaces of every task and reports the whole system as
+ * one burst of added tasks. With --checkpoint the task and namespace tables
+ * are written out every few seconds and on exit; the next start maps the
+ * file and the first tick merely revalidates each saved task through its
+ * stat file, like any other tick. Tasks whose starttime no longer matches
+ * were replaced while nobody was watching and go through the usual reuse
+ * path, so only what really changed during the downtime is reported.
+ */
+
+#define CHECKPOINT_MAGIC "NSTREECK"
+#define CHECKPOINT_VERSION 1
+
+/**
+ * struct CheckpointHeader - Start of a checkpoint file
+ * @magic:     CHECKPOINT_MAGIC
+ * @version:   CHECKPOINT_VERSION
+ * @taskSize:  sizeof(CheckpointTask), guards against other builds
+ * @nsSize:    sizeof(NsRecord)
+ * @nsTypes:   NS_TYPE_COUNT of the writer
+ * @threads:   Whether threads were listed
+ * @bootId:    /proc/sys/kernel/random/boot_id; starttimes and
+ *             CLOCK_MONOTONIC only mean something within one boot
+ * @tick:      g_tick when written
+ * @clock:     Start of the listing the tables reflect (CLOCK_MONOTONIC)
+ * @taskCount: CheckpointTask records following the header
+ * @nsCount:   NsRecord entries following the tasks
+ */
+typedef struct {
+  char magic[8];
+  unsigned int version;
+  unsigned int taskSize;
+  unsigned int nsSize;
+  unsigned int nsTypes;
+  unsigned int threads;
+  char bootId[40];
+  unsigned long tick;
+  struct timespec clock;
+  unsigned long long taskCount;
+  unsigned long long nsCount;
+} CheckpointHeader;
+
+/**
+ * struct CheckpointTask - One saved task
+ * @task: Identity and namespaces, packed as for the spill file
+ * @comm: The full command name; SpillRec keeps only TASK_COMM_LEN bytes
+ *
+ * The CPU counters are kept so that the first interval after a restart
+ * charges what was used during the downtime instead of everything since
+ * the task started.
+ */
+typedef struct {
+  SpillRec task;
+  char comm[sizeof(((ProcInfo *)0)->comm)];
+  unsigned long long cpuTime;
+  unsigned long long childCpuTime;
+  long rssPages;
+} CheckpointTask;
+
+static const char *g_checkpointPath = NULL;
+static double g_checkpointEvery = 60.0; /* seconds between checkpoints */
+
+/* Read the current boot id, an empty string if it cannot be read */
+static void checkpoint_boot_id(char *out, size_t outLen) {
+  memset(out, 0, outLen);
+  FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+  if (!f)
+    return;
+  if (fgets(out, (int)outLen, f))
+    out[strcspn(out, "\n")] = '\0';
+  fclose(f);
+}
+
+/**
+ * checkpoint_write - Save the task and namespace tables to g_checkpointPath
+ *
+ * The file is written next to the destination and renamed over it, so a
+ * crash mid-write leaves the previous checkpoint intact. Failures are
+ * reported but never stop the daemon.
+ */
+static void checkpoint_write(void) {
+  char tmpPath[PATH_MAX];
+  if (snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", g_checkpointPath) >=
+      (int)sizeof(tmpPath)) {
+    fprintf(stderr, "%s: checkpoint path too long\n", g_checkpointPath);
+    return;
+  }
+  FILE *f = fopen(tmpPath, "we");
+  if (!f) {
+    perror(tmpPath);
+    return;
+  }
+
+  CheckpointHeader hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic));
+  hdr.version = CHECKPOINT_VERSION;
+  hdr.taskSize = sizeof(CheckpointTask);
+  hdr.nsSize = sizeof(NsRecord);
+  hdr.nsTypes = NS_TYPE_COUNT;
+  hdr.threads = (unsigned int)show_threads;
+  checkpoint_boot_id(hdr.bootId, sizeof(hdr.bootId));
+  hdr.tick = g_tick;
+  hdr.clock = g_cpuClock;
+  if (!g_cpuAccounting) /* g_cpuClock is only kept with CPU accounting */
+    clock_gettime(CLOCK_MONOTONIC, &hdr.clock);
+  hdr.taskCount = g_procCount;
+  hdr.nsCount = g_nsTableCount;
+  fwrite(&hdr, sizeof(hdr), 1, f);
+
+  for (size_t i = 0; i < g_procCount; i++) {
+    const ProcInfo *proc = &g_processes[i];
+    CheckpointTask rec;
+    memset(&rec, 0, sizeof(rec));
+    spill_pack(proc, &rec.task);
+    memcpy(rec.comm, proc->comm, sizeof(rec.comm));
+    rec.cpuTime = proc->cpuTime;
+    rec.childCpuTime = proc->childCpuTime;
+    rec.rssPages = proc->rssPages;
+    fwrite(&rec, sizeof(rec), 1, f);
+  }
+  for (size_t i = 0; i < g_nsTableCap; i++) {
+    if (g_nsTable[i].ino)
+      fwrite(&g_nsTable[i], sizeof(g_nsTable[i]), 1, f);
+  }
+
+  int failed = (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) != 0);
+  if (fclose(f) != 0)
+    failed = 1;
+  if (failed || rename(tmpPath, g_checkpointPath) != 0) {
+    perror(tmpPath);
+    unlink(tmpPath);
+  }
+}
+
+/**
+ * checkpoint_restore - Seed the watch tables from g_checkpointPath
+ *
+ * Runs before the first tick. A missing file is a normal first start; one
+ * that does not match this build, this boot or the --threads setting is
+ * ignored with a note, and the daemon starts cold.
+ *
+ * g_tick continues from the saved tick, so the first tick is not taken as
+ * the baseline: namespaces created or destroyed during the downtime produce
+ * their events, while the saved ones do not. g_cpuClock continues as well,
+ * making the first CPU interval span the downtime.
+ */
+static void checkpoint_restore(void) {
+  int fd = open(g_checkpointPath, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno != ENOENT)
+      perror(g_checkpointPath);
+    return;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CheckpointHeader)) {
+    close(fd);
+    fprintf(stderr, "%s: not a checkpoint, starting cold\n",
+            g_checkpointPath);
+    return;
+  }
+  const char *data =
+      mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(g_checkpointPath);
+    return;
+  }
+
+  const CheckpointHeader *hdr = (const CheckpointHeader *)data;
+  char bootId[sizeof(hdr->bootId)];
+  checkpoint_boot_id(bootId, sizeof(bootId));
+  const char *why = NULL;
+  if (memcmp(hdr->magic, CHECKPOINT_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version != CHECKPOINT_VERSION ||
+      hdr->taskSize != sizeof(CheckpointTask) ||
+      hdr->nsSize != sizeof(NsRecord) || hdr->nsTypes != NS_TYPE_COUNT)
+    why = "written by another version";
+  else if (hdr->taskCount > SIZE_MAX / sizeof(CheckpointTask) ||
+           hdr->nsCount > SIZE_MAX / sizeof(NsRecord) ||
+           (size_t)st.st_size !=
+               sizeof(*hdr) + hdr->taskCount * sizeof(CheckpointTask) +
+                   hdr->nsCount * sizeof(NsRecord))
+    why = "truncated";
+  else if (!bootId[0] || memcmp(hdr->bootId, bootId, sizeof(bootId)) != 0)
+    why = "from another boot";
+  else if (hdr->threads != (unsigned int)show_threads)
+    why = "taken with a different --threads setting";
+  if (why) {
+    fprintf(stderr, "%s: checkpoint %s, starting cold\n", g_checkpointPath,
+            why);
+    munmap((void *)data, (size_t)st.st_size);
+    return;
+  }
+
+  const CheckpointTask *tasks = (const CheckpointTask *)(hdr + 1);
+  for (size_t i = 0; i < hdr->taskCount; i++) {
+    const CheckpointTask *rec = &tasks[i];
+    int valid = rec->task.pid > 0 && rec->task.nsCount <= MAX_NAMESPACES;
+    for (size_t n = 0; valid && n < rec->task.nsCount; n++) {
+      valid = rec->task.ns[n].kind >= 0 &&
+              (size_t)rec->task.ns[n].kind < NS_TYPE_COUNT &&
+              rec->task.ns[n].typeIdx >= 0 &&
+              (size_t)rec->task.ns[n].typeIdx < NS_TYPE_COUNT;
+    }
+    if (!valid || pid_index_find(rec->task.pid) >= 0)
+      continue;
+
+    ensure_capacity();
+    ProcInfo *proc = &g_processes[g_procCount];
+    spill_unpack(&rec->task, proc);
+    memcpy(proc->comm, rec->comm, sizeof(proc->comm));
+    proc->comm[sizeof(proc->comm) - 1] = '\0';
+    proc->cpuTime = rec->cpuTime;
+    proc->childCpuTime = rec->childCpuTime;
+    proc->rssPages = rec->rssPages;
+    proc->lastSeen = hdr->tick;
+    pid_index_insert(proc->pid, g_procCount++);
+  }
+
+  const NsRecord *records = (const NsRecord *)(tasks + hdr->taskCount);
+  for (size_t i = 0; i < hdr->nsCount; i++) {
+    const NsRecord *saved = &records[i];
+    if (!saved->ino || saved->typeIdx < 0 ||
+        (size_t)saved->typeIdx >= NS_TYPE_COUNT)
+      continue;
+    NsRecord *rec = ns_table_get(saved->ino, saved->typeIdx);
+    rec->members = saved->members;
+    rec->pid = saved->pid;
+    rec->ppid = saved->ppid;
+    memcpy(rec->comm, saved->comm, sizeof(rec->comm));
+    rec->comm[sizeof(rec->comm) - 1] = '\0';
+  }
+
+  g_tick = hdr->tick;
+  g_cpuClock = hdr->clock;
+  munmap((void *)data, (size_t)st.st_size);
+  fprintf(stderr, "%s: restored %zu tasks and %zu namespaces\n",
+          g_checkpointPath, g_procCount, g_nsTableCount);
+}
+
+/* ---- interactive full-screen mode (--tui) ---- */
+
+/* Child orderings the TUI cycles through with 's' */
+enum { TUI_SORT_SCAN, TUI_SORT_PID, TUI_SORT_COMM, TUI_SORT_SIZE };
+static const char *const g_tuiSortNames[] = {"scan", "pid", "comm",
+                                             "children"};
+
+/* Keys that do not map to a single byte */
+enum { TUI_KEY_PGUP = 0x100, TUI_KEY_PGDN };
+
+/* What a prompt at the bottom line is currently editing */
+enum { TUI_INPUT_NONE, TUI_INPUT_NSFILTER, TUI_INPUT_SEARCH };
+
+static int g_tui = 0;                   /* --tui given */
+static int g_tuiActive = 0;             /* terminal is in raw mode */
+static struct termios g_tuiSavedTermios;
+static volatile sig_atomic_t g_tuiResized = 0;
+static int g_tuiRows = 24, g_tuiCols = 80;
+static int g_tuiSort = TUI_SORT_SCAN;
+static int g_tuiInput = TUI_INPUT_NONE;
+static char g_tuiEdit[128];             /* text being typed at the prompt */
+static char g_tuiSearch[128];           /* active comm substring filter */
+static char g_tuiNsFilter[128];         /* active namespace filter list */
+static size_t g_tuiSel = 0;             /* selected row */
+static size_t g_tuiTop = 0;             /* first row in the window */
+static pid_t g_tuiSelPid = 1;           /* task on the selected row */
+static size_t g_tuiTotalRows = 0;       /* rows of the whole visible tree */
+static char **g_tuiFrame = NULL;        /* screen lines being built */
+static char **g_tuiShown = NULL;        /* screen lines on the terminal */
+static pid_t *g_tuiRowPid = NULL;       /* task per window row */
+static int g_tuiLines = 0;              /* allocated screen lines */
+static Sink g_tuiOut = {NULL, "terminal", STDOUT_FILENO, NULL, 0, 0, 0, NULL,
+                        0, NULL, 0, 0, 0};
+
+static void tui_handle_winch(int sig) {
+  (void)sig;
+  g_tuiResized = 1;
+}
+
+/**
+ * tui_resize - Pick up the terminal size and force a full redraw
+ */
+static void tui_resize(void) {
+  struct winsize ws;
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 2 &&
+      ws.ws_col > 10) {
+    g_tuiRows = ws.ws_row;
+    g_tuiCols = ws.ws_col;
+  }
+
+  for (int i = 0; i < g_tuiLines; i++) {
+    free(g_tuiFrame[i]);
+    free(g_tuiShown[i]);
+  }
+  free(g_tuiFrame);
+  free(g_tuiShown);
+  free(g_tuiRowPid);
+  g_tuiLines = g_tuiRows;
+  g_tuiFrame = calloc((size_t)g_tuiLines, sizeof(char *));
+  g_tuiShown = calloc((size_t)g_tuiLines, sizeof(char *));
+  g_tuiRowPid = calloc((size_t)g_tuiLines, sizeof(pid_t));
+  if (!g_tuiFrame || !g_tuiShown || !g_tuiRowPid) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  sink_puts(&g_tuiOut, "\033[2J");
+  g_tuiResized = 0;
+}
+
+/**
+ * tui_close - Restore the terminal; safe to call more than once
+ */
+static void tui_close(void) {
+  if (!g_tuiActive)
+    return;
+  sink_puts(&g_tuiOut, "\033[?25h\033[?1049l");
+  sink_flush(&g_tuiOut);
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &g_tuiSavedTermios);
+  g_tuiActive = 0;
+}
+
+/**
+ * tui_open - Switch the terminal to the alternate screen, unbuffered input
+ *
+ * ISIG is left on so Ctrl-C still stops the watch loop cleanly.
+ */
+static void tui_open(void) {
+  if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+    fprintf(stderr, "--tui needs a terminal\n");
+    exit(EXIT_FAILURE);
+  }
+  tcgetattr(STDIN_FILENO, &g_tuiSavedTermios);
+  struct termios raw = g_tuiSavedTermios;
+  raw.c_lflag &= ~(tcflag_t)(ICANON | ECHO | IEXTEN);
+  raw.c_iflag &= ~(tcflag_t)(IXON | ICRNL);
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+  tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+  g_tuiActive = 1;
+  atexit(tui_close);
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = tui_handle_winch;
+  sigaction(SIGWINCH, &sa, NULL);
+
+  sink_puts(&g_tuiOut, "\033[?1049h\033[?25l");
+  tui_resize();
+}
+
+/**
+ * tui_set_line - Store @len bytes of @text as screen line @row of the frame
+ *
+ * The text is cut after g_tuiCols display columns, counting every UTF-8
+ * sequence (such as the tree glyphs) as one column.
+ */
+static void tui_set_line(int row, const char *text, size_t len,
+                         int highlight) {
+  size_t cut = 0;
+  int cols = 0;
+  while (cut < len && cols < g_tuiCols) {
+    cut++;
+    while (cut < len && ((unsigned char)text[cut] & 0xC0) == 0x80)
+      cut++;
+    cols++;
+  }
+
+  char *line = malloc(cut + 16);
+  if (!line) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  size_t off = 0;
+  if (highlight) {
+    memcpy(line, "\033[7m", 4);
+    off = 4;
+  }
+  memcpy(line + off, text, cut);
+  off += cut;
+  if (highlight) {
+    memcpy(line + off, "\033[0m", 4);
+    off += 4;
+  }
+  line[off] = '\0';
+
+  free(g_tuiFrame[row]);
+  g_tuiFrame[row] = line;
+}
+
+/**
+ * tui_walk - Lay out the visible tree, formatting only rows in the window
+ * @proc:     Current node
+ * @prefix:   Tree indentation for @proc
+ * @isLast:   Non-zero if @proc is the last kept child
+ * @parent:   Parent node, or NULL for the root
+ * @row:      Running row counter
+ * @format:   Zero to only count rows and locate the selection
+ * @scratch:  Sink used to format one row at a time
+ *
+ * Rows outside [g_tuiTop, g_tuiTop + window) are only counted, so the cost
+ * of a frame is one pass over the unfolded, unfiltered tree plus formatting
+ * of a screenful of rows. Also finds the row of g_tuiSelPid.
+ */
+static void tui_walk(const ProcInfo *proc, const char *prefix, int isLast,
+                     const ProcInfo *parent, size_t *row, int format,
+                     Sink *scratch) {
+  if (!proc->keep)
+    return;
+
+  size_t window = (size_t)g_tuiRows - 2;
+  if (!format && proc->pid == g_tuiSelPid)
+    g_tuiSel = *row;
+
+  if (format && *row >= g_tuiTop && *row < g_tuiTop + window) {
+    VisitInfo visit = {
+        proc,
+        prefix,
+        isLast,
+        0,
+        parent ? parent->namespaces : NULL,
+        parent ? parent->nsCount : 0,
+        namespace_diff_mask(proc, parent ? parent->namespaces : NULL,
+                            parent ? parent->nsCount : 0)};
+    scratch->len = 0;
+    tree_node(scratch, &visit);
+    scratch->len--; /* drop the newline */
+    if (proc->collapsed && proc->childCount)
+      sink_puts(scratch, " [+]");
+
+    int screenRow = (int)(*row - g_tuiTop) + 1;
+    tui_set_line(screenRow, scratch->buf, scratch->len, 0);
+    g_tuiRowPid[screenRow] = proc->pid;
+  }
+  (*row)++;
+
+  if (proc->collapsed)
+    return;
+
+  char newPrefix[1024];
+  snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix,
+           (isLast ? "  " : "│ "));
+
+  int lastKeptIdx = -1;
+  for (int i = (int)proc->childCount - 1; i >= 0; i--) {
+    if (proc->children[i]->keep) {
+      lastKeptIdx = i;
+      break;
+    }
+  }
+  for (size_t i = 0; i < proc->childCount; i++)
+    tui_walk(proc->children[i], newPrefix, (int)i == lastKeptIdx, proc, row,
+             format, scratch);
+}
+
+/**
+ * tui_search_prune - Hide everything that neither matches the comm search
+ * nor leads to a match
+ *
+ * Return: 1 if @proc stays visible.
+ */
+static int tui_search_prune(ProcInfo *proc) {
+  int any = 0;
+  for (size_t i = 0; i < proc->childCount; i++) {
+    if (tui_search_prune(proc->children[i]))
+      any = 1;
+  }
+  int self = proc->keep && strstr(proc->comm, g_tuiSearch) != NULL;
+  proc->keep = self || any;
+  return proc->keep;
+}
+
+static int tui_child_compare(const void *a, const void *b) {
+  const ProcInfo *x = *(ProcInfo *const *)a, *y = *(ProcInfo *const *)b;
+  int c = 0;
+  if (g_tuiSort == TUI_SORT_COMM)
+    c = strcmp(x->comm, y->comm);
+  else if (g_tuiSort == TUI_SORT_SIZE)
+    c = (x->childCount < y->childCount) - (x->childCount > y->childCount);
+  if (c == 0)
+    c = (x->pid > y->pid) - (x->pid < y->pid);
+  return c;
+}
+
+/**
+ * tui_apply_view - Apply folding-independent view state to a fresh tree
+ *
+ * Sorts every child list by the selected key and recomputes the keep
+ * flags from the namespace filter and the comm search.
+ */
+static void tui_apply_view(ProcInfo *root) {
+  if (g_tuiSort != TUI_SORT_SCAN) {
+    for (size_t i = 0; i < g_procCount; i++) {
+      if (g_processes[i].childCount > 1)
+        qsort(g_processes[i].children, g_processes[i].childCount,
+              sizeof(ProcInfo *), tui_child_compare);
+    }
+  }
+  mark_keep_processes(root);
+  if (g_tuiSearch[0])
+    tui_search_prune(root);
+}
+
+/**
+ * tui_draw - Build the frame for the current tree and emit changed lines
+ *
+ * Lines are compared with what is already on the terminal, and only the
+ * ones that differ are rewritten, so an idle tree costs no output at all.
+ */
+static void tui_draw(void) {
+  if (g_tuiResized)
+    tui_resize();
+
+  ssize_t init = pid_index_find(1);
+  const ProcInfo *root = init >= 0 ? &g_processes[init] : NULL;
+  size_t window = (size_t)g_tuiRows - 2;
+  Sink scratch = {NULL, "row", -1, NULL, 0, 0, 0, NULL, 0, NULL, 0, 0, 0};
+  char text[512];
+
+  for (int r = 0; r < g_tuiLines; r++) {
+    g_tuiRowPid[r] = 0;
+    free(g_tuiFrame[r]);
+    g_tuiFrame[r] = NULL;
+  }
+
+  /* Pass 1: count rows and find the selection, keep it in the window */
+  size_t row = 0;
+  if (root)
+    tui_walk(root, "", 1, NULL, &row, 0, &scratch);
+  g_tuiTotalRows = row;
+  if (g_tuiSel >= g_tuiTotalRows)
+    g_tuiSel = g_tuiTotalRows ? g_tuiTotalRows - 1 : 0;
+  if (g_tuiSel < g_tuiTop)
+    g_tuiTop = g_tuiSel;
+  if (g_tuiSel >= g_tuiTop + window)
+    g_tuiTop = g_tuiSel - window + 1;
+
+  /* Pass 2: format the rows inside the window */
+  row = 0;
+  pid_t selPid = g_tuiSelPid;
+  if (root)
+    tui_walk(root, "", 1, NULL, &row, 1, &scratch);
+  g_tuiSelPid = g_tuiRowPid[g_tuiSel - g_tuiTop + 1]
+                    ? g_tuiRowPid[g_tuiSel - g_tuiTop + 1]
+                    : selPid;
+  int selRow = (int)(g_tuiSel - g_tuiTop) + 1;
+  if (g_tuiFrame[selRow]) {
+    char *plain = g_tuiFrame[selRow];
+    g_tuiFrame[selRow] = NULL;
+    tui_set_line(selRow, plain, strlen(plain), 1);
+    free(plain);
+  }
+  free(scratch.buf);
+
+  int len = snprintf(text, sizeof(text),
+                     "nstree: %zu tasks, %zu namespaces | sort: %s | "
+                     "ns filter: %s | search: %s",
+                     g_procCount, g_nsTableCount, g_tuiSortNames[g_tuiSort],
+                     g_tuiNsFilter[0] ? g_tuiNsFilter : "-",
+                     g_tuiSearch[0] ? g_tuiSearch : "-");
+  tui_set_line(0, text, (size_t)len, 1);
+
+  if (g_tuiInput != TUI_INPUT_NONE)
+    len = snprintf(text, sizeof(text), "%s: %s_",
+                   g_tuiInput == TUI_INPUT_SEARCH ? "search comm"
+                                                  : "ns filter (e.g. net,pid)",
+                   g_tuiEdit);
+  else
+    len = snprintf(text, sizeof(text),
+                   "q quit  j/k move  space fold  s sort  f ns filter  "
+                   "/ search  t threads");
+  tui_set_line(g_tuiRows - 1, text, (size_t)len, 0);
+
+  for (int r = 0; r < g_tuiLines; r++) {
+    const char *now = g_tuiFrame[r] ? g_tuiFrame[r] : "";
+    if (g_tuiShown[r] && strcmp(g_tuiShown[r], now) == 0)
+      continue;
+    sink_printf(&g_tuiOut, "\033[%d;1H%s\033[K", r + 1, now);
+    free(g_tuiShown[r]);
+    g_tuiShown[r] = strdup(now);
+  }
+  sink_flush(&g_tuiOut);
+}
+
+/**
+ * tui_set_ns_filter - Replace the namespace filters with a typed list
+ *
+ * An empty list clears the filters; "*" keeps anything that differs from
+ * its parent in any namespace, like a bare --filter.
+ */
+static void tui_set_ns_filter(const char *list) {
+  static char storage[sizeof(g_tuiNsFilter)];
+
+  snprintf(g_tuiNsFilter, sizeof(g_tuiNsFilter), "%s", list);
+  snprintf(storage, sizeof(storage), "%s", list);
+  g_filterCount = 0;
+  char *save = NULL;
+  for (char *tok = strtok_r(storage, ", ", &save);
+       tok && g_filterCount < sizeof(g_filters) / sizeof(g_filters[0]);
+       tok = strtok_r(NULL, ", ", &save))
+    g_filters[g_filterCount++] = tok;
+  traversal_select();
+}
+
+/**
+ * tui_handle_input - Read and act on pending key presses
+ *
+ * Return: non-zero if the view changed and needs to be redrawn.
+ */
+static int tui_handle_input(void) {
+  unsigned char keys[64];
+  ssize_t n = read(STDIN_FILENO, keys, sizeof(keys));
+  if (n <= 0)
+    return 0;
+
+  size_t window = (size_t)g_tuiRows - 2;
+  int treeChanged = 0;
+  for (ssize_t i = 0; i < n; i++) {
+    unsigned char k = keys[i];
+
+    if (g_tuiInput != TUI_INPUT_NONE) {
+      size_t len = strlen(g_tuiEdit);
+      if (k == '\r' || k == '\n') {
+        if (g_tuiInput == TUI_INPUT_SEARCH)
+          snprintf(g_tuiSearch, sizeof(g_tuiSearch), "%s", g_tuiEdit);
+        else
+          tui_set_ns_filter(g_tuiEdit);
+        g_tuiInput = TUI_INPUT_NONE;
+        treeChanged = 1;
+      } else if (k == 27) {
+        g_tuiInput = TUI_INPUT_NONE;
+      } else if ((k == 127 || k == 8) && len > 0) {
+        g_tuiEdit[len - 1] = '\0';
+      } else if (isprint(k) && len + 1 < sizeof(g_tuiEdit)) {
+        g_tuiEdit[len] = (char)k;
+        g_tuiEdit[len + 1] = '\0';
       }
-      /* If we get here, no difference in any namespace, check next filter. */
       continue;
     }
 
-    const char *childInode = NULL;
-    for (size_t i = 0; i < proc->nsCount; i++) {
-      if (strcmp(proc->namespaces[i].type, filterType) == 0) {
-        childInode = proc->namespaces[i].inode;
-        break;
-      }
+    /* Arrow and paging keys arrive as ESC [ x or ESC [ n ~ */
+    int key = k;
+    if (k == 27 && i + 2 < n && keys[i + 1] == '[') {
+      unsigned char c = keys[i + 2];
+      i += 2;
+      if ((c == '5' || c == '6') && i + 1 < n && keys[i + 1] == '~')
+        i++;
+      key = c == 'A'   ? 'k'
+            : c == 'B' ? 'j'
+            : c == '5' ? TUI_KEY_PGUP
+            : c == '6' ? TUI_KEY_PGDN
+            : c == 'H' ? 'g'
+            : c == 'F' ? 'G'
+                       : 0;
+    }
+
+    switch (key) {
+    case 'q':
+      g_stop = 1;
+      break;
+    case 'k':
+      if (g_tuiSel > 0)
+        g_tuiSel--;
+      break;
+    case 'j':
+      if (g_tuiSel + 1 < g_tuiTotalRows)
+        g_tuiSel++;
+      break;
+    case TUI_KEY_PGUP:
+      g_tuiSel = g_tuiSel > window ? g_tuiSel - window : 0;
+      break;
+    case TUI_KEY_PGDN:
+      g_tuiSel += window;
+      break;
+    case 'g':
+      g_tuiSel = 0;
+      break;
+    case 'G':
+      g_tuiSel = g_tuiTotalRows ? g_tuiTotalRows - 1 : 0;
+      break;
+    case ' ':
+    case '\r': {
+      ssize_t idx = pid_index_find(g_tuiSelPid);
+      if (idx >= 0)
+        g_processes[idx].collapsed = !g_processes[idx].collapsed;
+      break;
+    }
+    case 's':
+      g_tuiSort = (g_tuiSort + 1) % 4;
+      treeChanged = 1;
+      break;
+    case 't':
+      show_threads = !show_threads;
+      break;
+    case 'f':
+    case '/':
+      g_tuiInput = key == '/' ? TUI_INPUT_SEARCH : TUI_INPUT_NSFILTER;
+      snprintf(g_tuiEdit, sizeof(g_tuiEdit), "%s",
+               key == '/' ? g_tuiSearch : g_tuiNsFilter);
+      break;
+    default:
+      continue;
+    }
+    /* Moving selects by row; the task under it is picked up on redraw */
+    if (key == 'k' || key == 'j' || key == 'g' || key == 'G' ||
+        key == TUI_KEY_PGUP || key == TUI_KEY_PGDN)
+      g_tuiSelPid = 0;
+  }
+
+  if (treeChanged) {
+    ssize_t init = pid_index_find(1);
+    if (init >= 0)
+      tui_apply_view(&g_processes[init]);
+  }
+  return 1;
+}
+
+static void watch_handle_signal(int sig) {
+  (void)sig;
+  g_stop = 1;
+}
+
+/**
+ * watch_sleep - Sleep for @seconds, returning early on SIGINT/SIGTERM
+ *
+ * While sleeping, the event socket keeps accepting subscribers and reading
+ * their subscription lines, and the TUI keeps reacting to key presses.
+ */
+static void watch_sleep(double seconds) {
+  struct timespec deadline, now;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += (time_t)seconds;
+  deadline.tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  while (!g_stop) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long remainMs = (long long)(deadline.tv_sec - now.tv_sec) * 1000 +
+                         (deadline.tv_nsec - now.tv_nsec) / 1000000;
+    if (remainMs <= 0)
+      return;
+
+    struct pollfd pfds[MAX_SUBSCRIBERS + 2];
+    size_t nfds = 0;
+    if (g_tui) {
+      pfds[nfds].fd = STDIN_FILENO;
+      pfds[nfds++].events = POLLIN;
+    }
+    if (g_eventListenFd >= 0) {
+      pfds[nfds].fd = g_eventListenFd;
+      pfds[nfds++].events = POLLIN;
+    }
+    for (size_t i = 0; i < MAX_SUBSCRIBERS; i++) {
+      if (g_subs[i].fd >= 0) {
+        pfds[nfds].fd = g_subs[i].fd;
+        pfds[nfds++].events = POLLIN;
+      }
+    }
+
+    int n = poll(pfds, nfds, (int)remainMs);
+    size_t first = 0;
+    if (g_tui) {
+      int redraw = g_tuiResized;
+      if (n > 0 && pfds[0].revents && tui_handle_input())
+        redraw = 1;
+      if (redraw)
+        tui_draw();
+      first = 1;
+    }
+    if (n > 0)
+      events_poll(pfds + first, nfds - first);
+  }
+}
+
+/**
+ * run_watch - Poll /proc and re-render the sinks whenever something changed
+ *
+ * Works without any privileges: each tick only lists /proc, reads stat for
+ * every task and namespaces for new ones plus a rotating sample. The poll
+ * interval follows an exponentially weighted churn rate, aiming at
+ * WATCH_TARGET_CHURN changes per tick within [g_watchMin, g_watchMax].
+ */
+static void run_watch(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = watch_handle_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  double interval = g_watchMax;
+  double churnRate = 0.0; /* changes per second, smoothed */
+  int warned = 0;
+
+  fd_cache_init();
+  events_open();
+  query_server_open();
+  if (g_tui)
+    tui_open();
+  for (size_t s = 0; s < g_sinkCount; s++)
+    g_renderCache |= g_sinks[s].format->cacheable;
+  traversal_select();
+  g_creatorsSince = creators_clock();
+  if (g_checkpointPath)
+    checkpoint_restore();
+  unsigned long firstTick = g_tick + 1;
+  double checkpointAt = creators_clock() + g_checkpointEvery;
+
+  while (!g_stop) {
+    WatchStats st = watch_tick();
+    size_t churn = st.added + st.removed + st.changed;
+
+    if (g_unreadableFound && !warned && !g_tui) {
+      fprintf(stderr, "Warning, namespaces that could not be read is marked "
+                      "with an asterisk. Run as root for full info.\n");
+      warned = 1;
+    }
+
+    /* CPU and creation rates change without any task coming or going */
+    if (g_sinkCount &&
+        (churn || g_tick == firstTick || g_cpuAccounting ||
+         g_creatorTracking)) {
+      ssize_t init = pid_index_find(1);
+      ProcInfo *root = init >= 0 ? &g_processes[init] : NULL;
+      if (root)
+        mark_keep_processes(root);
+      render_all_sinks(root);
+    }
+    if (g_tui) {
+      ssize_t init = pid_index_find(1);
+      if (init >= 0)
+        tui_apply_view(&g_processes[init]);
+      tui_draw();
     }
 
-    if (!parentNs) {
-      /* If there's no parent, having this childInode means it's new. */
-      if (childInode)
-        return 1;
-      else
-        continue;
+    if (g_checkpointPath && creators_clock() >= checkpointAt) {
+      checkpoint_write();
+      checkpointAt = creators_clock() + g_checkpointEvery;
     }
 
-    /* Compare child's inode with parent's inode for the same type */
-    if (childInode) {
-      const char *parentInode =
-          find_namespace_inode(parentNs, parentNsCount, filterType);
-      if (!parentInode || strcmp(parentInode, childInode) != 0) {
-        return 1;
-      }
+    if (g_tick > firstTick) {
+      churnRate = 0.7 * churnRate + 0.3 * ((double)churn / interval);
+      interval = churnRate > 0 ? WATCH_TARGET_CHURN / churnRate : g_watchMax;
+      if (interval < g_watchMin)
+        interval = g_watchMin;
+      if (interval > g_watchMax)
+        interval = g_watchMax;
     }
+    watch_sleep(interval);
   }
-  return 0;
+
+  if (g_checkpointPath && g_tick >= firstTick)
+    checkpoint_write();
+  fd_cache_destroy();
+  events_close();
+  query_server_close();
+  tui_close();
+  for (size_t i = 0; i < g_procCount; i++)
+    render_cache_forget(&g_processes[i]);
+  free(g_renderDirty);
+  g_renderDirty = NULL;
+  g_renderDirtyCount = g_renderDirtyCap = 0;
 }
 
+/* ---- offline fleet aggregation over ndjson snapshots (--aggregate) ---- */
+
+#define FLEET_TOP_HOSTS 20
+#define FLEET_TOP_PATTERNS 10
+#define FLEET_BUCKETS 64
+#define NS_PATTERN_COUNT (1u << NS_TYPE_COUNT)
+
+/**
+ * struct SnapTask - The fields of one ndjson snapshot line that are used
+ * @pid:      Task ID
+ * @ppid:     Parent as written (the leader for threads)
+ * @thread:   Non-zero for threads
+ * @depth:    Depth in the rendered tree
+ * @ns:       Inode per g_nsTypes index, 0 if absent
+ * @diffMask: Types (bits over g_nsTypes) differing from the parent
+ */
+typedef struct {
+  pid_t pid;
+  pid_t ppid;
+  int thread;
+  unsigned long depth;
+  unsigned long long ns[NS_TYPE_COUNT];
+  unsigned int diffMask;
+} SnapTask;
+
+/**
+ * struct HostSummary - What one snapshot contributes to the fleet report
+ * @name:        Snapshot path, which names the host
+ * @tasks:       Parsed tasks
+ * @malformed:   Lines that could not be parsed
+ * @nsCount:     Distinct namespaces per type
+ * @orphanedNet: Net namespaces only ever entered by tasks parented to PID 1
+ * @patterns:    Boundaries per set of types entered together
+ */
+typedef struct {
+  const char *name;
+  size_t tasks;
+  size_t malformed;
+  size_t nsCount[NS_TYPE_COUNT];
+  size_t orphanedNet;
+  size_t patterns[NS_PATTERN_COUNT];
+} HostSummary;
+
+/**
+ * struct LeakyHost - A host in the orphaned-net-namespace ranking
+ * @name:   Snapshot path
+ * @leaked: Its orphaned net namespaces
+ */
+typedef struct {
+  char name[256];
+  size_t leaked;
+} LeakyHost;
+
 /**
- * mark_keep_processes - Recursively mark which processes to keep.
- * Return 1 if 'proc' or any descendant is kept, else 0.
+ * struct FleetState - Everything merged from the host summaries
  *
- * If no filters are specified, every process is kept.
+ * The size is fixed, however many hosts there are: distributions are kept
+ * as log2 histograms and only the FLEET_TOP_HOSTS leakiest hosts are kept.
  */
-static int mark_keep_processes(ProcInfo *proc, const NamespaceEntry *parentNs,
-                               size_t parentNsCount) {
-  if (g_filterCount == 0) {
-    /* No filters => keep everything. */
-    proc->keep = 1;
-  } else {
-    /* Keep if there's a difference in any requested namespace. */
-    int differs = has_requested_namespace_diff(proc, parentNs, parentNsCount);
-    proc->keep = (differs ? 1 : 0);
-  }
+typedef struct {
+  size_t hosts;
+  size_t unreadable;
+  size_t tasks;
+  size_t malformed;
+  struct {
+    size_t min;
+    size_t max;
+    unsigned long long sum;
+    size_t buckets[FLEET_BUCKETS];
+  } nsDist[NS_TYPE_COUNT];
+  size_t leakyHosts;
+  LeakyHost leaky[FLEET_TOP_HOSTS]; /* min-heap on leaked */
+  size_t leakyCount;
+  struct {
+    unsigned long long boundaries;
+    size_t hosts;
+  } patterns[NS_PATTERN_COUNT];
+} FleetState;
 
-  /* Recurse on children; if a child is kept, we also keep this proc. */
-  for (size_t i = 0; i < proc->childCount; i++) {
-    ProcInfo *child = proc->children[i];
-    int childKept = mark_keep_processes(child, proc->namespaces, proc->nsCount);
-    if (childKept) {
-      proc->keep = 1;
-    }
-  }
+static int g_aggregate = 0;     /* --aggregate given */
+static long g_aggJobs = 0;      /* --jobs=N, 0 = one per online CPU */
+static char **g_aggFiles = NULL;
+static size_t g_aggFileCount = 0;
+static size_t g_aggNext = 0;    /* next file for a worker, under the lock */
+static FleetState g_fleet;
+static pthread_mutex_t g_fleetLock = PTHREAD_MUTEX_INITIALIZER;
 
-  return proc->keep;
+/* Skip a JSON string starting at its opening quote */
+static char *snapshot_skip_string(char *p) {
+  if (*p != '"')
+    return NULL;
+  for (p++; *p && *p != '"'; p++) {
+    if (*p == '\\' && p[1])
+      p++;
+  }
+  return *p ? p + 1 : NULL;
 }
 
 /**
- * print_tree - Recursively print the process tree with namespace differences
- * @proc:           pointer to the current ProcInfo
- * @prefix:         prefix string for tree indentation
- * @isLast:         bool indicating if this child is last among siblings
- * @parentNs:       parent's namespace array
- * @parentNsCount:  how many namespaces in parent's array
+ * snapshot_parse_line - Parse one line written by the ndjson output
+ * @line: NUL-terminated line; it is modified
+ * @task: Output
+ *
+ * Only comm is chosen by the task, so once it has been skipped as a proper
+ * JSON string the remaining keys can be found by plain search.
  *
- * This prints the tree comparing each child's namespaces to its parent's.
- * The tree lines are updated so that if the node is the last kept child,
- * we print "└─" instead of "├─".
+ * Return: 0 on success, -1 if the line is not an ndjson task.
  */
-static void print_tree(const ProcInfo *proc, const char *prefix, int isLast,
-                       const NamespaceEntry *parentNs, size_t parentNsCount) {
-  /* If this node is pruned, skip it. */
-  if (!proc->keep) {
-    return;
+static int snapshot_parse_line(char *line, SnapTask *task) {
+  memset(task, 0, sizeof(*task));
+  int pid, ppid;
+  if (sscanf(line, "{\"pid\":%d,\"ppid\":%d,", &pid, &ppid) != 2)
+    return -1;
+  task->pid = (pid_t)pid;
+  task->ppid = (pid_t)ppid;
+
+  char *p = strstr(line, ",\"comm\":");
+  if (!p || !(p = snapshot_skip_string(p + 8)))
+    return -1;
+  if (strncmp(p, ",\"thread\":", 10) != 0)
+    return -1;
+  task->thread = (strncmp(p + 10, "true", 4) == 0);
+
+  char *q = strstr(p, "\"depth\":");
+  if (!q)
+    return -1;
+  task->depth = strtoul(q + 8, NULL, 10);
+
+  if (!(q = strstr(p, "\"ns\":{")))
+    return -1;
+  for (q += 6; *q == '"';) {
+    char *nameEnd = strchr(q + 1, '"');
+    if (!nameEnd || nameEnd[1] != ':')
+      return -1;
+    *nameEnd = '\0';
+    int t = ns_type_index(q + 1);
+    unsigned long long ino = strtoull(nameEnd + 2, &q, 10);
+    if (t >= 0)
+      task->ns[t] = ino;
+    if (*q == ',')
+      q++;
   }
 
-  /* Print the tree branch prefix */
-  printf("%s", prefix);
-  printf("%s", isLast ? "└─" : "├─");
+  if (!(q = strstr(q, "\"diff\":[")))
+    return -1;
+  for (q += 8; *q == '"';) {
+    char *nameEnd = strchr(q + 1, '"');
+    if (!nameEnd)
+      return -1;
+    *nameEnd = '\0';
+    int t = ns_type_index(q + 1);
+    if (t >= 0)
+      task->diffMask |= 1u << t;
+    q = nameEnd + 1;
+    if (*q == ',')
+      q++;
+  }
+  return 0;
+}
 
-  /* If it's a thread, comm is typically in braces, e.g. {bash} */
-  if (proc->isThread) {
-    printf("{%s}(%d)", proc->comm, proc->pid);
-  } else {
-    printf("%s(%d)", proc->comm, proc->pid);
+/**
+ * aggregate_host - Summarize one memory-mapped snapshot
+ *
+ * Return: 0 on success, -1 if the file could not be opened or mapped or
+ * holds no task at all.
+ */
+static int aggregate_host(const char *path, HostSummary *h) {
+  memset(h, 0, sizeof(*h));
+  h->name = path;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    perror(path);
+    close(fd);
+    return -1;
   }
+  if (st.st_size == 0) {
+    fprintf(stderr, "%s: empty snapshot\n", path);
+    close(fd);
+    return -1;
+  }
+  const char *data =
+      mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(path);
+    return -1;
+  }
+  madvise((void *)data, (size_t)st.st_size, MADV_SEQUENTIAL);
 
-  /* If namespaces were unreadable, add an asterisk */
-  if (!proc->nsReadable) {
-	  printf("*");
+  /* *_for_children always follow their base type, so leave them out */
+  unsigned int baseTypes = 0;
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    if (!strstr(g_nsTypes[t], "_for_children"))
+      baseTypes |= 1u << t;
   }
+  int netIdx = ns_type_index("net");
 
-  /* Determine which namespaces differ from the parent's */
-  int firstNsPrinted = 1;
-  for (size_t i = 0; i < proc->nsCount; i++) {
-    const char *childType = proc->namespaces[i].type;
-    const char *childInode = proc->namespaces[i].inode;
+  InoSet distinct[NS_TYPE_COUNT];
+  InoSet orphaned = {NULL, 0, 0}, owned = {NULL, 0, 0};
+  memset(distinct, 0, sizeof(distinct));
 
-    const char *parentInode =
-        (parentNs ? find_namespace_inode(parentNs, parentNsCount, childType)
-                  : NULL);
-    if (!parentInode || strcmp(parentInode, childInode) != 0) {
-      if (firstNsPrinted) {
-        printf(" [");
-        firstNsPrinted = 0;
+  char line[65536];
+  const char *p = data, *end = data + st.st_size;
+  while (p < end) {
+    const char *nl = memchr(p, '\n', (size_t)(end - p));
+    size_t len = (size_t)((nl ? nl : end) - p);
+    if (len >= sizeof(line)) {
+      h->malformed++;
+    } else if (len > 0) {
+      memcpy(line, p, len);
+      line[len] = '\0';
+      SnapTask task;
+      if (snapshot_parse_line(line, &task) != 0) {
+        h->malformed++;
       } else {
-        printf(", ");
+        h->tasks++;
+        for (size_t t = 0; t < NS_TYPE_COUNT; t++)
+          inoset_add(&distinct[t], task.ns[t]);
+        unsigned int entered = task.diffMask & baseTypes;
+        if (task.depth > 0 && entered) {
+          h->patterns[entered]++;
+          if (netIdx >= 0 && (entered & (1u << netIdx)))
+            inoset_add(task.ppid == 1 ? &orphaned : &owned, task.ns[netIdx]);
+        }
       }
-      printf("%s", childInode);
     }
+    p += len + 1;
   }
-  if (!firstNsPrinted)
-    printf("]");
+  munmap((void *)data, (size_t)st.st_size);
+
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    h->nsCount[t] = distinct[t].count;
+    free(distinct[t].slots);
+  }
+  for (size_t i = 0; i < orphaned.cap; i++) {
+    if (orphaned.slots[i] && !inoset_contains(&owned, orphaned.slots[i]))
+      h->orphanedNet++;
+  }
+  free(orphaned.slots);
+  free(owned.slots);
+  if (!h->tasks) {
+    fprintf(stderr, "%s: no task in snapshot\n", path);
+    return -1;
+  }
+  return 0;
+}
 
-  printf("\n");
+static size_t fleet_bucket(size_t v) {
+  size_t b = 0;
+  while (v) {
+    b++;
+    v >>= 1;
+  }
+  return b < FLEET_BUCKETS ? b : FLEET_BUCKETS - 1;
+}
 
-  /* Prepare prefix for children */
-  char newPrefix[1024];
-  snprintf(newPrefix, sizeof(newPrefix), "%s%s", prefix,
-           (isLast ? "  " : "│ "));
+/* Restore the min-heap order of g_fleet.leaky below @i */
+static void fleet_leaky_sift_down(size_t i) {
+  LeakyHost *heap = g_fleet.leaky;
+  for (;;) {
+    size_t min = i, l = 2 * i + 1, r = l + 1;
+    if (l < g_fleet.leakyCount && heap[l].leaked < heap[min].leaked)
+      min = l;
+    if (r < g_fleet.leakyCount && heap[r].leaked < heap[min].leaked)
+      min = r;
+    if (min == i)
+      return;
+    LeakyHost tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
 
-  /*
-   * Find which child is actually the last 'kept' child
-   * so that we show "└─" instead of "├─" for that child.
-   */
-  int lastKeptIdx = -1;
-  for (int i = (int)proc->childCount - 1; i >= 0; i--) {
-    if (proc->children[i]->keep) {
-      lastKeptIdx = i;
+/**
+ * fleet_merge - Fold one host summary into g_fleet; caller holds the lock
+ */
+static void fleet_merge(const HostSummary *h) {
+  FleetState *f = &g_fleet;
+  f->hosts++;
+  f->tasks += h->tasks;
+  f->malformed += h->malformed;
+
+  for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+    size_t v = h->nsCount[t];
+    if (f->hosts == 1 || v < f->nsDist[t].min)
+      f->nsDist[t].min = v;
+    if (v > f->nsDist[t].max)
+      f->nsDist[t].max = v;
+    f->nsDist[t].sum += v;
+    f->nsDist[t].buckets[fleet_bucket(v)]++;
+  }
+
+  for (size_t m = 0; m < NS_PATTERN_COUNT; m++) {
+    if (!h->patterns[m])
+      continue;
+    f->patterns[m].boundaries += h->patterns[m];
+    f->patterns[m].hosts++;
+  }
+
+  if (!h->orphanedNet)
+    return;
+  f->leakyHosts++;
+  LeakyHost entry;
+  snprintf(entry.name, sizeof(entry.name), "%s", h->name);
+  entry.leaked = h->orphanedNet;
+  if (f->leakyCount < FLEET_TOP_HOSTS) {
+    size_t j = f->leakyCount++;
+    f->leaky[j] = entry;
+    while (j > 0 && f->leaky[(j - 1) / 2].leaked > f->leaky[j].leaked) {
+      LeakyHost tmp = f->leaky[j];
+      f->leaky[j] = f->leaky[(j - 1) / 2];
+      f->leaky[(j - 1) / 2] = tmp;
+      j = (j - 1) / 2;
+    }
+  } else if (entry.leaked > f->leaky[0].leaked) {
+    f->leaky[0] = entry;
+    fleet_leaky_sift_down(0);
+  }
+}
+
+/**
+ * aggregate_worker - Pool thread: summarize snapshots until none are left
+ *
+ * Summaries are built without the lock, so only the short merge is
+ * serialized; each worker holds a single host's state at a time.
+ */
+static void *aggregate_worker(void *arg) {
+  (void)arg;
+  HostSummary *h = malloc(sizeof(*h));
+  if (!h) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+
+  for (;;) {
+    pthread_mutex_lock(&g_fleetLock);
+    size_t idx = g_aggNext++;
+    pthread_mutex_unlock(&g_fleetLock);
+    if (idx >= g_aggFileCount)
       break;
+
+    int rc = aggregate_host(g_aggFiles[idx], h);
+    pthread_mutex_lock(&g_fleetLock);
+    if (rc == 0) {
+      fleet_merge(h);
+    } else {
+      g_fleet.unreadable++;
+      g_fleet.malformed += h->malformed;
     }
+    pthread_mutex_unlock(&g_fleetLock);
   }
+  free(h);
+  return NULL;
+}
 
-  /* Recurse for children */
-  for (size_t i = 0; i < proc->childCount; i++) {
-    if (!proc->children[i]->keep) {
+/*
+ * Upper bound of the log2 bucket holding quantile @q of the hosts, clamped
+ * to the largest value seen so that it never exceeds MAX
+ */
+static size_t fleet_quantile(const size_t *buckets, size_t hosts, double q,
+                             size_t max) {
+  size_t want = (size_t)ceil(q * (double)hosts), seen = 0;
+  for (size_t b = 0; b < FLEET_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen >= want && seen) {
+      size_t bound = b ? ((size_t)1 << b) - 1 : 0;
+      return bound < max ? bound : max;
+    }
+  }
+  return 0;
+}
+
+static int leaky_compare(const void *a, const void *b) {
+  const LeakyHost *x = a, *y = b;
+  if (x->leaked != y->leaked)
+    return x->leaked > y->leaked ? -1 : 1;
+  return strcmp(x->name, y->name);
+}
+
+/**
+ * fleet_report - Print the merged fleet summary to stdout
+ */
+static void fleet_report(void) {
+  FleetState *f = &g_fleet;
+  Sink out = {NULL, "stdout", STDOUT_FILENO, NULL, 0, 0, 0, NULL,
+              0,    NULL,     0,             0, 0};
+
+  sink_printf(&out, "%-12s %zu (%zu unreadable, %zu malformed lines)\n",
+              "hosts", f->hosts, f->unreadable, f->malformed);
+  sink_printf(&out, "%-12s %zu\n\n", "tasks", f->tasks);
+
+  sink_puts(&out, "Distinct namespaces per host (percentiles are log2 "
+                  "bucket upper bounds):\n");
+  sink_printf(&out, "%-8s %8s %8s %8s %8s %10s\n", "TYPE", "MIN", "P50<=",
+              "P90<=", "MAX", "MEAN");
+  for (size_t t = 0; t < NS_TYPE_COUNT && f->hosts; t++) {
+    if (strstr(g_nsTypes[t], "_for_children"))
       continue;
+    sink_printf(&out, "%-8s %8zu %8zu %8zu %8zu %10.1f\n", g_nsTypes[t],
+                f->nsDist[t].min,
+                fleet_quantile(f->nsDist[t].buckets, f->hosts, 0.5,
+                               f->nsDist[t].max),
+                fleet_quantile(f->nsDist[t].buckets, f->hosts, 0.9,
+                               f->nsDist[t].max),
+                f->nsDist[t].max,
+                (double)f->nsDist[t].sum / (double)f->hosts);
+  }
+
+  qsort(f->leaky, f->leakyCount, sizeof(*f->leaky), leaky_compare);
+  sink_printf(&out,
+              "\nHosts with orphaned net namespaces (entered only by tasks "
+              "parented to PID 1): %zu\n",
+              f->leakyHosts);
+  if (f->leakyCount)
+    sink_printf(&out, "%8s  %s\n", "ORPHANED", "HOST");
+  for (size_t i = 0; i < f->leakyCount; i++)
+    sink_printf(&out, "%8zu  %s\n", f->leaky[i].leaked, f->leaky[i].name);
+
+  sink_puts(&out, "\nMost common isolation patterns (types entered together "
+                  "at a boundary):\n");
+  sink_printf(&out, "%12s %8s  %s\n", "BOUNDARIES", "HOSTS", "TYPES");
+  for (size_t n = 0; n < FLEET_TOP_PATTERNS; n++) {
+    size_t best = 0;
+    for (size_t m = 1; m < NS_PATTERN_COUNT; m++) {
+      if (f->patterns[m].boundaries > f->patterns[best].boundaries)
+        best = m;
+    }
+    if (!f->patterns[best].boundaries)
+      break;
+    sink_printf(&out, "%12llu %8zu  ", f->patterns[best].boundaries,
+                f->patterns[best].hosts);
+    const char *sep = "";
+    for (size_t t = 0; t < NS_TYPE_COUNT; t++) {
+      if (best & (1u << t)) {
+        sink_printf(&out, "%s%s", sep, g_nsTypes[t]);
+        sep = ",";
+      }
     }
-    print_tree(proc->children[i], newPrefix, (int)i == lastKeptIdx,
-               proc->namespaces, proc->nsCount);
+    sink_puts(&out, "\n");
+    f->patterns[best].boundaries = 0;
+  }
+  sink_flush(&out);
+  free(out.buf);
+}
+
+/**
+ * run_aggregate - Summarize g_aggFiles with a pool of worker threads
+ *
+ * Return: 0 if every snapshot was read, 1 if any could not be (the report
+ * still covers the others).
+ */
+static int run_aggregate(void) {
+  long jobs = g_aggJobs > 0 ? g_aggJobs : sysconf(_SC_NPROCESSORS_ONLN);
+  if (jobs < 1)
+    jobs = 1;
+  if ((size_t)jobs > g_aggFileCount)
+    jobs = (long)g_aggFileCount;
+
+  pthread_t *workers = calloc((size_t)jobs, sizeof(*workers));
+  if (!workers) {
+    perror("calloc");
+    exit(EXIT_FAILURE);
+  }
+  long started = 0;
+  for (; started < jobs; started++) {
+    if (pthread_create(&workers[started], NULL, aggregate_worker, NULL) != 0)
+      break;
   }
+  if (!started)
+    aggregate_worker(NULL); /* no threads available: do it inline */
+  for (long i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+  free(workers);
+
+  fleet_report();
+  return g_fleet.hosts && !g_fleet.unreadable ? 0 : 1;
 }
 
 /**
@@ -629,6 +9200,9 @@ static void print_usage(const char *argv0) {
   printf("Options:\n");
   printf("  --help, -h         Show this help message and exit.\n");
   printf("  --show-threads, -t Include threads in the tree.\n");
+  printf("  --sort=ORDER       Order children by pid (default), starttime, "
+         "comm, or\n"
+         "                     scan (the order /proc listed them in).\n");
   printf("  --filter=TYPE      Only keep processes that differ in this "
          "namespace\n");
   printf("                     from their parent. May be specified multiple "
@@ -636,7 +9210,97 @@ static void print_usage(const char *argv0) {
   printf("                     Available filters: net, pid, mnt, ipc, uts,"
          " user, cgroup.\n");
   printf("  --filter           Prune paths that do not differ in *any* "
-         "namespace.\n\n");
+         "namespace.\n");
+  printf("  --output=FORMAT[:DEST]\n"
+         "                     Render to DEST (a file, or - for stdout) in "
+         "FORMAT,\n"
+         "                     one of tree, ndjson, arrow, metrics, census, "
+         "by-ns,\n"
+         "                     cpu, top, groups, mounts, quota, creators (cpu "
+         "and\n"
+         "                     creators need --watch). May be given several "
+         "times;\n"
+         "                     all outputs share a single scan.\n");
+  printf("  --top=K[:METRIC]   Print the K heaviest namespaces entered below "
+         "PID 1\n"
+         "                     by tasks (default), rss or cpu (needs "
+         "--watch).\n");
+  printf("  --group-by=LIST    Group tasks sharing these namespaces (e.g. "
+         "net,ipc for\n"
+         "                     pods) and print each group's member "
+         "subtrees.\n");
+  printf("  --policy=FILE      Check the namespace rules in FILE and print "
+         "only the\n"
+         "                     violations; exits with 2 if there are "
+         "any.\n");
+  printf("  --mem-limit=SIZE   Keep task records within SIZE bytes (K, M, G "
+         "suffixes)\n"
+         "                     by spilling sorted runs to $TMPDIR; slower, "
+         "for small\n"
+         "                     nodes with huge thread counts. Not with "
+         "--watch.\n");
+  printf("  --rescue           Work from static buffers only, for hosts "
+         "where malloc\n"
+         "                     fails (tree and ndjson outputs, at most "
+         "%d tasks).\n",
+         RESCUE_MAX_TASKS);
+  printf("  --query=QUERY      Print \"AGGS [by KEYS] [where COND [and "
+         "COND]...]\"\n"
+         "                     over the scanned tasks instead of any "
+         "output, e.g.\n"
+         "                     'sum(rss) by ns:pid,comm where "
+         "ns:user!=host'.\n");
+  printf("  --query-socket=PATH\n"
+         "                     In watch mode, answer such queries sent "
+         "line by line\n"
+         "                     to a Unix socket, from a snapshot taken "
+         "after each\n"
+         "                     tick, without ever delaying the next "
+         "one.\n");
+  printf("  --aggregate FILE...\n"
+         "                     Summarize ndjson snapshots from many hosts "
+         "into one\n"
+         "                     fleet report instead of scanning /proc.\n");
+  printf("  --jobs=N           Worker threads for --aggregate (default: "
+         "one per CPU).\n");
+  printf("  --watch[=MIN:MAX]  Keep polling /proc and re-render whenever "
+         "something\n"
+         "                     changed. The interval adapts to the churn "
+         "rate\n"
+         "                     between MIN and MAX seconds (default "
+         "0.25:2).\n");
+  printf("  --tui              Interactive full-screen tree fed by watch "
+         "mode, with\n"
+         "                     folding, live filters and sorting (press q "
+         "to quit).\n");
+  printf("  --ns-sample=N      In watch mode, re-read the namespaces of N "
+         "known\n"
+         "                     tasks per tick (default 64).\n");
+  printf("  --fd-cache=N       In watch mode, keep the /proc directory and "
+         "stat\n"
+         "                     descriptors of up to N tasks open between "
+         "ticks,\n"
+         "                     within RLIMIT_NOFILE (default 16384, 0 "
+         "disables).\n");
+  printf("  --checkpoint=FILE[:SECS]\n"
+         "                     In watch mode, save the task and namespace "
+         "tables\n"
+         "                     to FILE every SECS seconds (default 60) and "
+         "on\n"
+         "                     exit, and resume from it on the next start.\n");
+  printf("  --events[=DEST]    In watch mode, stream namespace creation and\n"
+         "                     destruction events as NDJSON to stdout (-, "
+         "the\n"
+         "                     default) or to clients of unix:PATH. Clients "
+         "may\n"
+         "                     send a line of types to subscribe to, or "
+         "\"where\n"
+         "                     COND...\" to have matching tasks pushed as "
+         "they\n"
+         "                     change.\n");
+  printf("  --event-types=LIST Only report events for these namespace "
+         "types,\n"
+         "                     e.g. net,user (default: all).\n\n");
   printf(
       "By default, if no --filter arguments are provided, the entire tree is "
       "shown.\n"
@@ -651,6 +9315,8 @@ static void print_usage(const char *argv0) {
  * Return: 0 on success, non-zero on error
  */
 int main(int argc, char *argv[]) {
+  int wantTop = 0;
+
   /* Simple argument parsing */
   for (int i = 1; i < argc; i++) {
     if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0) {
@@ -667,6 +9333,129 @@ int main(int argc, char *argv[]) {
     } else if (strcmp(argv[i], "--filter") == 0) {
       /* If user passed --filter with no type, treat it as wildcard "*" */
       g_filters[g_filterCount++] = "*";
+    } else if (strcmp(argv[i], "--tui") == 0) {
+      g_tui = 1;
+    } else if (strcmp(argv[i], "--watch") == 0) {
+      g_watch = 1;
+    } else if (strncmp(argv[i], "--watch=", 8) == 0) {
+      char *end;
+      g_watch = 1;
+      g_watchMin = strtod(argv[i] + 8, &end);
+      g_watchMax = (*end == ':') ? strtod(end + 1, &end) : g_watchMin;
+      if (*end || g_watchMin <= 0 || g_watchMax < g_watchMin) {
+        fprintf(stderr, "Invalid watch interval: %s\n", argv[i] + 8);
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--events") == 0 ||
+               strcmp(argv[i], "--events=-") == 0) {
+      g_eventStdout = 1;
+    } else if (strncmp(argv[i], "--events=unix:", 14) == 0 &&
+               argv[i][14]) {
+      g_eventSocketPath = argv[i] + 14;
+    } else if (strncmp(argv[i], "--checkpoint=", 13) == 0 &&
+               argv[i][13]) {
+      char *colon = strrchr(argv[i] + 13, ':');
+      if (colon) {
+        char *end;
+        *colon = '\0';
+        g_checkpointEvery = strtod(colon + 1, &end);
+        if (*end || !(g_checkpointEvery > 0) || !argv[i][13]) {
+          fprintf(stderr, "Invalid checkpoint interval: %s\n", colon + 1);
+          return 1;
+        }
+      }
+      g_checkpointPath = argv[i] + 13;
+    } else if (strncmp(argv[i], "--event-types=", 14) == 0) {
+      if (parse_ns_type_mask(argv[i] + 14, &g_eventTypeMask) != 0) {
+        fprintf(stderr, "Unknown namespace type in: %s\n", argv[i] + 14);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--fd-cache=", 11) == 0) {
+      char *end;
+      errno = 0;
+      g_fdCacheMax = strtoul(argv[i] + 11, &end, 10);
+      if (!isdigit((unsigned char)argv[i][11]) || *end || errno) {
+        fprintf(stderr, "Invalid fd cache size: %s\n", argv[i] + 11);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--ns-sample=", 12) == 0) {
+      char *end;
+      errno = 0;
+      g_nsSample = strtoul(argv[i] + 12, &end, 10);
+      if (!isdigit((unsigned char)argv[i][12]) || *end || errno) {
+        fprintf(stderr, "Invalid namespace sample size: %s\n", argv[i] + 12);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--sample=", 9) == 0) {
+      char *end;
+      g_sampleRate = strtod(argv[i] + 9, &end);
+      if (*end || !(g_sampleRate > 0.0 && g_sampleRate <= 1.0)) {
+        fprintf(stderr, "Invalid sample rate: %s\n", argv[i] + 9);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--top=", 6) == 0) {
+      if (parse_top(argv[i] + 6) != 0) {
+        fprintf(stderr, "Invalid --top (expected K[:tasks|rss|cpu]): %s\n",
+                argv[i] + 6);
+        return 1;
+      }
+      wantTop = 1;
+    } else if (strncmp(argv[i], "--sort=", 7) == 0) {
+      size_t o;
+      for (o = 0; o < sizeof(g_childOrderNames) / sizeof(g_childOrderNames[0]);
+           o++) {
+        if (strcmp(argv[i] + 7, g_childOrderNames[o]) == 0)
+          break;
+      }
+      if (o == sizeof(g_childOrderNames) / sizeof(g_childOrderNames[0])) {
+        fprintf(stderr, "Unknown child order: %s\n", argv[i] + 7);
+        return 1;
+      }
+      g_childOrder = (int)o;
+    } else if (strcmp(argv[i], "--rescue") == 0) {
+      g_rescue = 1;
+    } else if (strncmp(argv[i], "--mem-limit=", 12) == 0) {
+      if (parse_size(argv[i] + 12, &g_memLimit) != 0) {
+        fprintf(stderr, "Invalid memory limit: %s\n", argv[i] + 12);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--policy=", 9) == 0) {
+      if (load_policy(argv[i] + 9) != 0)
+        return 1;
+    } else if (strncmp(argv[i], "--group-by=", 11) == 0) {
+      if (parse_ns_type_mask(argv[i] + 11, &g_groupMask) != 0) {
+        fprintf(stderr, "Unknown namespace type in: %s\n", argv[i] + 11);
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--query=", 8) == 0) {
+      if (parse_query(argv[i] + 8) != 0)
+        return 1;
+    } else if (strncmp(argv[i], "--query-socket=", 15) == 0 &&
+               argv[i][15]) {
+      g_querySocketPath = argv[i] + 15;
+    } else if (strcmp(argv[i], "--aggregate") == 0) {
+      g_aggregate = 1;
+      g_aggFiles = calloc((size_t)argc, sizeof(*g_aggFiles));
+      if (!g_aggFiles) {
+        perror("calloc");
+        return 1;
+      }
+    } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      char *end;
+      errno = 0;
+      g_aggJobs = strtol(argv[i] + 7, &end, 10);
+      if (!isdigit((unsigned char)argv[i][7]) || *end || errno ||
+          g_aggJobs < 1) {
+        fprintf(stderr, "Invalid number of jobs: %s\n", argv[i] + 7);
+        return 1;
+      }
+    } else if (g_aggregate && argv[i][0] != '-') {
+      g_aggFiles[g_aggFileCount++] = argv[i];
+    } else if (strncmp(argv[i], "--output=", 9) == 0) {
+      if (add_sink(argv[i] + 9) != 0) {
+        print_usage(argv[0]);
+        return 1;
+      }
     } else {
       fprintf(stderr, "Unknown option: %s\n", argv[i]);
       print_usage(argv[0]);
@@ -674,28 +9463,227 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  gather_processes_and_threads();
-  build_process_tree();
+  /* Offline aggregation reads snapshots only, never /proc */
+  if (g_aggregate) {
+    if (!g_aggFileCount) {
+      fprintf(stderr, "--aggregate needs at least one snapshot file\n");
+      return 1;
+    }
+    int rc = run_aggregate();
+    free(g_aggFiles);
+    return rc;
+  }
 
-  if (g_unreadableFound) {
-	  fprintf(stderr, "Warning, namespaces that could not be read is marked with an asterisk. Run as root for full info.\n");
+  /* --top prints to stdout unless --output=top:FILE already takes it */
+  if (wantTop) {
+    int haveTop = 0;
+    for (size_t s = 0; s < g_sinkCount; s++)
+      haveTop |= (g_sinks[s].format->node == top_node);
+    if (!haveTop && add_sink("top") != 0)
+      return 1;
   }
 
-  /* Find PID 1 and print from there, marking keep first if filters are used */
-  for (size_t i = 0; i < g_procCount; i++) {
-    if (g_processes[i].pid == 1 && g_processes[i].isThread == 0) {
-      mark_keep_processes(&g_processes[i], NULL, 0);
-      print_tree(&g_processes[i], "", 1, NULL, 0);
-      break;
+  /* Likewise for --policy, whose rules cannot come from --output */
+  {
+    int havePolicy = 0;
+    for (size_t s = 0; s < g_sinkCount; s++)
+      havePolicy |= (g_sinks[s].format->node == policy_node);
+    if (havePolicy && !g_policyRuleCount) {
+      fprintf(stderr, "--output=policy needs --policy=FILE\n");
+      return 1;
+    }
+    if (g_policyRuleCount && !havePolicy && add_sink("policy") != 0)
+      return 1;
+  }
+
+  /* Likewise for --group-by, which joins on net,ipc (pods) by default */
+  {
+    int haveGroups = 0;
+    for (size_t s = 0; s < g_sinkCount; s++)
+      haveGroups |= (g_sinks[s].format->node == groups_node);
+    if (g_groupMask && !haveGroups && add_sink("groups") != 0)
+      return 1;
+    if (!g_groupMask && haveGroups)
+      parse_ns_type_mask("net,ipc", &g_groupMask);
+  }
+
+  if (g_sampleRate < 1.0) {
+    for (size_t s = 0; s < g_sinkCount; s++) {
+      if (!g_sinks[s].format->scalesSamples) {
+        fprintf(stderr, "--sample only works with the census and by-ns "
+                        "outputs\n");
+        return 1;
+      }
     }
+    if (g_sinkCount == 0)
+      add_sink("census");
+    /* Sampling is about threads, so they have to be scanned at all */
+    show_threads = 1;
+    g_sampleSeed = (unsigned long long)time(NULL) ^
+                   ((unsigned long long)getpid() << 32);
   }
 
-  /* Cleanup */
-  for (size_t i = 0; i < g_procCount; i++) {
-    if (g_processes[i].children)
-      free(g_processes[i].children);
+  if (g_tui) {
+    /* The TUI owns the terminal; other outputs must go to files */
+    for (size_t s = 0; s < g_sinkCount; s++) {
+      if (g_sinks[s].fd == STDOUT_FILENO) {
+        fprintf(stderr, "--tui cannot share stdout with --output\n");
+        return 1;
+      }
+    }
+    if (g_eventStdout) {
+      fprintf(stderr, "--tui cannot share stdout with --events\n");
+      return 1;
+    }
+    /* Refresh once a second unless --watch says otherwise */
+    if (!g_watch)
+      g_watchMin = g_watchMax = 1.0;
+    g_watch = 1;
+  }
+
+  if ((g_eventStdout || g_eventSocketPath) && !g_watch) {
+    fprintf(stderr, "--events requires --watch\n");
+    return 1;
+  }
+  if (g_checkpointPath && !g_watch) {
+    fprintf(stderr, "--checkpoint requires --watch\n");
+    return 1;
+  }
+  if (g_querySocketPath && !g_watch) {
+    fprintf(stderr, "--query-socket requires --watch\n");
+    return 1;
+  }
+
+  /* CPU rates are deltas, so they need a previous sample */
+  for (size_t s = 0; s < g_sinkCount; s++) {
+    g_cpuAccounting |= (g_sinks[s].format->node == cpu_node);
+    g_cpuAccounting |= (g_sinks[s].format->node == top_node &&
+                        g_topMetric == TOP_CPU);
+  }
+  if (g_cpuAccounting && !g_watch) {
+    fprintf(stderr, "CPU rates (--output=cpu, --top=K:cpu) require "
+                    "--watch\n");
+    return 1;
+  }
+
+  for (size_t s = 0; s < g_sinkCount; s++)
+    g_creatorTracking |= (g_sinks[s].format->node == creators_node);
+  if (g_creatorTracking && !g_watch) {
+    fprintf(stderr, "--output=creators requires --watch\n");
+    return 1;
+  }
+
+  if (g_query && (g_watch || g_memLimit || g_rescue || g_sinkCount ||
+                  g_eventStdout || g_eventSocketPath)) {
+    fprintf(stderr, "--query prints its own result and cannot be combined "
+                    "with --output, --watch, --tui, --events, --mem-limit "
+                    "or --rescue\n");
+    return 1;
+  }
+
+  /*
+   * Without any --output, behave like before: a tree on stdout. An event
+   * stream on its own does not need a tree rendered on every change.
+   */
+  if (g_sinkCount == 0 && !g_eventStdout && !g_eventSocketPath && !g_tui)
+    add_sink("tree");
+
+  if (g_memLimit) {
+    if (g_watch) {
+      fprintf(stderr, "--mem-limit cannot be combined with --watch or "
+                      "--tui\n");
+      return 1;
+    }
+    for (size_t s = 0; s < g_sinkCount; s++) {
+      if (!g_sinks[s].format->streamable) {
+        fprintf(stderr, "--mem-limit does not support the %s output\n",
+                g_sinks[s].format->name);
+        return 1;
+      }
+    }
+  }
+
+  if (g_rescue) {
+    if (g_watch || g_memLimit) {
+      fprintf(stderr, "--rescue is a one-shot mode without --watch, --tui "
+                      "or --mem-limit\n");
+      return 1;
+    }
+    /* Only formats without state of their own can stream from the arena */
+    for (size_t s = 0; s < g_sinkCount; s++) {
+      if (g_sinks[s].format->begin || g_sinks[s].format->end) {
+        fprintf(stderr, "--rescue does not support the %s output\n",
+                g_sinks[s].format->name);
+        return 1;
+      }
+      /* The static buffers cannot hold a whole rendering back */
+      if (g_sinks[s].shared) {
+        fprintf(stderr, "--rescue can send only one output to stdout\n");
+        return 1;
+      }
+    }
+    rescue_setup();
+  }
+
+  traversal_select();
+  g_queryPageKb = sysconf(_SC_PAGESIZE) / 1024;
+  int queryFailed = 0;
+  if (g_query) {
+    gather_processes_and_threads();
+    queryFailed = run_query();
+  } else if (g_watch) {
+    run_watch();
+  } else if (g_memLimit) {
+    run_spill();
+  } else {
+    gather_processes_and_threads();
+    build_process_tree();
+
+    if (g_unreadableFound) {
+	  fprintf(stderr, "Warning, namespaces that could not be read is marked with an asterisk. Run as root for full info.\n");
+    }
+
+    /*
+     * Find PID 1 and render from there, marking keep first if filters are
+     * used
+     */
+    ProcInfo *root = NULL;
+    for (size_t i = 0; i < g_procCount; i++) {
+      if (g_processes[i].pid == 1 && g_processes[i].isThread == 0) {
+        mark_keep_processes(&g_processes[i]);
+        root = &g_processes[i];
+        break;
+      }
+    }
+    render_all_sinks(root);
+  }
+
+  if (g_rescue) {
+    if (g_rescueDropped)
+      fprintf(stderr, "Warning, only %d tasks fit the rescue arena; %zu more "
+                      "(and their descendants) are not shown.\n",
+              RESCUE_MAX_TASKS, g_rescueDropped);
+    return 0; /* everything lives in static arrays */
   }
+
+  /* Cleanup */
+  free_process_tree();
+  free(g_childSlab);
   free(g_processes);
+  free(g_pidIndex.keys);
+  free(g_pidIndex.vals);
+  free(g_order);
+  free(g_orderTmp);
+  for (size_t s = 0; s < g_sinkCount; s++) {
+    free(g_sinks[s].buf);
+    if (g_sinks[s].fd != STDOUT_FILENO)
+      close(g_sinks[s].fd);
+  }
+  for (size_t g = 0; g < g_policyGlobCount; g++)
+    free(g_policyGlobs[g]);
 
-  return 0;
+  /* Policy violations in the last rendering fail the run */
+  if (queryFailed)
+    return 1;
+  return g_policyViolations ? 2 : 0;
 }